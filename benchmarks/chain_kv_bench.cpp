@@ -0,0 +1,319 @@
+// Benchmarks for chain_kv's hot paths. Each workload reports throughput, p50/p99 latency, and
+// heap allocations per operation. Run with --help for the workload parameters; database_config
+// options (e.g. --chain-kv-preset) are also accepted. Pass several --db-dir values to compare
+// storage, e.g. --db-dir /dev/shm/chain-kv-bench --db-dir /var/tmp/chain-kv-bench.
+
+#include <algorithm>
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <chain_kv/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+
+static std::atomic<uint64_t> num_allocs{ 0 };
+
+void* operator new(size_t size) {
+   ++num_allocs;
+   if (auto p = std::malloc(size ? size : 1))
+      return p;
+   throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+using chain_kv::bytes;
+using chain_kv::to_slice;
+using clock_type = std::chrono::steady_clock;
+
+struct bench_config {
+   std::vector<std::string> db_dirs              = { "chain-kv-bench-db" };
+   std::vector<std::string> workloads            = {};
+   uint64_t                 num_keys             = 100'000;
+   uint64_t                 ops                  = 100'000;
+   uint32_t                 key_size             = 16; // Within the view; at least 8
+   uint32_t                 min_value_size       = 32;
+   uint32_t                 max_value_size       = 256;
+   double                   hot_keys             = 0.01; // Fraction of keys in the hot set
+   double                   hot_ops              = 0;    // Fraction of operations on the hot set
+   uint32_t                 ops_per_session      = 1000; // Reads in one session hit its cache
+   uint32_t                 scan_length          = 100;
+   uint32_t                 undo_depth           = 100;
+   uint32_t                 changes_per_revision = 1000;
+   uint64_t                 seed                 = 1;
+};
+
+const std::vector<std::string> all_workloads = { "get",  "set",           "scan", "scan_uncached",
+                                                 "undo", "write_changes", "squash", "commit" };
+
+// Collects latencies for one workload. Only the timed sections count towards the results.
+class recorder {
+ private:
+   std::string            name;
+   std::vector<uint64_t>  latencies;
+   uint64_t               total_ns     = 0;
+   uint64_t               total_allocs = 0;
+   uint64_t               start_allocs = 0;
+   clock_type::time_point start_time;
+
+ public:
+   recorder(std::string name, uint64_t expected_ops) : name{ std::move(name) } { latencies.reserve(expected_ops); }
+
+   void start() {
+      start_allocs = num_allocs;
+      start_time   = clock_type::now();
+   }
+
+   void stop() {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start_time).count();
+      total_allocs += num_allocs - start_allocs;
+      total_ns += ns;
+      latencies.push_back(ns);
+   }
+
+   template <typename F>
+   void time(F&& f) {
+      start();
+      f();
+      stop();
+   }
+
+   void report(const std::string& db_dir) {
+      if (latencies.empty())
+         return;
+      std::sort(latencies.begin(), latencies.end());
+      auto percentile = [&](double p) {
+         return latencies[std::min(latencies.size() - 1, size_t(latencies.size() * p))];
+      };
+      printf("%-24s %-14s %10zu %14.0f %10.2f %10.2f %10.2f\n", db_dir.c_str(), name.c_str(), latencies.size(),
+             latencies.size() / (total_ns / 1e9), percentile(0.5) / 1e3, percentile(0.99) / 1e3,
+             double(total_allocs) / latencies.size());
+   }
+}; // recorder
+
+class workload {
+ private:
+   const bench_config&                     config;
+   std::mt19937_64                         rng;
+   std::uniform_int_distribution<uint32_t> value_size;
+   std::uniform_real_distribution<double>  unit{ 0, 1 };
+   uint64_t                                hot_count;
+   bytes                                   value_data;
+
+ public:
+   chain_kv::database   db;
+   chain_kv::undo_stack undo_stack;
+
+   workload(const bench_config& config, const std::string& db_dir, const chain_kv::database_config& db_config)
+       : config{ config }, rng{ config.seed }, value_size{ config.min_value_size, config.max_value_size },
+         hot_count{ std::max<uint64_t>(1, config.num_keys * config.hot_keys) }, value_data(config.max_value_size),
+         db{ db_dir.c_str(), true, db_config }, undo_stack{ db, { 0x10 } } {
+      for (auto& b : value_data) //
+         b = char(rng());
+   }
+
+   // Keys are big-endian indexes padded to key_size, so key order matches index order
+   void make_key(bytes& dest, uint64_t index) {
+      dest.assign(config.key_size, 0);
+      for (int i = 0; i < 8; ++i) //
+         dest[7 - i] = char(index >> (8 * i));
+   }
+
+   // Hot keys are spread through the keyspace, not clustered at the start
+   uint64_t choose_index() {
+      if (config.hot_ops > 0 && unit(rng) < config.hot_ops)
+         return (rng() % hot_count) * (config.num_keys / hot_count);
+      return rng() % config.num_keys;
+   }
+
+   rocksdb::Slice choose_value() { return { value_data.data(), value_size(rng) }; }
+
+   void load() {
+      bytes key;
+      for (uint64_t i = 0; i < config.num_keys;) {
+         chain_kv::write_session session{ db };
+         chain_kv::view          view{ session, bytes{ 0x70 } };
+         for (uint64_t j = 0; j < 10'000 && i < config.num_keys; ++j, ++i) {
+            make_key(key, i);
+            view.set(0, to_slice(key), choose_value());
+         }
+         session.write_changes(undo_stack);
+      }
+      db.flush(true, true);
+   }
+
+   // Push a revision containing changes_per_revision random changes
+   void push_revision() {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      bytes                   key;
+      undo_stack.push(false);
+      for (uint32_t i = 0; i < config.changes_per_revision; ++i) {
+         make_key(key, choose_index());
+         view.set(0, to_slice(key), choose_value());
+      }
+      session.write_changes(undo_stack);
+   }
+
+   void run(const std::string& name, const std::string& db_dir) {
+      bytes key;
+      if (name == "get" || name == "set") {
+         recorder r{ name, config.ops };
+         for (uint64_t i = 0; i < config.ops;) {
+            chain_kv::write_session session{ db };
+            chain_kv::view          view{ session, bytes{ 0x70 } };
+            for (uint32_t j = 0; j < config.ops_per_session && i < config.ops; ++j, ++i) {
+               make_key(key, choose_index());
+               if (name == "get") {
+                  r.time([&] { view.get(0, to_slice(key)); });
+               } else {
+                  auto value = choose_value();
+                  r.time([&] { view.set(0, to_slice(key), value); });
+               }
+            }
+            if (name == "set")
+               session.write_changes(undo_stack);
+         }
+         r.report(db_dir);
+      } else if (name == "scan" || name == "scan_uncached") {
+         auto     scans             = std::max<uint64_t>(1, config.ops / config.scan_length);
+         auto     scans_per_session = std::max<uint64_t>(1, config.ops_per_session / config.scan_length);
+         recorder r{ name, scans };
+         for (uint64_t i = 0; i < scans;) {
+            chain_kv::write_session session{ db };
+            chain_kv::view          view{ session, bytes{ 0x70 } };
+            for (uint64_t j = 0; j < scans_per_session && i < scans; ++j, ++i) {
+               make_key(key, choose_index());
+               r.time([&] {
+                  if (name == "scan")
+                     scan(chain_kv::view::iterator{ view, 0, {} }, key);
+                  else
+                     scan(chain_kv::view::scan_iterator{ view, 0, {} }, key);
+               });
+            }
+         }
+         r.report(db_dir);
+      } else if (name == "write_changes") {
+         auto     revisions = std::max<uint64_t>(1, config.ops / config.changes_per_revision);
+         recorder r{ name, revisions };
+         for (uint64_t i = 0; i < revisions; ++i) {
+            chain_kv::write_session session{ db };
+            chain_kv::view          view{ session, bytes{ 0x70 } };
+            undo_stack.push(false);
+            for (uint32_t j = 0; j < config.changes_per_revision; ++j) {
+               make_key(key, choose_index());
+               view.set(0, to_slice(key), choose_value());
+            }
+            r.time([&] { session.write_changes(undo_stack); });
+            if (undo_stack.revision() - undo_stack.first_revision() >= config.undo_depth)
+               undo_stack.commit(undo_stack.revision());
+         }
+         undo_stack.commit(undo_stack.revision());
+         r.report(db_dir);
+      } else if (name == "undo" || name == "squash" || name == "commit") {
+         auto revision_ops = uint64_t(config.undo_depth) * config.changes_per_revision;
+         auto rounds       = std::max<uint64_t>(1, config.ops / revision_ops);
+         recorder r{ name, rounds * config.undo_depth };
+         for (uint64_t round = 0; round < rounds; ++round) {
+            for (uint32_t i = 0; i < config.undo_depth; ++i) //
+               push_revision();
+            if (name == "undo") {
+               for (uint32_t i = 0; i < config.undo_depth; ++i) //
+                  r.time([&] { undo_stack.undo(); });
+            } else if (name == "squash") {
+               for (uint32_t i = 1; i < config.undo_depth; ++i) //
+                  r.time([&] { undo_stack.squash(); });
+               undo_stack.commit(undo_stack.revision());
+            } else {
+               for (auto rev = undo_stack.first_revision() + 1; rev <= undo_stack.revision(); ++rev)
+                  r.time([&] { undo_stack.commit(rev); });
+            }
+         }
+         r.report(db_dir);
+      } else {
+         throw std::runtime_error("unknown workload: " + name);
+      }
+   }
+
+   template <typename It>
+   void scan(It&& it, const bytes& key) {
+      it.lower_bound(key);
+      for (uint32_t i = 0; i < config.scan_length && !it.is_end(); ++i) //
+         ++it;
+   }
+}; // workload
+
+} // namespace
+
+int main(int argc, char** argv) {
+   namespace po = boost::program_options;
+   bench_config config;
+
+   po::options_description desc{ "Options" };
+   auto                    opt = desc.add_options();
+   opt("help", "Show this message");
+   opt("db-dir", po::value(&config.db_dirs)->multitoken(), "Database directories; each is erased and benchmarked");
+   opt("workload", po::value(&config.workloads)->multitoken(),
+       "get, set, scan, scan_uncached, undo, write_changes, squash, or commit; default is all");
+   opt("num-keys", po::value(&config.num_keys), "Keys loaded before the workloads run");
+   opt("ops", po::value(&config.ops), "Approximate key operations per workload");
+   opt("key-size", po::value(&config.key_size), "Key size within the view; at least 8");
+   opt("min-value-size", po::value(&config.min_value_size), "Values sizes are uniform between min and max");
+   opt("max-value-size", po::value(&config.max_value_size), "");
+   opt("hot-keys", po::value(&config.hot_keys), "Fraction of keys in the hot set");
+   opt("hot-ops", po::value(&config.hot_ops), "Fraction of operations on the hot set; 0 is uniform");
+   opt("ops-per-session", po::value(&config.ops_per_session),
+       "Operations per write_session; repeated reads within a session hit its cache");
+   opt("scan-length", po::value(&config.scan_length), "Keys per scan");
+   opt("undo-depth", po::value(&config.undo_depth), "Revisions on the undo stack for undo, squash, and commit");
+   opt("changes-per-revision", po::value(&config.changes_per_revision), "Keys changed in each revision");
+   opt("seed", po::value(&config.seed), "Random seed");
+   chain_kv::add_database_config_options(desc);
+
+   po::variables_map vm;
+   try {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+   } catch (std::exception& e) {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+   if (vm.count("help")) {
+      std::cout << desc << "\n";
+      return 0;
+   }
+   if (config.key_size < 8 || config.min_value_size > config.max_value_size || !config.num_keys ||
+       !config.scan_length || !config.ops_per_session || !config.undo_depth || !config.changes_per_revision) {
+      std::cerr << "invalid workload parameters\n";
+      return 1;
+   }
+   if (config.workloads.empty())
+      config.workloads = all_workloads;
+
+   try {
+      auto db_config = chain_kv::database_config_from_options(vm);
+      printf("%-24s %-14s %10s %14s %10s %10s %10s\n", "db-dir", "workload", "ops", "ops/s", "p50 us", "p99 us",
+             "allocs/op");
+      for (auto& db_dir : config.db_dirs) {
+         for (auto& name : config.workloads) {
+            // A fresh database per workload keeps earlier workloads from skewing later ones
+            boost::filesystem::remove_all(db_dir);
+            workload w{ config, db_dir, db_config };
+            w.load();
+            w.run(name, db_dir);
+         }
+         boost::filesystem::remove_all(db_dir);
+      }
+   } catch (std::exception& e) {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chain_kv/chain_kv.hpp>
+#include <rocksdb/utilities/backup_engine.h>
+
+namespace chain_kv {
+
+struct backup_info {
+   uint32_t id        = 0;
+   int64_t  timestamp = 0; // Seconds since the epoch
+   uint64_t size      = 0;
+   uint32_t num_files = 0;
+   int64_t  revision  = 0; // undo_stack's revision when the backup was created
+};
+
+// Incremental backups. Backups in the same directory share sst files, so each backup only
+// copies the files created since the previous one.
+class backup_engine {
+ private:
+   std::unique_ptr<rocksdb::BackupEngine> engine;
+
+ public:
+   // threads copies files in parallel; 0 is hardware concurrency
+   explicit backup_engine(const std::string& backup_dir, uint32_t threads = 0) {
+      rocksdb::BackupEngineOptions options{ backup_dir };
+      options.share_table_files         = true;
+      options.max_background_operations = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+      rocksdb::BackupEngine* p          = nullptr;
+      check(rocksdb::BackupEngine::Open(options, rocksdb::Env::Default(), &p),
+            "backup_engine::backup_engine: rocksdb::BackupEngine::Open: ");
+      engine.reset(p);
+   }
+
+   // Back up the database, recording undo's revision. The memtables are flushed first, since
+   // the WAL is usually disabled. Returns the backup's id.
+   uint32_t create_backup(database& db, undo_stack& undo) {
+      undo.write_state();
+      db.wait_for_writes();
+      check(engine->CreateNewBackupWithMetadata(db.rdb.get(), undo_stack::revision_metadata(undo.revision()), true),
+            "backup_engine::create_backup: rocksdb::BackupEngine::CreateNewBackupWithMetadata: ");
+      return backups().back().id;
+   }
+
+   // Oldest first
+   std::vector<backup_info> backups() {
+      std::vector<rocksdb::BackupInfo> infos;
+      engine->GetBackupInfo(&infos);
+      std::vector<backup_info> result;
+      for (auto& info : infos)
+         result.push_back({ info.backup_id, info.timestamp, info.size, info.number_files,
+                            undo_stack::parse_revision_metadata(info.app_metadata) });
+      return result;
+   }
+
+   // Check that the backup's files exist and have the expected sizes
+   void verify_backup(uint32_t id) {
+      check(engine->VerifyBackup(id), "backup_engine::verify_backup: rocksdb::BackupEngine::VerifyBackup: ");
+   }
+
+   void delete_backup(uint32_t id) {
+      check(engine->DeleteBackup(id), "backup_engine::delete_backup: rocksdb::BackupEngine::DeleteBackup: ");
+   }
+
+   // Delete all but the newest `keep` backups. sst files are removed once no backup uses them.
+   void purge_old_backups(uint32_t keep) {
+      check(engine->PurgeOldBackups(keep),
+            "backup_engine::purge_old_backups: rocksdb::BackupEngine::PurgeOldBackups: ");
+   }
+
+   // Replace the database in db_dir, which must not be open, with a backup. Restores the
+   // newest backup if id is nullopt.
+   void restore(const std::string& db_dir, std::optional<uint32_t> id = {}) {
+      if (id)
+         check(engine->RestoreDBFromBackup(*id, db_dir, db_dir),
+               "backup_engine::restore: rocksdb::BackupEngine::RestoreDBFromBackup: ");
+      else
+         check(engine->RestoreDBFromLatestBackup(db_dir, db_dir),
+               "backup_engine::restore: rocksdb::BackupEngine::RestoreDBFromLatestBackup: ");
+   }
+}; // backup_engine
+
+} // namespace chain_kv
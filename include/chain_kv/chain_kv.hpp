@@ -1,10 +1,43 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fc/io/raw.hpp>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <rocksdb/cache.h>
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/perf_context.h>
+#include <rocksdb/perf_level.h>
+#include <rocksdb/rate_limiter.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/statistics.h>
 #include <rocksdb/table.h>
+#include <rocksdb/utilities/checkpoint.h>
+#include <rocksdb/utilities/table_properties_collectors.h>
+#include <set>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <zlib.h>
+
+#ifdef CHAIN_KV_HAVE_ZSTD
+#   include <zstd.h>
+#endif
+
+#ifdef CHAIN_KV_HAVE_LZ4
+#   include <lz4.h>
+#endif
 
 namespace chain_kv {
 
@@ -27,6 +60,230 @@ inline void check(rocksdb::Status s, const char* prefix) {
       throw exception(prefix + s.ToString());
 }
 
+// Instrumentation. Define CHAIN_KV_METRICS to collect it; otherwise the hooks compile to
+// nothing. Each thread updates its own counters, so recording is an uncontended relaxed
+// load and store. Counters are process-wide; database::stats() takes a snapshot.
+enum class metric : uint8_t {
+   get_cache_hits,        // write_session::get and get_many found the key in the session or its parents
+   get_read_cache_hits,   // ... in the shared read_cache
+   get_db_reads,          // ... had to read rocksdb
+   iterator_steps,        // view::iterator and view::scan_iterator moves
+   iterator_fill_cache,   // Entries view::iterator copied from rocksdb into a session's cache
+   sessions_wiped,        // write_session::wipe_cache calls, including those by write_changes
+   session_cache_entries, // Total cache_map entries in sessions when they were wiped
+   session_cache_bytes,   // Total arena bytes in sessions when they were wiped
+   undo_revision_writes,  // undo_stack::write_changes calls
+   undo_segments,         // Undo segments written
+   undo_segment_bytes,    // Undo segment bytes written, after compression
+   db_writes,             // database::write and write_async batches
+   db_write_bytes,
+   wal_syncs,             // database::sync_wal calls
+   undo_compactions,      // Background compactions of undo ranges removed by commit() and squash()
+   num_metrics,
+};
+
+enum class latency : uint8_t {
+   db_write,      // database::write and write_async batches
+   write_changes, // write_session::write_changes, including building the undo segments
+   undo,          // undo_stack::undo
+   wal_sync,      // database::sync_wal
+   undo_compaction,
+   num_latencies,
+};
+
+inline const char* metric_name(metric m) {
+   static constexpr const char* names[] = { "get_cache_hits",
+                                            "get_read_cache_hits",
+                                            "get_db_reads",
+                                            "iterator_steps",
+                                            "iterator_fill_cache",
+                                            "sessions_wiped",
+                                            "session_cache_entries",
+                                            "session_cache_bytes",
+                                            "undo_revision_writes",
+                                            "undo_segments",
+                                            "undo_segment_bytes",
+                                            "db_writes",
+                                            "db_write_bytes",
+                                            "wal_syncs",
+                                            "undo_compactions" };
+   static_assert(std::size(names) == size_t(metric::num_metrics));
+   return names[size_t(m)];
+}
+
+inline const char* latency_name(latency l) {
+   static constexpr const char* names[] = { "db_write", "write_changes", "undo", "wal_sync", "undo_compaction" };
+   static_assert(std::size(names) == size_t(latency::num_latencies));
+   return names[size_t(l)];
+}
+
+// Latencies in power-of-2 nanosecond buckets. Bucket i holds [2^(i-1), 2^i).
+struct histogram {
+   static constexpr size_t num_buckets = 64;
+
+   std::array<uint64_t, num_buckets> buckets  = {};
+   uint64_t                          count    = 0;
+   uint64_t                          total_ns = 0;
+
+   // Upper bound of the bucket holding percentile p (0 - 1)
+   uint64_t percentile_ns(double p) const {
+      uint64_t target = count * p, seen = 0;
+      for (size_t i = 0; i < num_buckets; ++i) {
+         seen += buckets[i];
+         if (seen > target)
+            return i < 63 ? uint64_t(1) << i : ~uint64_t(0);
+      }
+      return 0;
+   }
+};
+
+struct stats_snapshot {
+   std::array<uint64_t, size_t(metric::num_metrics)>     counters           = {};
+   std::array<histogram, size_t(latency::num_latencies)> latencies          = {};
+   std::string                                           rocksdb_statistics = {}; // Empty unless enabled in config
+
+   uint64_t         operator[](metric m) const { return counters[size_t(m)]; }
+   const histogram& operator[](latency l) const { return latencies[size_t(l)]; }
+
+   std::string to_string() const {
+      std::string result;
+      for (size_t i = 0; i < counters.size(); ++i)
+         result += std::string(metric_name(metric(i))) + " " + std::to_string(counters[i]) + "\n";
+      for (size_t i = 0; i < latencies.size(); ++i) {
+         auto& h = latencies[i];
+         result += std::string(latency_name(latency(i))) + " count " + std::to_string(h.count) + " total_ns " +
+                   std::to_string(h.total_ns) + " p50_ns " + std::to_string(h.percentile_ns(0.5)) + " p99_ns " +
+                   std::to_string(h.percentile_ns(0.99)) + "\n";
+      }
+      return result + rocksdb_statistics;
+   }
+};
+
+namespace metrics_detail {
+
+   struct thread_metrics;
+
+   struct registry {
+      std::mutex                mutex;
+      std::set<thread_metrics*> threads;
+      stats_snapshot            exited; // From threads which have exited
+   };
+
+   inline registry& get_registry() {
+      static registry r;
+      return r;
+   }
+
+   struct thread_metrics {
+      using bucket_array = std::array<std::atomic<uint64_t>, histogram::num_buckets>;
+
+      std::array<std::atomic<uint64_t>, size_t(metric::num_metrics)>    counters = {};
+      std::array<bucket_array, size_t(latency::num_latencies)>          buckets  = {};
+      std::array<std::atomic<uint64_t>, size_t(latency::num_latencies)> total_ns = {};
+
+      thread_metrics() {
+         auto&           r = get_registry();
+         std::lock_guard lock{ r.mutex };
+         r.threads.insert(this);
+      }
+
+      ~thread_metrics() {
+         auto&           r = get_registry();
+         std::lock_guard lock{ r.mutex };
+         add_to(r.exited);
+         r.threads.erase(this);
+      }
+
+      void add_to(stats_snapshot& dest) const {
+         for (size_t i = 0; i < counters.size(); ++i) //
+            dest.counters[i] += counters[i].load(std::memory_order_relaxed);
+         for (size_t i = 0; i < buckets.size(); ++i) {
+            auto& h = dest.latencies[i];
+            for (size_t j = 0; j < histogram::num_buckets; ++j) {
+               auto n = buckets[i][j].load(std::memory_order_relaxed);
+               h.buckets[j] += n;
+               h.count += n;
+            }
+            h.total_ns += total_ns[i].load(std::memory_order_relaxed);
+         }
+      }
+   };
+
+   inline thread_metrics& local() {
+      thread_local thread_metrics m;
+      return m;
+   }
+
+   // Only the owning thread writes, so this doesn't need an atomic read-modify-write
+   inline void add(std::atomic<uint64_t>& a, uint64_t n) {
+      a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+   }
+
+} // namespace metrics_detail
+
+inline void add_metric([[maybe_unused]] metric m, [[maybe_unused]] uint64_t n = 1) {
+#ifdef CHAIN_KV_METRICS
+   metrics_detail::add(metrics_detail::local().counters[size_t(m)], n);
+#endif
+}
+
+// Records the time from construction to destruction
+class latency_timer {
+#ifdef CHAIN_KV_METRICS
+   latency                               l;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+ public:
+   explicit latency_timer(latency l) : l{ l } {}
+
+   ~latency_timer() {
+      auto   elapsed = std::chrono::steady_clock::now() - start;
+      auto   ns      = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+      size_t bucket  = 0;
+      while (bucket < histogram::num_buckets - 1 && (uint64_t(1) << bucket) <= ns) //
+         ++bucket;
+      auto& m = metrics_detail::local();
+      metrics_detail::add(m.buckets[size_t(l)][bucket], 1);
+      metrics_detail::add(m.total_ns[size_t(l)], ns);
+   }
+#else
+ public:
+   explicit latency_timer(latency) {}
+#endif
+}; // latency_timer
+
+// Sum of every thread's metrics. All zero unless built with CHAIN_KV_METRICS.
+inline stats_snapshot get_metrics() {
+   auto&           r = metrics_detail::get_registry();
+   std::lock_guard lock{ r.mutex };
+   stats_snapshot  result = r.exited;
+   for (auto* t : r.threads) //
+      t->add_to(result);
+   return result;
+}
+
+// Enables rocksdb's PerfContext on this thread while it exists. Wrapping a session's work
+// in one shows how much of that work's time was spent inside rocksdb.
+class perf_scope {
+   rocksdb::PerfLevel prev_level;
+
+ public:
+   explicit perf_scope(rocksdb::PerfLevel level = rocksdb::PerfLevel::kEnableTimeExceptForMutex)
+       : prev_level{ rocksdb::GetPerfLevel() } {
+      rocksdb::SetPerfLevel(level);
+      rocksdb::get_perf_context()->Reset();
+   }
+
+   perf_scope(const perf_scope&) = delete;
+   perf_scope& operator=(const perf_scope&) = delete;
+
+   ~perf_scope() { rocksdb::SetPerfLevel(prev_level); }
+
+   const rocksdb::PerfContext& context() const { return *rocksdb::get_perf_context(); }
+
+   std::string to_string() const { return rocksdb::get_perf_context()->ToString(true); }
+}; // perf_scope
+
 using bytes = std::vector<char>;
 
 inline rocksdb::Slice to_slice(const bytes& v) { return { v.data(), v.size() }; }
@@ -39,7 +296,7 @@ inline std::shared_ptr<bytes> to_shared_bytes(const rocksdb::Slice& v) {
 
 // Bypasses fc's vector size limit
 template <typename Stream>
-void pack_bytes(Stream& s, const bytes& b) {
+void pack_bytes(Stream& s, const rocksdb::Slice& b) {
    fc::unsigned_int size(b.size());
    if (size.value != b.size())
       throw exception("bytes is too big");
@@ -47,6 +304,11 @@ void pack_bytes(Stream& s, const bytes& b) {
    s.write(b.data(), b.size());
 }
 
+template <typename Stream>
+void pack_bytes(Stream& s, const bytes& b) {
+   pack_bytes(s, to_slice(b));
+}
+
 template <typename Stream>
 void pack_optional_bytes(Stream& s, const bytes* b) {
    fc::raw::pack(s, bool(b));
@@ -54,6 +316,13 @@ void pack_optional_bytes(Stream& s, const bytes* b) {
       pack_bytes(s, *b);
 }
 
+template <typename Stream>
+void pack_optional_bytes(Stream& s, const std::optional<rocksdb::Slice>& b) {
+   fc::raw::pack(s, bool(b));
+   if (b)
+      pack_bytes(s, *b);
+}
+
 template <typename Stream>
 std::pair<const char*, size_t> get_bytes(Stream& s) {
    fc::unsigned_int size;
@@ -128,334 +397,2393 @@ bytes create_full_key(const bytes& prefix, uint64_t contract, const T& key) {
    return result;
 }
 
-struct database {
-   std::unique_ptr<rocksdb::DB> rdb;
+// Like create_full_key, for several keys. The keys are stored back to back in `dest`, which
+// the result points into.
+inline std::vector<rocksdb::Slice> create_full_keys(bytes& dest, const bytes& prefix, uint64_t contract,
+                                                    const std::vector<rocksdb::Slice>& keys) {
+   size_t total = 0;
+   for (auto& k : keys) //
+      total += prefix.size() + sizeof(contract) + k.size();
+   dest.clear();
+   dest.reserve(total);
+   for (auto& k : keys) {
+      dest.insert(dest.end(), prefix.begin(), prefix.end());
+      append_key(dest, contract);
+      dest.insert(dest.end(), k.data(), k.data() + k.size());
+   }
+   std::vector<rocksdb::Slice> result;
+   result.reserve(keys.size());
+   size_t pos = 0;
+   for (auto& k : keys) {
+      auto size = prefix.size() + sizeof(contract) + k.size();
+      result.emplace_back(dest.data() + pos, size);
+      pos += size;
+   }
+   return result;
+}
 
-   database(const char* db_path, bool create_if_missing, std::optional<uint32_t> threads = {},
-            std::optional<int> max_open_files = {}) {
+// Holds a key built from parts, e.g. prefix, big-endian contract, and user key (see
+// create_full_key). Short keys stay in inline storage, so lookups don't allocate.
+class key_buffer {
+   static constexpr size_t inline_capacity = 96;
 
-      rocksdb::Options options;
-      options.create_if_missing                    = create_if_missing;
-      options.level_compaction_dynamic_level_bytes = true;
-      options.bytes_per_sync                       = 1048576;
+   char   inline_data[inline_capacity];
+   bytes  heap_data;
+   char*  ptr = inline_data;
+   size_t len = 0;
 
-      if (threads)
-         options.IncreaseParallelism(*threads);
+   void append(const char* data, size_t size) {
+      memcpy(ptr + len, data, size);
+      len += size;
+   }
 
-      options.OptimizeLevelStyleCompaction(256ull << 20);
+   void reserve(size_t size) {
+      if (size > inline_capacity) {
+         heap_data.resize(size);
+         ptr = heap_data.data();
+      }
+   }
 
-      if (max_open_files)
-         options.max_open_files = *max_open_files;
+ public:
+   template <typename T>
+   key_buffer(const bytes& prefix, uint64_t contract, const T& key) {
+      reserve(prefix.size() + sizeof(contract) + key.size());
+      append(prefix.data(), prefix.size());
+      char buf[sizeof(contract)];
+      memcpy(buf, &contract, sizeof(contract));
+      std::reverse(std::begin(buf), std::end(buf));
+      append(buf, sizeof(buf));
+      append(key.data(), key.size());
+   }
 
-      rocksdb::BlockBasedTableOptions table_options;
-      table_options.format_version               = 4;
-      table_options.index_block_restart_interval = 16;
-      options.table_factory.reset(NewBlockBasedTableFactory(table_options));
+   key_buffer(const char* a, size_t a_size, const char* b, size_t b_size) {
+      reserve(a_size + b_size);
+      append(a, a_size);
+      append(b, b_size);
+   }
 
-      rocksdb::DB* p;
-      check(rocksdb::DB::Open(options, db_path, &p), "database::database: rocksdb::DB::Open: ");
-      rdb.reset(p);
+   key_buffer(const key_buffer&) = delete;
+   key_buffer& operator=(const key_buffer&) = delete;
 
-      // Sentinels with keys 0x00 and 0xff simplify iteration logic.
-      // Views have prefixes which must start with a byte within the range 0x01 - 0xfe.
-      rocksdb::WriteBatch batch;
-      bool                modified       = false;
-      auto                write_sentinal = [&](const bytes& k) {
-         rocksdb::PinnableSlice v;
-         auto                   stat = rdb->Get(rocksdb::ReadOptions(), rdb->DefaultColumnFamily(), to_slice(k), &v);
-         if (stat.IsNotFound()) {
-            check(batch.Put(to_slice(k), {}), "database::database: rocksdb::WriteBatch::Put: ");
-            modified = true;
-         } else {
-            check(stat, "database::database: rocksdb::DB::Get: ");
-         }
-      };
-      write_sentinal({ 0x00 });
-      write_sentinal({ (char)0xff });
-      if (modified)
-         write(batch);
+   const char* data() const { return ptr; }
+   size_t      size() const { return len; }
+};
+
+inline rocksdb::Slice to_slice(const key_buffer& k) { return { k.data(), k.size() }; }
+
+// Bump allocator. Memory is only released by clear() or destruction, which
+// invalidate everything allocated from the arena.
+class arena {
+ private:
+   struct block {
+      std::unique_ptr<char[]> data;
+      size_t                  size;
+   };
+
+   size_t             block_size;
+   std::vector<block> blocks;
+   char*              pos            = nullptr;
+   char*              end            = nullptr;
+   size_t             bytes_in_use   = 0;
+   size_t             bytes_reserved = 0;
+
+   char* add_block(size_t size) {
+      blocks.push_back(block{ std::make_unique<char[]>(size), size });
+      bytes_reserved += size;
+      return blocks.back().data.get();
    }
 
-   database(database&&) = default;
-   database& operator=(database&&) = default;
+   static char* align_up(char* p, size_t align) {
+      return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~uintptr_t(align - 1));
+   }
 
-   void flush(bool allow_write_stall, bool wait) {
-      rocksdb::FlushOptions op;
-      op.allow_write_stall = allow_write_stall;
-      op.wait              = wait;
-      rdb->Flush(op);
+ public:
+   arena(size_t block_size = 64 * 1024) : block_size{ block_size } {}
+   arena(const arena&) = delete;
+   arena& operator=(const arena&) = delete;
+
+   // `align` must be a power of 2 no greater than alignof(std::max_align_t)
+   void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+      if (pos) {
+         auto p = align_up(pos, align);
+         if (p <= end && size <= size_t(end - p)) {
+            pos = p + size;
+            bytes_in_use += size;
+            return p;
+         }
+      }
+
+      // Large allocations get their own block so they don't waste the rest of the current one
+      bytes_in_use += size;
+      if (size > block_size / 4)
+         return add_block(size);
+      pos = add_block(block_size);
+      end = pos + block_size;
+      auto p = pos;
+      pos += size;
+      return p;
    }
 
-   void write(rocksdb::WriteBatch& batch) {
-      rocksdb::WriteOptions opt;
-      opt.disableWAL = true;
-      check(rdb->Write(opt, &batch), "database::write: rocksdb::DB::Write (batch)");
-      batch.Clear();
+   // Copy data into the arena
+   rocksdb::Slice copy(const rocksdb::Slice& v) {
+      if (v.empty())
+         return {};
+      auto p = static_cast<char*>(allocate(v.size(), 1));
+      memcpy(p, v.data(), v.size());
+      return { p, v.size() };
    }
-}; // database
 
-struct key_value {
-   rocksdb::Slice key   = {};
-   rocksdb::Slice value = {};
-};
+   // Release everything. Keeps one standard-sized block for reuse.
+   void clear() {
+      auto it = std::find_if(blocks.begin(), blocks.end(), [&](auto& b) { return b.size == block_size; });
+      if (it == blocks.end()) {
+         blocks.clear();
+         pos = end = nullptr;
+      } else {
+         auto b = std::move(*it);
+         blocks.clear();
+         blocks.push_back(std::move(b));
+         pos = blocks.back().data.get();
+         end = pos + block_size;
+      }
+      bytes_in_use   = 0;
+      bytes_reserved = blocks.empty() ? 0 : block_size;
+   }
 
-inline int compare_key(const std::optional<key_value>& a, const std::optional<key_value>& b) {
-   // nullopt represents end; everything else is before end
-   if (!a && !b)
-      return 0;
-   else if (!a && b)
-      return 1;
-   else if (a && !b)
-      return -1;
-   else
-      return compare_blob(a->key, b->key);
-}
+   // Bytes handed out by allocate() since the last clear()
+   size_t used() const { return bytes_in_use; }
 
-inline int compare_value(const std::shared_ptr<const bytes>& a, const std::shared_ptr<const bytes>& b) {
-   // nullptr represents erased; everything else, including empty, is after erased
-   if (!a && !b)
-      return 0;
-   else if (!a && b)
-      return -1;
-   else if (a && !b)
-      return 1;
-   else
-      return compare_blob(*a, *b);
-}
+   // Bytes held in blocks
+   size_t reserved() const { return bytes_reserved; }
+}; // arena
 
-using cache_map = std::map<bytes, struct cached_value, less_blob>;
+// Allocator for std containers which allocates from an arena. deallocate() is a no-op;
+// memory is reclaimed by arena::clear().
+template <typename T>
+struct arena_allocator {
+   using value_type = T;
 
-// The cache serves these needs:
-//    * Keep track of changes that need to be written to rocksdb
-//    * Support reading writes
-//    * Support iteration logic
-struct cached_value {
-   uint64_t                     num_erases       = 0; // For iterator invalidation
-   std::shared_ptr<const bytes> orig_value       = {};
-   std::shared_ptr<const bytes> current_value    = {};
-   bool                         in_change_list   = false;
-   cache_map::iterator          change_list_next = {};
-};
+   chain_kv::arena* arena;
 
-struct undo_state {
-   uint8_t               format_version    = 0;
-   int64_t               revision          = 0;
-   std::vector<uint64_t> undo_stack        = {}; // Number of undo segments needed to go back each revision
-   uint64_t              next_undo_segment = 0;
-};
+   arena_allocator(chain_kv::arena& arena) : arena{ &arena } {}
 
-template <typename Stream>
-void pack_undo_segment(Stream& s, const bytes& key, const bytes* old_value, const bytes* new_value) {
-   pack_bytes(s, key);
-   pack_optional_bytes(s, old_value);
-   pack_optional_bytes(s, new_value);
-}
+   template <typename U>
+   arena_allocator(const arena_allocator<U>& other) : arena{ other.arena } {}
 
-class undo_stack {
+   T*   allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+   void deallocate(T*, size_t) {}
+
+   template <typename U>
+   friend bool operator==(const arena_allocator& a, const arena_allocator<U>& b) {
+      return a.arena == b.arena;
+   }
+
+   template <typename U>
+   friend bool operator!=(const arena_allocator& a, const arena_allocator<U>& b) {
+      return a.arena != b.arena;
+   }
+};
+
+// Size-bounded LRU cache of committed key-values, shared by the write_sessions of a
+// database. Also caches keys which don't exist. Thread safe.
+//
+// undo_stack keeps the cache coherent with its own writes. Anything else which writes
+// to keys in the cache must call erase() after writing.
+class read_cache {
  private:
-   database&  db;
-   bytes      undo_prefix;
-   uint64_t   target_segment_size;
-   bytes      state_prefix;
-   bytes      segment_prefix;
-   bytes      segment_next_prefix;
-   undo_state state;
+   struct entry;
+   using entry_map = std::map<bytes, entry, less_blob>;
 
- public:
-   undo_stack(database& db, const bytes& undo_prefix, uint64_t target_segment_size = 64 * 1024 * 1024)
-       : db{ db }, undo_prefix{ undo_prefix }, target_segment_size{ target_segment_size } {
-      if (this->undo_prefix.empty())
-         throw exception("undo_prefix is empty");
+   struct entry {
+      std::optional<bytes>                     value;
+      std::list<entry_map::iterator>::iterator lru_pos;
+   };
 
-      // Sentinels reserve 0x00 and 0xff. This keeps rocksdb iterators from going
-      // invalid during iteration.
-      if (this->undo_prefix[0] == 0x00 || this->undo_prefix[0] == (char)0xff)
-         throw exception("undo_stack may not have a prefix which begins with 0x00 or 0xff");
+   struct shard {
+      std::mutex                     mutex;
+      entry_map                      entries;
+      std::list<entry_map::iterator> lru; // Most-recently used at front
+      size_t                         size       = 0;
+      uint64_t                       generation = 0; // Bumped by writes; see begin_read()
+   };
 
-      state_prefix = this->undo_prefix;
-      state_prefix.push_back(0x00);
-      segment_prefix = this->undo_prefix;
-      segment_prefix.push_back(0x80);
-      segment_next_prefix = get_next_prefix(segment_prefix);
+   // Rough per-entry overhead of map node, list node, and bytes
+   static constexpr size_t entry_overhead = 128;
 
-      rocksdb::PinnableSlice v;
-      auto stat = db.rdb->Get(rocksdb::ReadOptions(), db.rdb->DefaultColumnFamily(), to_slice(this->state_prefix), &v);
-      if (!stat.IsNotFound())
-         check(stat, "undo_stack::undo_stack: rocksdb::DB::Get: ");
-      if (stat.ok()) {
-         auto format_version = fc::raw::unpack<uint8_t>(v.data(), v.size());
-         if (format_version)
-            throw exception("invalid undo format");
-         state = fc::raw::unpack<undo_state>(v.data(), v.size());
-      }
+   size_t                   max_shard_size;
+   std::unique_ptr<shard[]> shards;
+   size_t                   num_shards;
+   std::atomic<uint64_t>    num_hits   = 0;
+   std::atomic<uint64_t>    num_misses = 0;
+
+   shard& get_shard(const rocksdb::Slice& key) {
+      return shards[std::hash<std::string_view>{}({ key.data(), key.size() }) % num_shards];
    }
 
-   int64_t revision() const { return state.revision; }
-   int64_t first_revision() const { return state.revision - state.undo_stack.size(); }
+   static size_t entry_size(const rocksdb::Slice& key, const std::optional<rocksdb::Slice>& value) {
+      return key.size() + (value ? value->size() : 0) + entry_overhead;
+   }
 
-   void set_revision(uint64_t revision, bool write_now = true) {
-      if (state.undo_stack.size() != 0)
-         throw exception("cannot set revision while there is an existing undo stack");
-      if (revision > std::numeric_limits<int64_t>::max())
-         throw exception("revision to set is too high");
-      if (revision < state.revision)
-         throw exception("revision cannot decrease");
-      state.revision = revision;
-      if (write_now)
-         write_state();
+   static size_t entry_size(const entry_map::iterator& it) {
+      return it->first.size() + (it->second.value ? it->second.value->size() : 0) + entry_overhead;
    }
 
-   // Create a new entry on the undo stack
-   void push(bool write_now = true) {
-      state.undo_stack.push_back(0);
-      ++state.revision;
-      if (write_now)
-         write_state();
+   void remove(shard& sh, entry_map::iterator it) {
+      sh.size -= entry_size(it);
+      sh.lru.erase(it->second.lru_pos);
+      sh.entries.erase(it);
    }
 
-   // Combine the top two states on the undo stack
-   void squash(bool write_now = true) {
-      if (state.undo_stack.empty()) {
-         return;
-      } else if (state.undo_stack.size() == 1) {
-         rocksdb::WriteBatch batch;
-         check(batch.DeleteRange(to_slice(create_segment_key(0)), to_slice(create_segment_key(state.next_undo_segment))),
-               "undo_stack::squash: rocksdb::WriteBatch::DeleteRange: ");
-         state.undo_stack.clear();
-         --state.revision;
-         write_state(batch);
-         db.write(batch);
-         return;
-      }
-      auto n = state.undo_stack.back();
-      state.undo_stack.pop_back();
-      state.undo_stack.back() += n;
-      --state.revision;
-      if (write_now)
-         write_state();
+ public:
+   read_cache(size_t max_size, size_t num_shards = 16)
+       : max_shard_size{ max_size / num_shards }, shards{ std::make_unique<shard[]>(num_shards) }, num_shards{
+            num_shards
+         } {
+      if (!num_shards)
+         throw exception("read_cache needs at least 1 shard");
+   }
+
+   // Calls f(const std::optional<rocksdb::Slice>&) and returns true if key is cached;
+   // nullopt means the key doesn't exist. f runs while the shard is locked.
+   template <typename F>
+   bool get(const rocksdb::Slice& key, F&& f) {
+      auto&                       sh = get_shard(key);
+      std::lock_guard<std::mutex> lock{ sh.mutex };
+      auto                        it = sh.entries.find(key);
+      if (it == sh.entries.end()) {
+         ++num_misses;
+         return false;
+      }
+      ++num_hits;
+      sh.lru.splice(sh.lru.begin(), sh.lru, it->second.lru_pos);
+      std::optional<rocksdb::Slice> value;
+      if (it->second.value)
+         value = to_slice(*it->second.value);
+      f(std::as_const(value));
+      return true;
+   }
+
+   // Call before reading key from rocksdb; pass the result to put(). This keeps a
+   // reader from caching a value which a concurrent write already replaced.
+   uint64_t begin_read(const rocksdb::Slice& key) {
+      auto&                       sh = get_shard(key);
+      std::lock_guard<std::mutex> lock{ sh.mutex };
+      return sh.generation;
+   }
+
+   // Cache a value read from rocksdb
+   void put(const rocksdb::Slice& key, const std::optional<rocksdb::Slice>& value, uint64_t generation) {
+      auto size = entry_size(key, value);
+      if (size > max_shard_size)
+         return;
+      auto&                       sh = get_shard(key);
+      std::lock_guard<std::mutex> lock{ sh.mutex };
+      if (sh.generation != generation)
+         return;
+      auto it = sh.entries.find(key);
+      if (it != sh.entries.end())
+         remove(sh, it);
+      while (!sh.lru.empty() && sh.size + size > max_shard_size) //
+         remove(sh, sh.lru.back());
+      it = sh.entries.emplace(to_bytes(key), entry{}).first;
+      if (value)
+         it->second.value = to_bytes(*value);
+      sh.lru.push_front(it);
+      it->second.lru_pos = sh.lru.begin();
+      sh.size += size;
+   }
+
+   // Replace a cached value after writing it to rocksdb. Does nothing if key isn't cached.
+   void update(const rocksdb::Slice& key, const std::optional<rocksdb::Slice>& value) {
+      auto&                       sh = get_shard(key);
+      std::lock_guard<std::mutex> lock{ sh.mutex };
+      ++sh.generation;
+      auto it = sh.entries.find(key);
+      if (it == sh.entries.end())
+         return;
+      sh.size -= entry_size(it);
+      if (value)
+         it->second.value = to_bytes(*value);
+      else
+         it->second.value.reset();
+      sh.size += entry_size(it);
+      while (sh.size > max_shard_size) //
+         remove(sh, sh.lru.back());
+   }
+
+   // Drop a cached value after writing it to rocksdb
+   void erase(const rocksdb::Slice& key) {
+      auto&                       sh = get_shard(key);
+      std::lock_guard<std::mutex> lock{ sh.mutex };
+      ++sh.generation;
+      auto it = sh.entries.find(key);
+      if (it != sh.entries.end())
+         remove(sh, it);
+   }
+
+   void clear() {
+      for (size_t i = 0; i < num_shards; ++i) {
+         std::lock_guard<std::mutex> lock{ shards[i].mutex };
+         ++shards[i].generation;
+         shards[i].entries.clear();
+         shards[i].lru.clear();
+         shards[i].size = 0;
+      }
+   }
+
+   // Approximate memory used
+   size_t size() {
+      size_t result = 0;
+      for (size_t i = 0; i < num_shards; ++i) {
+         std::lock_guard<std::mutex> lock{ shards[i].mutex };
+         result += shards[i].size;
+      }
+      return result;
+   }
+
+   uint64_t hits() const { return num_hits; }
+   uint64_t misses() const { return num_misses; }
+}; // read_cache
+
+// Tuning for database
+struct database_config {
+   std::optional<uint32_t> threads         = {};
+   std::optional<int>      max_open_files  = {};
+   std::optional<size_t>   read_cache_size = {}; // Enables the shared read_cache
+
+   // Bloom filter bits per key. 0 disables filters.
+   double bloom_bits_per_key = 0;
+
+   // Add whole keys to the filters. This speeds up view::get misses.
+   bool whole_key_filtering = true;
+
+   // Length of the view prefix used by this database's views. This installs a prefix extractor
+   // covering the view prefix and contract (see create_full_key) and adds those prefixes to the
+   // filters. All views of this database must use prefixes of this length; other keys (e.g. the
+   // undo stack's) still work, but don't benefit from prefix filtering.
+   std::optional<size_t> view_prefix_size = {};
+
+   // Size of the memtable's prefix bloom filter, as a fraction of write_buffer_size. Requires
+   // view_prefix_size. 0 disables it.
+   double memtable_prefix_bloom_size_ratio = 0;
+
+   // Block cache. Unset uses rocksdb's default (8MB). Shard bits of -1 lets rocksdb choose.
+   std::optional<size_t> block_cache_size       = {};
+   int                   block_cache_shard_bits = -1;
+   std::optional<size_t> block_size             = {};
+
+   // Cache of whole key-value pairs, ahead of the block cache. Unset disables it.
+   std::optional<size_t> row_cache_size = {};
+
+   // Compression for each level. Empty uses rocksdb's default.
+   std::vector<rocksdb::CompressionType> compression_per_level  = {};
+   rocksdb::CompressionType              bottommost_compression = rocksdb::kDisableCompressionOption;
+
+   uint64_t              compaction_memtable_budget = 256ull << 20; // OptimizeLevelStyleCompaction
+   std::optional<size_t> write_buffer_size          = {};
+   std::optional<int>    max_write_buffer_number    = {};
+   std::optional<int>    max_background_jobs        = {};
+   bool                  enable_pipelined_write     = false;
+   uint64_t              bytes_per_sync             = 1048576;
+   uint32_t              format_version             = 4;
+
+   bool use_direct_reads                       = false;
+   bool use_direct_io_for_flush_and_compaction = false;
+
+   // Skip the write-ahead log in database::write. Data which hasn't been flushed is lost on
+   // a crash; callers recover by replaying from their own source.
+   bool disable_wal = true;
+
+   // With the WAL enabled: buffer WAL writes in memory until database::sync_wal, instead of
+   // writing them to the file on every write. rocksdb still groups concurrent writers.
+   bool manual_wal_flush = false;
+
+   // Sync the WAL at each undo_stack::push and commit, so revisions survive a crash without
+   // a sync per write. Requires the WAL. See undo_stack::push for the recovery guarantee.
+   bool sync_wal_on_revision = false;
+
+   // Readahead for view::scan_iterator. 0 uses rocksdb's automatic readahead, which starts
+   // small and grows as a scan continues.
+   size_t scan_readahead_size = 0;
+
+   // Collect rocksdb::Statistics, which database::stats() includes. Costs a few percent.
+   bool statistics = false;
+
+   // Keep each write's last memtable insert position as a hint for its next key. Speeds up
+   // batches with sequential keys; see undo_stack_config::sorted_changes.
+   bool memtable_insert_hint_per_batch = false;
+
+   // Threads which serve write_session's asynchronous reads (get_async() etc.). 0 runs those
+   // reads on the calling thread.
+   uint32_t read_threads = 0;
+
+   // Let the asynchronous reads use rocksdb's async_io, which overlaps a MultiGet's or seek's
+   // block reads where rocksdb is built with io_uring
+   bool async_io = false;
+
+   // Keep undo_stack state and segments in their own column family, using universal
+   // compaction and no block cache. An existing undo column family is always opened, even if
+   // this is false; undo_stack moves data from the default column family on first use.
+   bool undo_column_family = false;
+
+   // Store large undo segments in blob files instead of the undo column family's LSM tree
+   bool     undo_blob_files    = false;
+   uint64_t undo_min_blob_size = 4096;
+
+   // Compact the undo range which undo_stack::commit() and squash() removed once this many of their
+   // range deletions have built up, so the tombstones stop slowing reads and seeks. This runs on a
+   // background thread and doesn't hold up automatic compactions or writes. 0 disables.
+   uint32_t undo_compaction_trigger = 0;
+
+   // rocksdb's CompactOnDeletionCollector: mark an sst file for compaction when a window of
+   // undo_deletion_window consecutive entries holds undo_deletion_trigger point deletions, e.g.
+   // segments removed by undo(). Applies to the undo column family, or to the default one if
+   // that holds undo data. 0 disables.
+   size_t undo_deletion_window  = 0;
+   size_t undo_deletion_trigger = 0;
+
+   // Limit the write rate of flushes and compactions, including undo compaction, so background
+   // work leaves disk bandwidth to foreground reads. 0 is unlimited.
+   int64_t rate_limit_bytes_per_sec = 0;
+
+   // Block producer or validator: mostly writes and random point reads
+   static database_config validator() {
+      database_config config;
+      config.block_cache_size       = 1ull << 30;
+      config.bloom_bits_per_key     = 10;
+      config.max_background_jobs    = 4;
+      config.enable_pipelined_write = true;
+      config.compression_per_level  = { rocksdb::kNoCompression,  rocksdb::kNoCompression,  rocksdb::kLZ4Compression,
+                                        rocksdb::kLZ4Compression, rocksdb::kLZ4Compression, rocksdb::kLZ4Compression,
+                                        rocksdb::kZSTD };
+      return config;
+   }
+
+   // API node: heavy read traffic, including repeated reads of hot rows
+   static database_config api_node() {
+      database_config config;
+      config.block_cache_size      = 4ull << 30;
+      config.row_cache_size        = 256ull << 20;
+      config.bloom_bits_per_key    = 10;
+      config.max_background_jobs   = 4;
+      config.use_direct_reads      = true;
+      config.scan_readahead_size   = 2ull << 20;
+      config.compression_per_level = { rocksdb::kNoCompression,  rocksdb::kNoCompression,  rocksdb::kLZ4Compression,
+                                       rocksdb::kLZ4Compression, rocksdb::kLZ4Compression, rocksdb::kLZ4Compression,
+                                       rocksdb::kLZ4Compression };
+      return config;
+   }
+
+   // Replay from blocks log or snapshot: sustained writes, few reads
+   static database_config bulk_replay() {
+      database_config config;
+      config.write_buffer_size                      = 256ull << 20;
+      config.max_write_buffer_number                = 6;
+      config.max_background_jobs                    = 8;
+      config.compaction_memtable_budget             = 1ull << 30;
+      config.enable_pipelined_write                 = true;
+      config.use_direct_io_for_flush_and_compaction = true;
+      config.compression_per_level = { rocksdb::kNoCompression,  rocksdb::kNoCompression,  rocksdb::kNoCompression,
+                                       rocksdb::kLZ4Compression, rocksdb::kLZ4Compression, rocksdb::kLZ4Compression,
+                                       rocksdb::kZSTD };
+      return config;
+   }
+}; // database_config
+
+// Bounds for a rocksdb iterator, which only sees keys in [lower, upper). rocksdb keeps
+// pointers to the slices, so this must outlive the iterator and stay in place.
+struct iterator_bounds {
+   bytes          lower;
+   bytes          upper;
+   rocksdb::Slice lower_slice;
+   rocksdb::Slice upper_slice;
+
+   iterator_bounds(bytes lower, bytes upper)
+       : lower{ std::move(lower) }, upper{ std::move(upper) }, lower_slice{ to_slice(this->lower) },
+         upper_slice{ to_slice(this->upper) } {}
+
+   // Keys which begin with prefix
+   explicit iterator_bounds(bytes prefix) : iterator_bounds{ prefix, get_next_prefix(prefix) } {}
+
+   iterator_bounds(const iterator_bounds&) = delete;
+   iterator_bounds& operator=(const iterator_bounds&) = delete;
+};
+
+// Applies write batches on a background thread, in the order they were queued. Once a write
+// fails, every later one fails with the same error, since it may depend on the failed one.
+//
+// Writes are pipelined but not coalesced: the caller builds its next batch while this thread
+// applies the last one, but each batch is still its own rdb->Write. This thread is the only
+// writer while batches are queued, so enable_pipelined_write has nothing to group them with.
+class write_queue {
+   struct pending_write {
+      rocksdb::WriteBatch   batch;
+      std::function<void()> on_written;
+      std::promise<void>    promise;
+   };
+
+   rocksdb::DB*              rdb;
+   rocksdb::WriteOptions     options;
+   std::mutex                mutex;
+   std::condition_variable   cv;
+   std::deque<pending_write> queue;
+   size_t                    in_flight = 0;
+   bool                      stopping  = false;
+   std::exception_ptr        error;
+   std::thread               thread;
+
+ public:
+   write_queue(rocksdb::DB* rdb, const rocksdb::WriteOptions& options) : rdb{ rdb }, options{ options } {
+      thread = std::thread([this] { run(); });
+   }
+
+   write_queue(const write_queue&) = delete;
+   write_queue& operator=(const write_queue&) = delete;
+
+   // Waits for queued writes
+   ~write_queue() {
+      {
+         std::lock_guard lock{ mutex };
+         stopping = true;
+      }
+      cv.notify_all();
+      thread.join();
+   }
+
+   // on_written runs on the writer thread after the batch is applied
+   std::future<void> push(rocksdb::WriteBatch&& batch, std::function<void()> on_written = {}) {
+      std::lock_guard lock{ mutex };
+      auto&           w = queue.emplace_back(pending_write{ std::move(batch), std::move(on_written), {} });
+      auto            f = w.promise.get_future();
+      cv.notify_all();
+      return f;
+   }
+
+   // Wait until everything queued so far is written. Throws if any write failed.
+   void wait() {
+      std::unique_lock lock{ mutex };
+      cv.wait(lock, [&] { return queue.empty() && !in_flight; });
+      if (error)
+         std::rethrow_exception(error);
+   }
+
+ private:
+   void run() {
+      std::unique_lock lock{ mutex };
+      while (true) {
+         cv.wait(lock, [&] { return stopping || !queue.empty(); });
+         if (queue.empty())
+            return;
+         auto w = std::move(queue.front());
+         queue.pop_front();
+         ++in_flight;
+         auto prev_error = error;
+         lock.unlock();
+         try {
+            if (prev_error)
+               std::rethrow_exception(prev_error);
+            add_metric(metric::db_writes);
+            add_metric(metric::db_write_bytes, w.batch.GetDataSize());
+            {
+               latency_timer timer{ latency::db_write };
+               check(rdb->Write(options, &w.batch), "database::write_async: rocksdb::DB::Write (batch)");
+            }
+            if (w.on_written)
+               w.on_written();
+            w.promise.set_value();
+         } catch (...) {
+            w.promise.set_exception(std::current_exception());
+            lock.lock();
+            if (!error)
+               error = std::current_exception();
+            lock.unlock();
+         }
+         lock.lock();
+         --in_flight;
+         cv.notify_all();
+      }
+   }
+}; // write_queue
+
+// Runs jobs on a pool of threads, in the order they were queued. database uses one for
+// write_session's asynchronous reads and another for undo_stack's parallel encoding and
+// decoding. Jobs must not throw.
+class thread_pool {
+   std::mutex                        mutex;
+   std::condition_variable           cv;
+   std::deque<std::function<void()>> queue;
+   bool                              stopping = false;
+   std::vector<std::thread>          threads; // Guarded by mutex
+
+ public:
+   explicit thread_pool(uint32_t num_threads) { reserve(num_threads); }
+
+   thread_pool(const thread_pool&) = delete;
+   thread_pool& operator=(const thread_pool&) = delete;
+
+   // Runs queued jobs first
+   ~thread_pool() {
+      {
+         std::lock_guard lock{ mutex };
+         stopping = true;
+      }
+      cv.notify_all();
+      for (auto& t : threads) //
+         t.join();
+   }
+
+   // Start threads until there are at least num_threads
+   void reserve(uint32_t num_threads) {
+      std::lock_guard lock{ mutex };
+      while (threads.size() < num_threads) //
+         threads.emplace_back([this] { run(); });
+   }
+
+   size_t size() {
+      std::lock_guard lock{ mutex };
+      return threads.size();
+   }
+
+   void push(std::function<void()> job) {
+      {
+         std::lock_guard lock{ mutex };
+         queue.push_back(std::move(job));
+      }
+      cv.notify_one();
+   }
+
+ private:
+   void run() {
+      std::unique_lock lock{ mutex };
+      while (true) {
+         cv.wait(lock, [&] { return stopping || !queue.empty(); });
+         if (queue.empty())
+            return;
+         auto job = std::move(queue.front());
+         queue.pop_front();
+         lock.unlock();
+         job();
+         lock.lock();
+      }
+   }
+}; // thread_pool
+
+// Runs CompactRange on a background thread. A range queued for a column family which already has
+// one waiting merges with it. Compactions aren't exclusive, so automatic compactions continue, and
+// they wait out write stalls instead of adding to them.
+class compaction_queue {
+   struct range {
+      rocksdb::ColumnFamilyHandle* cf;
+      bytes                        begin;
+      bytes                        end;
+   };
+
+   rocksdb::DB*            rdb;
+   std::mutex              mutex;
+   std::condition_variable cv;
+   std::vector<range>      queue;
+   size_t                  running  = 0;
+   bool                    stopping = false;
+   std::exception_ptr      error;
+   std::thread             thread;
+
+ public:
+   explicit compaction_queue(rocksdb::DB* rdb) : rdb{ rdb }, thread{ [this] { run(); } } {}
+
+   // Abandons a running compaction; rocksdb keeps whatever it finished
+   ~compaction_queue() {
+      {
+         std::lock_guard lock{ mutex };
+         stopping = true;
+      }
+      cv.notify_all();
+      rdb->DisableManualCompaction();
+      thread.join();
+      rdb->EnableManualCompaction();
+   }
+
+   void push(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice& begin, const rocksdb::Slice& end) {
+      std::lock_guard lock{ mutex };
+      for (auto& r : queue) {
+         if (r.cf == cf) {
+            if (compare_blob(begin, r.begin) < 0)
+               r.begin = to_bytes(begin);
+            if (compare_blob(end, r.end) > 0)
+               r.end = to_bytes(end);
+            return;
+         }
+      }
+      queue.push_back({ cf, to_bytes(begin), to_bytes(end) });
+      cv.notify_all();
+   }
+
+   // Wait for queued compactions. Rethrows the first failure.
+   void wait() {
+      std::unique_lock lock{ mutex };
+      cv.wait(lock, [&] { return queue.empty() && !running; });
+      if (error)
+         std::rethrow_exception(std::exchange(error, nullptr));
+   }
+
+ private:
+   void run() {
+      std::unique_lock lock{ mutex };
+      while (true) {
+         cv.wait(lock, [&] { return stopping || !queue.empty(); });
+         if (stopping)
+            return;
+         auto r = std::move(queue.front());
+         queue.erase(queue.begin());
+         ++running;
+         lock.unlock();
+
+         rocksdb::CompactRangeOptions options;
+         options.exclusive_manual_compaction = false;
+         auto            begin               = to_slice(r.begin);
+         auto            end                 = to_slice(r.end);
+         rocksdb::Status stat;
+         {
+            latency_timer timer{ latency::undo_compaction };
+            stat = rdb->CompactRange(options, r.cf, &begin, &end);
+         }
+         add_metric(metric::undo_compactions);
+
+         lock.lock();
+         --running;
+         if (!stat.ok() && !stopping && !error) {
+            try {
+               check(stat, "compaction_queue: rocksdb::DB::CompactRange: ");
+            } catch (...) { error = std::current_exception(); }
+         }
+         cv.notify_all();
+      }
+   }
+}; // compaction_queue
+
+struct column_family_deleter {
+   rocksdb::DB* rdb = nullptr;
+   void         operator()(rocksdb::ColumnFamilyHandle* cf) const { rdb->DestroyColumnFamilyHandle(cf); }
+};
+using column_family_ptr = std::unique_ptr<rocksdb::ColumnFamilyHandle, column_family_deleter>;
+
+struct database {
+   static constexpr const char* undo_column_family_name = "undo";
+
+   std::unique_ptr<rocksdb::DB>         rdb;
+   column_family_ptr                    undo_cf;           // Optional; must be destroyed before rdb
+   std::unique_ptr<write_queue>         async_writes;      // Created by write_async(); destroyed before undo_cf
+   std::unique_ptr<compaction_queue>    undo_compactions;  // Created by undo_range_deleted(); destroyed before undo_cf
+   std::unique_ptr<thread_pool>         async_reads;       // Optional; see database_config::read_threads
+   std::unique_ptr<thread_pool>         parallel_workers;  // Grows as run_parallel() needs threads
+   std::unique_ptr<read_cache>          shared_read_cache; // Optional
+   std::shared_ptr<rocksdb::Statistics> statistics;        // Optional
+   bool                                 disable_wal                    = true;
+   bool                                 manual_wal_flush               = false;
+   bool                                 sync_wal_on_revision           = false;
+   bool                                 memtable_insert_hint_per_batch = false;
+   bool                                 async_io                       = false;
+   size_t                               scan_readahead_size            = 0;
+   uint32_t                             undo_compaction_trigger        = 0;
+   uint32_t                             pending_undo_deletions         = 0; // Range deletions not yet compacted
+   bytes                                pending_undo_begin;
+   bytes                                pending_undo_end;
+
+   database(const char* db_path, bool create_if_missing, std::optional<uint32_t> threads = {},
+            std::optional<int> max_open_files = {}, std::optional<size_t> read_cache_size = {})
+       : database(db_path, create_if_missing, database_config{ threads, max_open_files, read_cache_size }) {}
+
+   database(const char* db_path, bool create_if_missing, const database_config& config) {
+      if (config.memtable_prefix_bloom_size_ratio && !config.view_prefix_size)
+         throw exception("database::database: memtable_prefix_bloom_size_ratio requires view_prefix_size");
+      if (config.sync_wal_on_revision && config.disable_wal)
+         throw exception("database::database: sync_wal_on_revision requires the WAL");
+      if (config.read_cache_size)
+         shared_read_cache = std::make_unique<read_cache>(*config.read_cache_size);
+      disable_wal                    = config.disable_wal;
+      manual_wal_flush               = config.manual_wal_flush;
+      sync_wal_on_revision           = config.sync_wal_on_revision;
+      memtable_insert_hint_per_batch = config.memtable_insert_hint_per_batch;
+      async_io                       = config.async_io;
+      scan_readahead_size            = config.scan_readahead_size;
+      undo_compaction_trigger        = config.undo_compaction_trigger;
+
+      rocksdb::Options options;
+      options.create_if_missing                    = create_if_missing;
+      options.level_compaction_dynamic_level_bytes = true;
+      options.bytes_per_sync                       = config.bytes_per_sync;
+      if (config.statistics) {
+         statistics         = rocksdb::CreateDBStatistics();
+         options.statistics = statistics;
+      }
+
+      if (config.threads)
+         options.IncreaseParallelism(*config.threads);
+
+      options.OptimizeLevelStyleCompaction(config.compaction_memtable_budget);
+
+      if (config.max_open_files)
+         options.max_open_files = *config.max_open_files;
+      if (config.write_buffer_size)
+         options.write_buffer_size = *config.write_buffer_size;
+      if (config.max_write_buffer_number)
+         options.max_write_buffer_number = *config.max_write_buffer_number;
+      if (config.max_background_jobs)
+         options.max_background_jobs = *config.max_background_jobs;
+      if (!config.compression_per_level.empty())
+         options.compression_per_level = config.compression_per_level;
+      options.bottommost_compression                 = config.bottommost_compression;
+      options.enable_pipelined_write                 = config.enable_pipelined_write;
+      options.use_direct_reads                       = config.use_direct_reads;
+      options.use_direct_io_for_flush_and_compaction = config.use_direct_io_for_flush_and_compaction;
+      options.manual_wal_flush                       = config.manual_wal_flush;
+      if (config.row_cache_size)
+         options.row_cache = rocksdb::NewLRUCache(*config.row_cache_size);
+      if (config.rate_limit_bytes_per_sec > 0)
+         options.rate_limiter.reset(rocksdb::NewGenericRateLimiter(config.rate_limit_bytes_per_sec));
+
+      rocksdb::BlockBasedTableOptions table_options;
+      table_options.format_version               = config.format_version;
+      table_options.index_block_restart_interval = 16;
+      if (config.block_cache_size)
+         table_options.block_cache = rocksdb::NewLRUCache(*config.block_cache_size, config.block_cache_shard_bits);
+      if (config.block_size)
+         table_options.block_size = *config.block_size;
+      if (config.bloom_bits_per_key > 0) {
+         table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(config.bloom_bits_per_key, false));
+         table_options.whole_key_filtering = config.whole_key_filtering;
+      }
+      if (config.view_prefix_size) {
+         options.prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(*config.view_prefix_size + sizeof(uint64_t)));
+         options.memtable_prefix_bloom_size_ratio = config.memtable_prefix_bloom_size_ratio;
+         options.memtable_whole_key_filtering     = config.whole_key_filtering && config.memtable_prefix_bloom_size_ratio;
+      }
+      options.table_factory.reset(NewBlockBasedTableFactory(table_options));
+
+      std::vector<std::string> existing_cfs;
+      if (!rocksdb::DB::ListColumnFamilies(options, db_path, &existing_cfs).ok())
+         existing_cfs.clear(); // New database
+      bool open_undo_cf = config.undo_column_family || std::find(existing_cfs.begin(), existing_cfs.end(),
+                                                                 undo_column_family_name) != existing_cfs.end();
+
+      if (!open_undo_cf)
+         add_deletion_collector(options, config);
+
+      std::vector<rocksdb::ColumnFamilyDescriptor> cf_descriptors;
+      cf_descriptors.emplace_back(rocksdb::kDefaultColumnFamilyName, options);
+      if (open_undo_cf)
+         cf_descriptors.emplace_back(undo_column_family_name, undo_column_family_options(config));
+      options.create_missing_column_families = true;
+
+      rocksdb::DB*                              p;
+      std::vector<rocksdb::ColumnFamilyHandle*> handles;
+      check(rocksdb::DB::Open(options, db_path, cf_descriptors, &handles, &p), "database::database: rocksdb::DB::Open: ");
+      rdb.reset(p);
+      rdb->DestroyColumnFamilyHandle(handles[0]); // DefaultColumnFamily() remains available
+      if (open_undo_cf)
+         undo_cf = column_family_ptr{ handles[1], { p } };
+
+      // Sentinels with keys 0x00 and 0xff simplify iteration logic.
+      // Views have prefixes which must start with a byte within the range 0x01 - 0xfe.
+      rocksdb::WriteBatch batch;
+      bool                modified       = false;
+      auto                write_sentinal = [&](const bytes& k) {
+         rocksdb::PinnableSlice v;
+         auto                   stat = rdb->Get(rocksdb::ReadOptions(), rdb->DefaultColumnFamily(), to_slice(k), &v);
+         if (stat.IsNotFound()) {
+            check(batch.Put(to_slice(k), {}), "database::database: rocksdb::WriteBatch::Put: ");
+            modified = true;
+         } else {
+            check(stat, "database::database: rocksdb::DB::Get: ");
+         }
+      };
+      write_sentinal({ 0x00 });
+      write_sentinal({ (char)0xff });
+      if (modified)
+         write(batch);
+      if (config.read_threads)
+         async_reads = std::make_unique<thread_pool>(config.read_threads);
+      parallel_workers = std::make_unique<thread_pool>(0);
+   }
+
+   database(database&&) = default;
+
+   database& operator=(database&& src) {
+      async_reads.reset(); // Before the handles they use go away
+      parallel_workers.reset();
+      async_writes.reset();
+      undo_compactions.reset();
+      undo_cf.reset();
+      rdb                            = std::move(src.rdb);
+      undo_cf                        = std::move(src.undo_cf);
+      async_writes                   = std::move(src.async_writes);
+      undo_compactions               = std::move(src.undo_compactions);
+      async_reads                    = std::move(src.async_reads);
+      parallel_workers               = std::move(src.parallel_workers);
+      shared_read_cache              = std::move(src.shared_read_cache);
+      statistics                     = std::move(src.statistics);
+      disable_wal                    = src.disable_wal;
+      manual_wal_flush               = src.manual_wal_flush;
+      sync_wal_on_revision           = src.sync_wal_on_revision;
+      memtable_insert_hint_per_batch = src.memtable_insert_hint_per_batch;
+      async_io                       = src.async_io;
+      scan_readahead_size            = src.scan_readahead_size;
+      undo_compaction_trigger        = src.undo_compaction_trigger;
+      pending_undo_deletions         = src.pending_undo_deletions;
+      pending_undo_begin             = std::move(src.pending_undo_begin);
+      pending_undo_end               = std::move(src.pending_undo_end);
+      return *this;
+   }
+
+   // Column family holding undo_stack's state and segments
+   rocksdb::ColumnFamilyHandle* undo_column_family() const {
+      return undo_cf ? undo_cf.get() : rdb->DefaultColumnFamily();
+   }
+
+   static rocksdb::ColumnFamilyOptions undo_column_family_options(const database_config& config) {
+      // Segments are written once, read only by undo(), and removed in ranges. FIFO
+      // compaction isn't an option since it drops data which commit() hasn't released.
+      rocksdb::ColumnFamilyOptions options;
+      options.OptimizeUniversalStyleCompaction(64ull << 20);
+      options.compaction_style = rocksdb::kCompactionStyleUniversal;
+      if (config.undo_blob_files) {
+         options.enable_blob_files = true;
+         options.min_blob_size     = config.undo_min_blob_size;
+      }
+      rocksdb::BlockBasedTableOptions table_options;
+      table_options.format_version = config.format_version;
+      table_options.no_block_cache = true;
+      options.table_factory.reset(NewBlockBasedTableFactory(table_options));
+      add_deletion_collector(options, config);
+      return options;
+   }
+
+   static void add_deletion_collector(rocksdb::ColumnFamilyOptions& options, const database_config& config) {
+      if (config.undo_deletion_window && config.undo_deletion_trigger)
+         options.table_properties_collector_factories.push_back(rocksdb::NewCompactOnDeletionCollectorFactory(
+               config.undo_deletion_window, config.undo_deletion_trigger));
+   }
+
+   // undo_stack calls this once a write removing [begin, end) from the undo column family with a
+   // range deletion is done. With database_config::undo_compaction_trigger, every that many calls
+   // queue a background compaction of the combined range.
+   void undo_range_deleted(const rocksdb::Slice& begin, const rocksdb::Slice& end) {
+      if (!undo_compaction_trigger)
+         return;
+      if (!pending_undo_deletions++) {
+         pending_undo_begin = to_bytes(begin);
+         pending_undo_end   = to_bytes(end);
+      } else {
+         if (compare_blob(begin, pending_undo_begin) < 0)
+            pending_undo_begin = to_bytes(begin);
+         if (compare_blob(end, pending_undo_end) > 0)
+            pending_undo_end = to_bytes(end);
+      }
+      if (pending_undo_deletions < undo_compaction_trigger)
+         return;
+      if (!undo_compactions)
+         undo_compactions = std::make_unique<compaction_queue>(rdb.get());
+      undo_compactions->push(undo_column_family(), to_slice(pending_undo_begin), to_slice(pending_undo_end));
+      pending_undo_deletions = 0;
+   }
+
+   // Wait for background undo compactions. Throws if any of them failed.
+   void wait_for_compactions() {
+      if (undo_compactions)
+         undo_compactions->wait();
+   }
+
+   // Options for iterators. These cross prefix boundaries (e.g. to reach sentinels), so
+   // they must ignore the prefix extractor.
+   static rocksdb::ReadOptions iterator_options(const rocksdb::Snapshot* snapshot = nullptr) {
+      rocksdb::ReadOptions r;
+      r.snapshot         = snapshot;
+      r.total_order_seek = true;
+      return r;
+   }
+
+   // Options for iterators confined to bounds. rocksdb can then skip files outside the range and
+   // stop at the upper bound instead of stepping through tombstones beyond it. auto_prefix_mode
+   // lets it use prefix filters whenever that gives the same result as a total-order seek.
+   // readahead_size 0 uses rocksdb's automatic readahead, which grows as a scan continues.
+   static rocksdb::ReadOptions iterator_options(const rocksdb::Snapshot* snapshot, const iterator_bounds& bounds,
+                                                size_t readahead_size = 0) {
+      rocksdb::ReadOptions r;
+      r.snapshot            = snapshot;
+      r.iterate_lower_bound = &bounds.lower_slice;
+      r.iterate_upper_bound = &bounds.upper_slice;
+      r.auto_prefix_mode    = true;
+      r.readahead_size      = readahead_size;
+      return r;
+   }
+
+   void flush(bool allow_write_stall, bool wait) {
+      rocksdb::FlushOptions op;
+      op.allow_write_stall = allow_write_stall;
+      op.wait              = wait;
+      rdb->Flush(op);
+   }
+
+   rocksdb::WriteOptions write_options() const {
+      rocksdb::WriteOptions opt;
+      opt.disableWAL                     = disable_wal;
+      opt.memtable_insert_hint_per_batch = memtable_insert_hint_per_batch;
+      return opt;
+   }
+
+   // Writes the batch after any pending asynchronous writes
+   void write(rocksdb::WriteBatch& batch) {
+      wait_for_writes();
+      auto opt = write_options();
+      add_metric(metric::db_writes);
+      add_metric(metric::db_write_bytes, batch.GetDataSize());
+      {
+         latency_timer timer{ latency::db_write };
+         check(rdb->Write(opt, &batch), "database::write: rocksdb::DB::Write (batch)");
+      }
+      batch.Clear();
+   }
+
+   // Queue batch for a background thread, which applies batches in order, one rdb->Write each;
+   // see write_queue. on_written runs on that thread once the batch is applied. Reads don't see
+   // the batch until the future is ready.
+   std::future<void> write_async(rocksdb::WriteBatch&& batch, std::function<void()> on_written = {}) {
+      if (!async_writes)
+         async_writes = std::make_unique<write_queue>(rdb.get(), write_options());
+      return async_writes->push(std::move(batch), std::move(on_written));
+   }
+
+   // Make everything written so far, including pending asynchronous writes, survive a crash.
+   // Does nothing if the WAL is disabled; flush() is the only option then.
+   void sync_wal() {
+      wait_for_writes();
+      if (disable_wal)
+         return;
+      add_metric(metric::wal_syncs);
+      latency_timer timer{ latency::wal_sync };
+      if (manual_wal_flush)
+         check(rdb->FlushWAL(true), "database::sync_wal: rocksdb::DB::FlushWAL: ");
+      else
+         check(rdb->SyncWAL(), "database::sync_wal: rocksdb::DB::SyncWAL: ");
+   }
+
+   // Run job on the read pool, or on this thread if there is none
+   void read_async(std::function<void()> job) {
+      if (async_reads)
+         async_reads->push(std::move(job));
+      else
+         job();
+   }
+
+   // Run task(0) through task(num_tasks - 1), task(0) on this thread and the rest on
+   // parallel_workers, and wait for all of them. Rethrows the first exception a task threw.
+   void run_parallel(size_t num_tasks, const std::function<void(size_t)>& task) {
+      if (num_tasks <= 1) {
+         if (num_tasks)
+            task(0);
+         return;
+      }
+      struct shared_state {
+         std::mutex              mutex;
+         std::condition_variable cv;
+         size_t                  remaining;
+         std::exception_ptr      error;
+      } st;
+      st.remaining = num_tasks - 1;
+      parallel_workers->reserve(num_tasks - 1);
+      for (size_t i = 1; i < num_tasks; ++i) {
+         parallel_workers->push([&st, &task, i] {
+            std::exception_ptr error;
+            try {
+               task(i);
+            } catch (...) { error = std::current_exception(); }
+            std::lock_guard lock{ st.mutex };
+            if (error && !st.error)
+               st.error = error;
+            if (!--st.remaining)
+               st.cv.notify_all(); // Under the lock, so st outlives this
+         });
+      }
+      std::exception_ptr error;
+      try {
+         task(0);
+      } catch (...) { error = std::current_exception(); }
+      std::unique_lock lock{ st.mutex };
+      st.cv.wait(lock, [&] { return !st.remaining; });
+      if (!error)
+         error = st.error;
+      if (error)
+         std::rethrow_exception(error);
+   }
+
+   // Wait for writes queued by write_async(). Throws if any of them failed.
+   void wait_for_writes() {
+      if (async_writes)
+         async_writes->wait();
+   }
+
+   // Snapshot of the current state, including completed asynchronous writes. It's released
+   // when the last copy is destroyed, which must happen before database is destroyed.
+   std::shared_ptr<const rocksdb::Snapshot> snapshot() {
+      wait_for_writes();
+      return { rdb->GetSnapshot(), [rdb = rdb.get()](const rocksdb::Snapshot* s) { rdb->ReleaseSnapshot(s); } };
+   }
+
+   // Create a copy of the database in path, which must not exist, that can be opened like the
+   // original. rocksdb hard links sst files when path is on the same filesystem, so beyond a
+   // memtable flush, writers don't stall. The flush always happens since the WAL is usually
+   // disabled. metadata is stored with the copy; see read_checkpoint_metadata().
+   void checkpoint(const std::string& path, const std::string& metadata = {}) {
+      wait_for_writes();
+      rocksdb::Checkpoint* p = nullptr;
+      check(rocksdb::Checkpoint::Create(rdb.get(), &p), "database::checkpoint: rocksdb::Checkpoint::Create: ");
+      std::unique_ptr<rocksdb::Checkpoint> cp{ p };
+      check(cp->CreateCheckpoint(path, 0), "database::checkpoint: rocksdb::Checkpoint::CreateCheckpoint: ");
+      std::ofstream file{ path + "/" + checkpoint_metadata_file, std::ios::binary };
+      file << metadata;
+      if (!file.flush())
+         throw exception("database::checkpoint: can't write " + path + "/" + checkpoint_metadata_file);
+   }
+
+   static std::string read_checkpoint_metadata(const std::string& path) {
+      std::ifstream file{ path + "/" + checkpoint_metadata_file, std::ios::binary };
+      if (!file)
+         throw exception("database::read_checkpoint_metadata: " + path + " isn't a checkpoint");
+      return { std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+   }
+
+   static constexpr const char* checkpoint_metadata_file = "CHAIN_KV_CHECKPOINT";
+
+   // chain_kv's metrics (see get_metrics()), plus this database's rocksdb::Statistics if enabled
+   stats_snapshot stats() const {
+      auto result = get_metrics();
+      if (statistics)
+         result.rocksdb_statistics = statistics->ToString();
+      return result;
+   }
+}; // database
+
+struct key_value {
+   rocksdb::Slice key   = {};
+   rocksdb::Slice value = {};
+};
+
+inline int compare_key(const std::optional<key_value>& a, const std::optional<key_value>& b) {
+   // nullopt represents end; everything else is before end
+   if (!a && !b)
+      return 0;
+   else if (!a && b)
+      return 1;
+   else if (a && !b)
+      return -1;
+   else
+      return compare_blob(a->key, b->key);
+}
+
+inline int compare_value(const std::optional<rocksdb::Slice>& a, const std::optional<rocksdb::Slice>& b) {
+   // nullopt represents erased; everything else, including empty, is after erased
+   if (!a && !b)
+      return 0;
+   else if (!a && b)
+      return -1;
+   else if (a && !b)
+      return 1;
+   else
+      return compare_blob(*a, *b);
+}
+
+// Keys point into the owning write_session's arena, as do the map nodes
+using cache_map = std::map<rocksdb::Slice, struct cached_value, less_blob,
+                           arena_allocator<std::pair<const rocksdb::Slice, struct cached_value>>>;
+
+// Set of keys which point into an arena
+using slice_set = std::set<rocksdb::Slice, less_blob, arena_allocator<rocksdb::Slice>>;
+
+// The cache serves these needs:
+//    * Keep track of changes that need to be written to rocksdb
+//    * Support reading writes
+//    * Support iteration logic
+//
+// Values point into the owning write_session's arena. nullopt represents a missing
+// or erased value. A value which hasn't changed shares its data with orig_value.
+struct cached_value {
+   uint64_t                      num_erases         = 0; // For iterator invalidation
+   std::optional<rocksdb::Slice> orig_value         = {};
+   std::optional<rocksdb::Slice> current_value      = {};
+   bool                          in_change_list     = false;
+   cache_map::iterator           change_list_next   = {};
+   bool                          orig_value_pending = false; // Blind write; orig_value hasn't been read
+};
+
+// Format versions:
+//    0: initial format
+//    1: adds undo_in_progress after the reflected fields
+//    2: undo segments start with a header byte (see undo_segment_header)
+//    3: undo entries may hold old_value as a diff against the new value (see undo_value_kind)
+//    4: undo_stack isn't packed; each revision's segment count is a separate key, and the state
+//       records how many there are
+struct undo_state {
+   static constexpr uint8_t max_format_version = 4;
+
+   uint8_t               format_version    = 0;
+   int64_t               revision          = 0;
+   std::vector<uint64_t> undo_stack        = {}; // Number of undo segments needed to go back each revision
+   uint64_t              next_undo_segment = 0;
+
+   // Format 1+. The top revision has been partly undone: some of its segments were applied and
+   // removed, possibly before a crash. The rest must be applied before anything else happens.
+   bool undo_in_progress = false;
+
+   // Format 4+. undo_stack.size() when the state was written; the revision keys must supply
+   // exactly that many counts.
+   uint64_t undo_depth = 0;
+};
+
+// Format 4+ doesn't pack undo_stack; undo_stack keeps each revision's count in its own key, so the
+// state stays the same size however deep the stack is
+template <typename Stream>
+void pack_undo_state(Stream& s, const undo_state& state) {
+   if (state.format_version >= 4) {
+      fc::raw::pack(s, state.format_version);
+      fc::raw::pack(s, state.revision);
+      fc::raw::pack(s, state.next_undo_segment);
+      fc::raw::pack(s, state.undo_in_progress);
+      fc::raw::pack(s, uint64_t(state.undo_stack.size()));
+      return;
+   }
+   fc::raw::pack(s, state);
+   if (state.format_version >= 1)
+      fc::raw::pack(s, state.undo_in_progress);
+}
+
+inline undo_state unpack_undo_state(const rocksdb::Slice& v) {
+   undo_state                  state;
+   fc::datastream<const char*> ds(v.data(), v.size());
+   if (v.size() && uint8_t(v[0]) >= 4) {
+      fc::raw::unpack(ds, state.format_version);
+      fc::raw::unpack(ds, state.revision);
+      fc::raw::unpack(ds, state.next_undo_segment);
+      fc::raw::unpack(ds, state.undo_in_progress);
+      fc::raw::unpack(ds, state.undo_depth);
+      return state;
+   }
+   fc::raw::unpack(ds, state);
+   if (state.format_version >= 1)
+      fc::raw::unpack(ds, state.undo_in_progress);
+   return state;
+}
+
+// Compression for undo segments. Only `none` and `zlib` are always available; the others
+// need CHAIN_KV_HAVE_ZSTD or CHAIN_KV_HAVE_LZ4.
+enum class undo_codec : uint8_t {
+   none = 0,
+   zlib = 1,
+   zstd = 2,
+   lz4  = 3,
+};
+
+inline bool undo_codec_available(undo_codec codec) {
+   switch (codec) {
+      case undo_codec::none:
+      case undo_codec::zlib: return true;
+#ifdef CHAIN_KV_HAVE_ZSTD
+      case undo_codec::zstd: return true;
+#endif
+#ifdef CHAIN_KV_HAVE_LZ4
+      case undo_codec::lz4: return true;
+#endif
+      default: return false;
+   }
+}
+
+// First byte of each undo segment in format 2+. The low bits hold the codec. Compressed
+// segments follow the header with a uint32_t uncompressed size.
+struct undo_segment_header {
+   static constexpr uint8_t codec_mask     = 0x0f;
+   static constexpr uint8_t omit_new_value = 0x80; // entries are (key, old_value) only
+};
+
+// Compress src using codec. Returns false if the codec doesn't reduce the size; dest is
+// unspecified in that case.
+inline bool compress_undo_segment(undo_codec codec, int level, const rocksdb::Slice& src, bytes& dest) {
+   switch (codec) {
+      case undo_codec::zlib: {
+         uLongf size = compressBound(src.size());
+         dest.resize(size);
+         if (compress2((Bytef*)dest.data(), &size, (const Bytef*)src.data(), src.size(),
+                       level ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw exception("compress_undo_segment: zlib compression failed");
+         dest.resize(size);
+         break;
+      }
+#ifdef CHAIN_KV_HAVE_ZSTD
+      case undo_codec::zstd: {
+         dest.resize(ZSTD_compressBound(src.size()));
+         auto size = ZSTD_compress(dest.data(), dest.size(), src.data(), src.size(), level ? level : 3);
+         if (ZSTD_isError(size))
+            throw exception(std::string{ "compress_undo_segment: " } + ZSTD_getErrorName(size));
+         dest.resize(size);
+         break;
+      }
+#endif
+#ifdef CHAIN_KV_HAVE_LZ4
+      case undo_codec::lz4: {
+         dest.resize(LZ4_compressBound(src.size()));
+         auto size = LZ4_compress_default(src.data(), dest.data(), src.size(), dest.size());
+         if (size <= 0)
+            throw exception("compress_undo_segment: lz4 compression failed");
+         dest.resize(size);
+         break;
+      }
+#endif
+      default: return false;
+   }
+   return dest.size() + sizeof(uint32_t) < src.size();
+}
+
+inline void decompress_undo_segment(undo_codec codec, const rocksdb::Slice& src, bytes& dest) {
+   switch (codec) {
+      case undo_codec::zlib: {
+         uLongf size = dest.size();
+         if (uncompress((Bytef*)dest.data(), &size, (const Bytef*)src.data(), src.size()) != Z_OK || size != dest.size())
+            throw exception("decompress_undo_segment: corrupt zlib segment");
+         return;
+      }
+#ifdef CHAIN_KV_HAVE_ZSTD
+      case undo_codec::zstd: {
+         auto size = ZSTD_decompress(dest.data(), dest.size(), src.data(), src.size());
+         if (ZSTD_isError(size) || size != dest.size())
+            throw exception("decompress_undo_segment: corrupt zstd segment");
+         return;
+      }
+#endif
+#ifdef CHAIN_KV_HAVE_LZ4
+      case undo_codec::lz4: {
+         auto size = LZ4_decompress_safe(src.data(), dest.data(), src.size(), dest.size());
+         if (size < 0 || size_t(size) != dest.size())
+            throw exception("decompress_undo_segment: corrupt lz4 segment");
+         return;
+      }
+#endif
+      default: throw exception("decompress_undo_segment: undo segment uses a codec which isn't available");
+   }
+}
+
+struct undo_stack_config {
+   uint64_t target_segment_size = 64 * 1024 * 1024;
+
+   // Format 2+ only. Segments written before the database reaches format 2 are uncompressed
+   // and keep new_value.
+   undo_codec codec       = undo_codec::none;
+   int        codec_level = 0; // 0 is the codec's default
+
+   // undo() never reads new_value; it's only kept for external tools which inspect segments
+   bool store_new_value = true;
+
+   // undo() applies segments in batches of about this many bytes. Each batch is written with
+   // a progress marker, so an interrupted undo resumes where it left off.
+   uint64_t undo_batch_size = 256 * 1024 * 1024;
+
+   // Threads which decode segments during undo(). 0 uses one per core. The calling thread is one
+   // of them; the rest come from database::run_parallel's pool.
+   uint32_t undo_threads = 0;
+
+   // write_changes emits changes and their undo entries in key order instead of reverse change
+   // order. Sorted batches insert into the memtable faster, especially with
+   // database_config::memtable_insert_hint_per_batch.
+   bool sorted_changes = false;
+
+   // Threads which pack and compress segments during write_changes. 0 uses one per core. As with
+   // undo_threads, the extra threads come from database::run_parallel's pool. Segment boundaries
+   // only depend on target_segment_size, so this only helps when a revision's changes span several
+   // segments; the segments written are the same for any thread count.
+   uint32_t encode_threads = 1;
+
+   // Upgrade to format 3 and store a changed value's old_value as a diff against its new value
+   // when that's smaller, e.g. when a few bytes of a large row change. undo() reads the new values
+   // it doesn't have from the database. Format 3 databases can't be opened by older versions.
+   bool delta_values = false;
+
+   // Maintain an index from (key, undo segment) to each undo entry, for undo_stack::get_at and
+   // view::history_iterator. Each change then writes an extra key, and commit() reads the segments
+   // it discards to remove their index entries. Enable this from the start; changes written
+   // without it aren't indexed.
+   bool history_index = false;
+
+   // Upgrade to format 4, which stores each revision's segment count in its own key instead of
+   // packing the whole stack into the undo state. push(), squash() and commit() then write a
+   // constant amount however deep the stack is. Format 4 databases can't be opened by older
+   // versions.
+   bool revision_keys = false;
+};
+
+// Format 3+: what follows an undo entry's key. Format 2 entries use an optional instead, which
+// is encoded like erased and full.
+struct undo_value_kind {
+   static constexpr uint8_t erased = 0;
+   static constexpr uint8_t full   = 1; // old_value
+   static constexpr uint8_t delta  = 2; // Diff which turns the new value into old_value
+};
+
+// Values this short are always stored in full
+inline constexpr size_t min_undo_delta_value_size = 16;
+
+// Append a diff to dest which turns base into target. Returns false, leaving dest unchanged, if
+// the diff isn't smaller than target.
+//
+// The diff is a series of runs, each (copy, skip, insert): copy bytes from base, skip bytes of
+// base, then insert bytes from the diff. Whatever remains of base follows the last run.
+inline bool append_undo_delta(bytes& dest, const rocksdb::Slice& target, const rocksdb::Slice& base) {
+   static constexpr size_t min_gap = 4; // Equal runs shorter than this are cheaper inside an insert
+   auto                    orig_size = dest.size();
+   auto                    append    = [&](uint32_t v) {
+      do {
+         uint8_t b = v & 0x7f;
+         v >>= 7;
+         dest.push_back(b | (v ? 0x80 : 0));
+      } while (v);
+   };
+   auto emit = [&](size_t copy, size_t skip, const char* insert, size_t insert_size) {
+      append(copy);
+      append(skip);
+      append(insert_size);
+      dest.insert(dest.end(), insert, insert + insert_size);
+      return dest.size() - orig_size < target.size();
+   };
+
+   size_t min_size = std::min(target.size(), base.size());
+   size_t prefix   = 0;
+   while (prefix < min_size && target[prefix] == base[prefix]) ++prefix;
+   size_t suffix = 0;
+   while (suffix < min_size - prefix && target[target.size() - suffix - 1] == base[base.size() - suffix - 1])
+      ++suffix;
+
+   bool smaller = true;
+   if (target.size() != base.size()) {
+      smaller = emit(prefix, base.size() - prefix - suffix, target.data() + prefix, target.size() - prefix - suffix);
+   } else {
+      // Same size: replace each differing region in place
+      size_t end  = target.size() - suffix;
+      size_t done = 0;
+      for (size_t pos = prefix; smaller && pos < end;) {
+         size_t run_end = pos + 1;
+         for (size_t i = run_end; i < end && i - run_end < min_gap; ++i)
+            if (target[i] != base[i])
+               run_end = i + 1;
+         smaller = emit(pos - done, run_end - pos, target.data() + pos, run_end - pos);
+         done    = run_end;
+         for (pos = run_end; pos < end && target[pos] == base[pos]; ++pos) {}
+      }
+   }
+   if (!smaller)
+      dest.resize(orig_size);
+   return smaller;
+}
+
+// Apply a diff from append_undo_delta to base
+inline void apply_undo_delta(bytes& dest, const rocksdb::Slice& base, const rocksdb::Slice& delta) {
+   dest.clear();
+   fc::datastream<const char*> ds(delta.data(), delta.size());
+   size_t                      pos = 0;
+   while (ds.remaining()) {
+      fc::unsigned_int copy, skip;
+      fc::raw::unpack(ds, copy);
+      fc::raw::unpack(ds, skip);
+      auto [insert, insert_size] = get_bytes(ds);
+      if (copy.value + skip.value > base.size() - pos)
+         throw exception("apply_undo_delta: diff doesn't fit its base");
+      dest.insert(dest.end(), base.data() + pos, base.data() + pos + copy.value);
+      pos += copy.value + skip.value;
+      dest.insert(dest.end(), insert, insert + insert_size);
+   }
+   dest.insert(dest.end(), base.data() + pos, base.data() + base.size());
+}
+
+// A decoded entry from an undo segment. If delta is set, old_value is that diff applied to the
+// key's value after this change (see apply_undo_delta); decode_undo_segment resolves it when the
+// segment stores new values.
+struct undo_entry {
+   rocksdb::Slice                key       = {};
+   std::optional<rocksdb::Slice> old_value = {};
+   std::optional<rocksdb::Slice> delta     = {};
+};
+
+struct decoded_undo_segment {
+   bytes                   data     = {}; // Decompressed contents, if the segment was compressed
+   std::vector<undo_entry> entries  = {}; // Refers to data, resolved, or the original segment
+   std::deque<bytes>       resolved = {}; // Old values rebuilt from deltas
+};
+
+inline decoded_undo_segment decode_undo_segment(const rocksdb::Slice& segment, uint8_t format_version) {
+   decoded_undo_segment result;
+   rocksdb::Slice       contents      = segment;
+   bool                 has_new_value = true;
+   if (format_version >= 2) {
+      if (contents.empty())
+         throw exception("decode_undo_segment: missing segment header");
+      uint8_t header = contents[0];
+      contents.remove_prefix(1);
+      has_new_value = !(header & undo_segment_header::omit_new_value);
+      auto codec    = undo_codec(header & undo_segment_header::codec_mask);
+      if (codec != undo_codec::none) {
+         if (contents.size() < sizeof(uint32_t))
+            throw exception("decode_undo_segment: truncated segment");
+         uint32_t size;
+         memcpy(&size, contents.data(), sizeof(size));
+         contents.remove_prefix(sizeof(size));
+         result.data.resize(size);
+         decompress_undo_segment(codec, contents, result.data);
+         contents = to_slice(result.data);
+      }
+   }
+   fc::datastream<const char*> ds(contents.data(), contents.size());
+   while (ds.remaining()) {
+      auto [key, key_size] = get_bytes(ds);
+      auto& entry          = result.entries.emplace_back();
+      entry.key            = { key, key_size };
+      uint8_t kind;
+      fc::raw::unpack(ds, kind);
+      if (kind == undo_value_kind::full || (kind == undo_value_kind::delta && format_version >= 3)) {
+         auto [value, value_size] = get_bytes(ds);
+         (kind == undo_value_kind::full ? entry.old_value : entry.delta) = rocksdb::Slice{ value, value_size };
+      } else if (kind != undo_value_kind::erased) {
+         throw exception("decode_undo_segment: bad undo entry");
+      }
+      if (has_new_value) {
+         auto [new_value, new_value_size] = get_optional_bytes(ds);
+         if (entry.delta) {
+            if (!new_value)
+               throw exception("decode_undo_segment: diff of an erased value");
+            apply_undo_delta(result.resolved.emplace_back(), { new_value, new_value_size }, *entry.delta);
+            entry.old_value = to_slice(result.resolved.back());
+            entry.delta     = std::nullopt;
+         }
+      }
+   }
+   return result;
+}
+
+// delta (format 3+) replaces old_value; see undo_value_kind
+template <typename Stream>
+void pack_undo_segment(Stream& s, const rocksdb::Slice& key, const std::optional<rocksdb::Slice>& old_value,
+                       const std::optional<rocksdb::Slice>& new_value, bool include_new_value = true,
+                       const std::optional<rocksdb::Slice>& delta = {}) {
+   pack_bytes(s, key);
+   if (delta) {
+      fc::raw::pack(s, undo_value_kind::delta);
+      pack_bytes(s, *delta);
+   } else {
+      pack_optional_bytes(s, old_value);
+   }
+   if (include_new_value)
+      pack_optional_bytes(s, new_value);
+}
+
+// Size of fc::unsigned_int's varint
+inline size_t packed_varint_size(uint64_t v) {
+   size_t size = 1;
+   for (; v >= 0x80; v >>= 7) ++size;
+   return size;
+}
+
+// The number of bytes pack_undo_segment writes
+inline size_t undo_entry_size(const rocksdb::Slice& key, const std::optional<rocksdb::Slice>& old_value,
+                              const std::optional<rocksdb::Slice>& new_value, bool include_new_value = true,
+                              const std::optional<rocksdb::Slice>& delta = {}) {
+   auto optional_size = [](const std::optional<rocksdb::Slice>& v) {
+      return 1 + (v ? packed_varint_size(v->size()) + v->size() : 0);
+   };
+   return packed_varint_size(key.size()) + key.size() + optional_size(delta ? delta : old_value) +
+          (include_new_value ? optional_size(new_value) : 0);
+}
+
+// Append key so the result is self-delimiting and sorts like key: 0x00 becomes 0x00 0xff, and
+// 0x00 0x00 ends it. The history index escapes keys this way, so what follows a key doesn't
+// interleave its entries with those of longer keys.
+inline void append_escaped_key(bytes& dest, const rocksdb::Slice& key) {
+   for (size_t i = 0; i < key.size(); ++i) {
+      dest.push_back(key[i]);
+      if (!key[i])
+         dest.push_back((char)0xff);
+   }
+   dest.push_back(0x00);
+   dest.push_back(0x00);
+}
+
+// Reverse append_escaped_key. Returns the number of bytes of src it used.
+inline size_t unescape_key(bytes& dest, const rocksdb::Slice& src) {
+   for (size_t i = 0; i < src.size(); ++i) {
+      if (src[i]) {
+         dest.push_back(src[i]);
+         continue;
+      }
+      if (i + 1 == src.size())
+         break;
+      if (!src[++i])
+         return i + 1;
+      if (src[i] != (char)0xff)
+         break;
+      dest.push_back(0x00);
+   }
+   throw exception("unescape_key: bad escaped key");
+}
+
+class undo_stack {
+ private:
+   database&  db;
+   bytes      undo_prefix;
+   uint64_t   target_segment_size;
+   undo_codec codec;
+   int        codec_level;
+   bool       store_new_value;
+   uint64_t   undo_batch_size;
+   uint32_t   undo_threads;
+   bool       sorted_changes;
+   uint32_t   encode_threads;
+   bool       delta_values;
+   bool       history_index;
+   bool       revision_keys;
+   bytes      state_prefix;
+   bytes      segment_prefix;
+   bytes      segment_next_prefix;
+   bytes      index_prefix;
+   bytes      index_next_prefix;
+   bytes      revision_prefix;
+   bytes      revision_next_prefix;
+   undo_state state;
+
+   // Format 4+: revisions whose keys write_state must update, or remove if they're gone
+   std::vector<int64_t> changed_revisions;
+
+   // get_at's most recently read segment
+   struct history_segment {
+      uint64_t             number  = 0;
+      bytes                data    = {};
+      decoded_undo_segment decoded = {}; // Refers to data
+   };
+   std::unique_ptr<history_segment> history_cache;
+
+ public:
+   undo_stack(database& db, const bytes& undo_prefix, uint64_t target_segment_size = 64 * 1024 * 1024)
+       : undo_stack(db, undo_prefix, undo_stack_config{ target_segment_size }) {}
+
+   undo_stack(database& db, const bytes& undo_prefix, const undo_stack_config& config)
+       : db{ db }, undo_prefix{ undo_prefix }, target_segment_size{ config.target_segment_size },
+         codec{ config.codec }, codec_level{ config.codec_level }, store_new_value{ config.store_new_value },
+         undo_batch_size{ config.undo_batch_size }, undo_threads{ config.undo_threads },
+         sorted_changes{ config.sorted_changes }, encode_threads{ config.encode_threads },
+         delta_values{ config.delta_values }, history_index{ config.history_index },
+         revision_keys{ config.revision_keys } {
+      if (!undo_threads)
+         undo_threads = std::max(1u, std::thread::hardware_concurrency());
+      if (!encode_threads)
+         encode_threads = std::max(1u, std::thread::hardware_concurrency());
+      if (!undo_codec_available(codec))
+         throw exception("undo codec isn't available in this build");
+      if (this->undo_prefix.empty())
+         throw exception("undo_prefix is empty");
+
+      // Sentinels reserve 0x00 and 0xff. This keeps rocksdb iterators from going
+      // invalid during iteration.
+      if (this->undo_prefix[0] == 0x00 || this->undo_prefix[0] == (char)0xff)
+         throw exception("undo_stack may not have a prefix which begins with 0x00 or 0xff");
+
+      state_prefix = this->undo_prefix;
+      state_prefix.push_back(0x00);
+      segment_prefix = this->undo_prefix;
+      segment_prefix.push_back(0x80);
+      segment_next_prefix = get_next_prefix(segment_prefix);
+      index_prefix        = this->undo_prefix;
+      index_prefix.push_back(0x40);
+      index_next_prefix = get_next_prefix(index_prefix);
+      revision_prefix   = this->undo_prefix;
+      revision_prefix.push_back(0x01);
+      revision_next_prefix = get_next_prefix(revision_prefix);
+
+      if (db.undo_column_family() != db.rdb->DefaultColumnFamily())
+         migrate_to_undo_column_family();
+
+      rocksdb::PinnableSlice v;
+      auto stat = db.rdb->Get(rocksdb::ReadOptions(), db.undo_column_family(), to_slice(this->state_prefix), &v);
+      if (!stat.IsNotFound())
+         check(stat, "undo_stack::undo_stack: rocksdb::DB::Get: ");
+      if (stat.ok()) {
+         auto format_version = fc::raw::unpack<uint8_t>(v.data(), v.size());
+         if (format_version > undo_state::max_format_version)
+            throw exception("invalid undo format");
+         state = unpack_undo_state(v);
+         if (state.format_version >= 4)
+            load_revision_keys();
+      }
+      // Format 1 only extends undo_state, so upgrading is always safe
+      state.format_version = std::max<uint8_t>(state.format_version, 1);
+      upgrade_format();
+
+      if (state.undo_in_progress)
+         undo();
+   }
+
+   uint8_t format_version() const { return state.format_version; }
+   const bytes& prefix() const { return undo_prefix; }
+
+   // Checkpoint the database, recording revision() in the checkpoint's metadata
+   void checkpoint(const std::string& path) {
+      check_no_undo_in_progress();
+      write_state();
+      db.checkpoint(path, revision_metadata(state.revision));
+   }
+
+   // The revision recorded by checkpoint()
+   static int64_t checkpoint_revision(const std::string& path) {
+      return parse_revision_metadata(database::read_checkpoint_metadata(path));
+   }
+
+   static std::string revision_metadata(int64_t revision) { return "revision=" + std::to_string(revision); }
+
+   static int64_t parse_revision_metadata(const std::string& metadata) {
+      static constexpr std::string_view tag = "revision=";
+      if (metadata.compare(0, tag.size(), tag))
+         throw exception("metadata has no revision");
+      try {
+         return std::stoll(metadata.substr(tag.size()));
+      } catch (std::exception&) { throw exception("metadata has an invalid revision"); }
+   }
+
+   int64_t revision() const { return state.revision; }
+   int64_t first_revision() const { return state.revision - state.undo_stack.size(); }
+
+   void set_revision(uint64_t revision, bool write_now = true) {
+      check_no_undo_in_progress();
+      if (state.undo_stack.size() != 0)
+         throw exception("cannot set revision while there is an existing undo stack");
+      if (revision > std::numeric_limits<int64_t>::max())
+         throw exception("revision to set is too high");
+      if (revision < state.revision)
+         throw exception("revision cannot decrease");
+      state.revision = revision;
+      if (write_now)
+         write_state();
+   }
+
+   // Create a new entry on the undo stack
+   //
+   // With database_config::sync_wal_on_revision, push() and commit() sync the WAL before
+   // returning. After a crash, the database reopens with revision() at least that of the last
+   // push(write_now) or commit() which returned. Each write_changes is atomic with the undo state
+   // it updates, and the WAL keeps them in order, so the reopened state is revision() - 1 plus
+   // some prefix of the revision's write_changes; undo() returns to revision() - 1 exactly, and
+   // the caller resumes from there.
+   void push(bool write_now = true) {
+      check_no_undo_in_progress();
+      state.undo_stack.push_back(0);
+      ++state.revision;
+      revision_changed(state.revision);
+      if (write_now)
+         write_state();
+      if (db.sync_wal_on_revision)
+         db.sync_wal();
+   }
+
+   // Combine the top two states on the undo stack
+   void squash(bool write_now = true) {
+      check_no_undo_in_progress();
+      if (state.undo_stack.empty()) {
+         return;
+      } else if (state.undo_stack.size() == 1) {
+         rocksdb::WriteBatch batch;
+         check(batch.DeleteRange(db.undo_column_family(), to_slice(create_segment_key(0)),
+                                 to_slice(create_segment_key(state.next_undo_segment))),
+               "undo_stack::squash: rocksdb::WriteBatch::DeleteRange: ");
+         check(batch.DeleteRange(db.undo_column_family(), to_slice(index_prefix), to_slice(index_next_prefix)),
+               "undo_stack::squash: rocksdb::WriteBatch::DeleteRange: ");
+         history_cache.reset();
+         revision_changed(state.revision);
+         state.undo_stack.clear();
+         --state.revision;
+         write_state(batch);
+         db.write(batch);
+         db.undo_range_deleted(to_slice(create_segment_key(0)), to_slice(create_segment_key(state.next_undo_segment)));
+         return;
+      }
+      auto n = state.undo_stack.back();
+      state.undo_stack.pop_back();
+      state.undo_stack.back() += n;
+      revision_changed(state.revision);
+      --state.revision;
+      revision_changed(state.revision);
+      if (write_now)
+         write_state();
    }
 
    // Reset the contents to the state at the top of the undo stack
+   //
+   // Segments are applied newest first, in batches of about undo_batch_size bytes, each
+   // decoded in parallel. Each batch removes the segments it applied and records progress in
+   // the same write, so memory stays bounded and an interrupted undo can resume; the
+   // constructor finishes one left by a crash.
    void undo(bool write_now = true) {
       if (state.undo_stack.empty())
          throw exception("nothing to undo");
+      db.wait_for_writes();
+      latency_timer timer{ latency::undo };
+      history_cache.reset();
+      do {
+         std::vector<std::pair<bytes, bytes>> segments; // newest first
+         load_undo_batch(segments);
+         auto decoded = decode_undo_batch(segments);
+         resolve_deltas(decoded);
+
+         rocksdb::WriteBatch batch;
+         std::vector<bytes>  undone_keys;
+         for (size_t i = 0; i < segments.size(); ++i) {
+            auto number = key_number(to_slice(segments[i].first));
+            for (auto& entry : decoded[i].entries) {
+               if (db.shared_read_cache)
+                  undone_keys.push_back(to_bytes(entry.key));
+               if (history_index)
+                  check(batch.Delete(db.undo_column_family(), to_slice(create_index_key(entry.key, number))),
+                        "undo_stack::undo: rocksdb::WriteBatch::Delete: ");
+               if (entry.old_value)
+                  check(batch.Put(entry.key, *entry.old_value), "undo_stack::undo: rocksdb::WriteBatch::Put: ");
+               else
+                  check(batch.Delete(entry.key), "undo_stack::undo: rocksdb::WriteBatch::Delete: ");
+            }
+            check(batch.Delete(db.undo_column_family(), to_slice(segments[i].first)),
+                  "undo_stack::undo: rocksdb::WriteBatch::Delete: ");
+         }
+
+         revision_changed(state.revision);
+         if (segments.empty() || segments.size() >= state.undo_stack.back()) {
+            state.next_undo_segment -= state.undo_stack.back();
+            state.undo_stack.pop_back();
+            --state.revision;
+            state.undo_in_progress = false;
+         } else {
+            state.next_undo_segment -= segments.size();
+            state.undo_stack.back() -= segments.size();
+            state.undo_in_progress = true;
+         }
+         if (write_now || !segments.empty()) {
+            write_state(batch);
+            db.write(batch);
+         }
+         for (auto& key : undone_keys) //
+            db.shared_read_cache->erase(to_slice(key));
+      } while (state.undo_in_progress);
+   }
+
+   // Discard all undo history prior to revision. See push() for durability. With
+   // undo_stack_config::history_index, the discarded segments are read to find their index entries.
+   void commit(int64_t revision) {
+      check_no_undo_in_progress();
+      revision            = std::min(revision, state.revision);
+      auto first_revision = state.revision - state.undo_stack.size();
+      if (first_revision < revision) {
+         rocksdb::WriteBatch batch;
+         state.undo_stack.erase(state.undo_stack.begin(), state.undo_stack.begin() + (revision - first_revision));
+         uint64_t keep_undo_segment = state.next_undo_segment;
+         for (auto n : state.undo_stack) //
+            keep_undo_segment -= n;
+         if (history_index)
+            remove_index_entries(batch, keep_undo_segment);
+         check(batch.DeleteRange(db.undo_column_family(), to_slice(create_segment_key(0)),
+                                 to_slice(create_segment_key(keep_undo_segment))),
+               "undo_stack::commit: rocksdb::WriteBatch::DeleteRange: ");
+         if (state.format_version >= 4)
+            check(batch.DeleteRange(db.undo_column_family(), to_slice(create_revision_key(first_revision + 1)),
+                                    to_slice(create_revision_key(revision + 1))),
+                  "undo_stack::commit: rocksdb::WriteBatch::DeleteRange: ");
+         write_state(batch);
+         db.write(batch);
+         db.undo_range_deleted(to_slice(create_segment_key(0)), to_slice(create_segment_key(keep_undo_segment)));
+      }
+      if (db.sync_wal_on_revision)
+         db.sync_wal();
+   }
+
+   // Write changes in `change_list`. Everything in `change_list` must belong to `cache`.
+   //
+   // It is undefined behavior if any `orig_value` in `change_list` doesn't match the
+   // database's current state. Entries with `orig_value_pending` are exempt; they're
+   // written unconditionally, and if an undo segment is needed, their original values
+   // are read with a single MultiGet.
+   void write_changes(cache_map& cache, cache_map::iterator change_list) {
       rocksdb::WriteBatch batch;
+      prepare_changes(batch, cache, change_list);
+      db.write(batch);
+
+      if (db.shared_read_cache)
+         for (auto it = change_list; it != cache.end(); it = it->second.change_list_next)
+            db.shared_read_cache->update(it->first, it->second.current_value);
+   }
+
+   // Like write_changes, but the write happens on the database's background thread. The undo
+   // state advances immediately; operations which read undo segments or original values wait
+   // for queued writes first. `cache` may be wiped once this returns.
+   std::future<void> write_changes_async(cache_map& cache, cache_map::iterator change_list) {
+      rocksdb::WriteBatch batch;
+      prepare_changes(batch, cache, change_list);
+
+      std::function<void()> on_written;
+      if (db.shared_read_cache) {
+         std::vector<std::pair<bytes, std::optional<bytes>>> updates;
+         for (auto it = change_list; it != cache.end(); it = it->second.change_list_next) {
+            auto& [k, v] = updates.emplace_back(to_bytes(it->first), std::nullopt);
+            if (it->second.current_value)
+               v = to_bytes(*it->second.current_value);
+         }
+         on_written = [cache = db.shared_read_cache.get(), updates = std::move(updates)] {
+            for (auto& [k, v] : updates) //
+               cache->update(to_slice(k), v ? std::optional{ to_slice(*v) } : std::nullopt);
+         };
+      }
+      return db.write_async(std::move(batch), std::move(on_written));
+   }
+
+   void write_state() {
+      rocksdb::WriteBatch batch;
+      write_state(batch);
+      db.write(batch);
+   }
+
+   // The value key had when revision() was `revision`, for first_revision() <= revision <=
+   // revision(). Needs undo_stack_config::history_index. The index locates the key's first undo
+   // entry after revision instead of replaying undo(). This reads the database, so changes which
+   // haven't been written by write_changes aren't seen.
+   std::optional<bytes> get_at(int64_t revision, const rocksdb::Slice& key) {
+      check_no_undo_in_progress();
+      if (!history_index)
+         throw exception("undo_stack::get_at: history_index isn't enabled");
+      if (revision < first_revision() || revision > state.revision)
+         throw exception("undo_stack::get_at: revision is out of range");
+      db.wait_for_writes();
+
+      // A diff needs the value after its change: the old value of the key's next entry, or else
+      // the database's value
+      iterator_bounds                    bounds{ history_key_prefix(key) };
+      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(database::iterator_options(nullptr, bounds),
+                                                                       db.undo_column_family()) };
+      std::vector<bytes>                 deltas;
+      std::optional<bytes>               result;
+      bool                               found = false;
+      for (rocks_it->Seek(to_slice(create_index_key(key, first_segment_after(revision)))); rocks_it->Valid();
+           rocks_it->Next()) {
+         auto  position = fc::raw::unpack<fc::unsigned_int>(rocks_it->value().data(), rocks_it->value().size());
+         auto& entries  = load_history_segment(key_number(rocks_it->key())).entries;
+         if (position.value >= entries.size() || compare_blob(entries[position.value].key, key))
+            throw exception("undo_stack::get_at: history index doesn't match its segment");
+         auto& entry = entries[position.value];
+         if (entry.delta) {
+            deltas.push_back(to_bytes(*entry.delta));
+            continue;
+         }
+         if (entry.old_value)
+            result = to_bytes(*entry.old_value);
+         found = true;
+         break;
+      }
+      check(rocks_it->status(), "undo_stack::get_at: iterate rocksdb: ");
+      if (!found) {
+         rocksdb::PinnableSlice v;
+         auto stat = db.rdb->Get(rocksdb::ReadOptions(), db.rdb->DefaultColumnFamily(), key, &v);
+         if (!stat.IsNotFound()) {
+            check(stat, "undo_stack::get_at: rocksdb::DB::Get: ");
+            result = to_bytes(v);
+         }
+      }
+      for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+         if (!result)
+            throw exception("undo_stack::get_at: diff of an erased value");
+         bytes value;
+         apply_undo_delta(value, to_slice(*result), to_slice(*it));
+         result = std::move(value);
+      }
+      return result;
+   }
+
+   // History index keys for key begin with this
+   bytes history_key_prefix(const rocksdb::Slice& key) const {
+      bytes result;
+      result.reserve(index_prefix.size() + key.size() + 2);
+      result.insert(result.end(), index_prefix.begin(), index_prefix.end());
+      append_escaped_key(result, key);
+      return result;
+   }
+
+   // The key a history index key belongs to
+   bytes history_key(const rocksdb::Slice& index_key) const {
+      if (!index_key.starts_with(to_slice(index_prefix)))
+         throw exception("undo_stack::history_key: not a history index key");
+      bytes result;
+      unescape_key(result, { index_key.data() + index_prefix.size(), index_key.size() - index_prefix.size() });
+      return result;
+   }
+
+ private:
+   struct change {
+      cache_map::iterator           it;
+      std::optional<rocksdb::Slice> orig_value;
+      bool                          known;
+      bool                          has_delta    = false; // orig_value is stored as a diff in prepare_changes' deltas
+      size_t                        delta_offset = 0;
+      size_t                        delta_size   = 0;
+   };
+
+   // Entries [begin, end) of prepare_changes' undo entries. The value written is header + data.
+   struct encoded_segment {
+      size_t                                 begin       = 0;
+      size_t                                 end         = 0;
+      size_t                                 size        = 0;  // Packed size of the entries
+      std::array<char, 1 + sizeof(uint32_t)> header      = {}; // Format 2+: flags, then size if compressed
+      size_t                                 header_size = 0;
+      bytes                                  data        = {};
+   };
+
+   void prepare_changes(rocksdb::WriteBatch& batch, cache_map& cache, cache_map::iterator change_list) {
+      check_no_undo_in_progress();
+      upgrade_format();
+      add_metric(metric::undo_revision_writes);
+      bool include_new_value = state.format_version < 2 || store_new_value;
+
+      // Gather the changes so the passes below don't chase change_list through map nodes
+      std::vector<change> changes;
+      for (auto it = change_list; it != cache.end(); it = it->second.change_list_next)
+         changes.push_back({ it, it->second.orig_value, !it->second.orig_value_pending });
+      if (sorted_changes)
+         std::sort(changes.begin(), changes.end(),
+                   [](const change& a, const change& b) { return compare_blob(a.it->first, b.it->first) < 0; });
+
+      std::vector<rocksdb::PinnableSlice> pending_values;
+      if (!state.undo_stack.empty()) {
+         std::vector<change*>        pending;
+         std::vector<rocksdb::Slice> keys;
+         for (auto& c : changes) {
+            if (!c.known) {
+               pending.push_back(&c);
+               keys.push_back(c.it->first);
+            }
+         }
+         if (!keys.empty()) {
+            db.wait_for_writes();
+            pending_values.resize(keys.size());
+            std::vector<rocksdb::Status> statuses(keys.size());
+            db.rdb->MultiGet(rocksdb::ReadOptions(), db.rdb->DefaultColumnFamily(), keys.size(), keys.data(),
+                             pending_values.data(), statuses.data(), sorted_changes);
+            for (size_t i = 0; i < pending.size(); ++i) {
+               if (!statuses[i].IsNotFound()) {
+                  check(statuses[i], "undo_stack::write_changes: rocksdb::DB::MultiGet: ");
+                  pending[i]->orig_value = pending_values[i];
+               }
+               pending[i]->known = true;
+            }
+         }
+      }
+
+      // Sizes are known up front, so segments are cut before encoding: a segment ends when the next
+      // entry would pass target_segment_size.
+      std::vector<encoded_segment> segments;
+      std::vector<const change*>   entries;
+      bytes                        deltas;
+      bool                         use_deltas = delta_values && state.format_version >= 3;
+      for (auto& c : changes) {
+         auto& [k, v] = *c.it;
+         if (!c.known || compare_value(c.orig_value, v.current_value)) {
+            if (v.current_value)
+               check(batch.Put(k, *v.current_value), "undo_stack::write_changes: rocksdb::WriteBatch::Put: ");
+            else
+               check(batch.Delete(k), "undo_stack::write_changes: rocksdb::WriteBatch::Erase: ");
+            if (!state.undo_stack.empty()) {
+               std::optional<rocksdb::Slice> delta;
+               if (use_deltas && c.orig_value && v.current_value &&
+                   c.orig_value->size() >= min_undo_delta_value_size) {
+                  c.delta_offset = deltas.size();
+                  if (append_undo_delta(deltas, *c.orig_value, *v.current_value)) {
+                     c.has_delta  = true;
+                     c.delta_size = deltas.size() - c.delta_offset;
+                     delta        = rocksdb::Slice{ deltas.data() + c.delta_offset, c.delta_size };
+                  }
+               }
+               auto size = undo_entry_size(k, c.orig_value, v.current_value, include_new_value, delta);
+               if (segments.empty() || segments.back().size + size > target_segment_size)
+                  segments.push_back({ entries.size(), entries.size() });
+               ++segments.back().end;
+               segments.back().size += size;
+               entries.push_back(&c);
+            }
+         }
+      }
+      encode_segments(segments, entries, deltas, include_new_value);
+
+      for (auto& seg : segments) {
+         if (history_index) {
+            for (size_t i = seg.begin; i < seg.end; ++i) {
+               char                  position[5];
+               fc::datastream<char*> ds(position, sizeof(position));
+               fc::raw::pack(ds, fc::unsigned_int(i - seg.begin));
+               check(batch.Put(db.undo_column_family(),
+                               to_slice(create_index_key(entries[i]->it->first, state.next_undo_segment)),
+                               rocksdb::Slice{ position, size_t(ds.tellp()) }),
+                     "undo_stack::write_changes: rocksdb::WriteBatch::Put: ");
+            }
+         }
+         auto           key       = create_segment_key(state.next_undo_segment++);
+         rocksdb::Slice key_slice = to_slice(key);
+         rocksdb::Slice value[]   = { { seg.header.data(), seg.header_size }, to_slice(seg.data) };
+         check(batch.Put(db.undo_column_family(), rocksdb::SliceParts{ &key_slice, 1 },
+                         rocksdb::SliceParts{ value, 2 }),
+               "undo_stack::write_changes: rocksdb::WriteBatch::Put: ");
+         add_metric(metric::undo_segments);
+         add_metric(metric::undo_segment_bytes, seg.header_size + seg.data.size());
+         ++state.undo_stack.back();
+      }
+      if (!segments.empty())
+         revision_changed(state.revision);
+      write_state(batch);
+   } // prepare_changes()
+
+   // Pack and compress segments; each thread gets a contiguous range
+   void encode_segments(std::vector<encoded_segment>& segments, const std::vector<const change*>& entries,
+                        const bytes& deltas, bool include_new_value) {
+      bool compress     = state.format_version >= 2 && codec != undo_codec::none;
+      auto encode_range = [&](size_t begin, size_t end) {
+         bytes packed;
+         for (size_t i = begin; i < end; ++i) {
+            auto&  seg  = segments[i];
+            bytes& dest = compress ? packed : seg.data;
+            dest.resize(seg.size);
+            fc::datastream<char*> ds(dest.data(), dest.size());
+            for (size_t j = seg.begin; j < seg.end; ++j) {
+               auto&                         c = *entries[j];
+               std::optional<rocksdb::Slice> delta;
+               if (c.has_delta)
+                  delta = rocksdb::Slice{ deltas.data() + c.delta_offset, c.delta_size };
+               pack_undo_segment(ds, c.it->first, c.orig_value, c.it->second.current_value, include_new_value, delta);
+            }
+            if (state.format_version < 2)
+               continue;
+            seg.header[0]   = include_new_value ? 0 : undo_segment_header::omit_new_value;
+            seg.header_size = 1;
+            if (compress) {
+               if (compress_undo_segment(codec, codec_level, to_slice(packed), seg.data)) {
+                  uint32_t size = packed.size();
+                  seg.header[0] |= uint8_t(codec);
+                  memcpy(seg.header.data() + 1, &size, sizeof(size));
+                  seg.header_size += sizeof(size);
+               } else {
+                  seg.data.swap(packed);
+               }
+            }
+         }
+      };
+      size_t num_tasks = std::min<size_t>(encode_threads, segments.size());
+      db.run_parallel(num_tasks, [&](size_t i) {
+         encode_range(segments.size() * i / num_tasks, segments.size() * (i + 1) / num_tasks);
+      });
+   }
+
+   void write_state(rocksdb::WriteBatch& batch) {
+      fc::datastream<size_t> size_stream;
+      pack_undo_state(size_stream, state);
+      bytes                 data(size_stream.tellp());
+      fc::datastream<char*> ds(data.data(), data.size());
+      pack_undo_state(ds, state);
+      check(batch.Put(db.undo_column_family(), to_slice(state_prefix), to_slice(data)),
+            "undo_stack::write_state: rocksdb::WriteBatch::Put: ");
+
+      auto first = first_revision();
+      for (auto revision : changed_revisions) {
+         auto key = create_revision_key(revision);
+         if (revision > first && revision <= state.revision) {
+            auto count = state.undo_stack[revision - first - 1];
+            check(batch.Put(db.undo_column_family(), to_slice(key),
+                            rocksdb::Slice{ reinterpret_cast<const char*>(&count), sizeof(count) }),
+                  "undo_stack::write_state: rocksdb::WriteBatch::Put: ");
+         } else {
+            check(batch.Delete(db.undo_column_family(), to_slice(key)),
+                  "undo_stack::write_state: rocksdb::WriteBatch::Delete: ");
+         }
+      }
+      changed_revisions.clear();
+   }
+
+   // Format 4+: the next write_state records revision's segment count, or removes its key
+   void revision_changed(int64_t revision) {
+      if (state.format_version >= 4)
+         changed_revisions.push_back(revision);
+   }
+
+   bytes create_revision_key(int64_t revision) const {
+      bytes key;
+      key.reserve(revision_prefix.size() + sizeof(uint64_t));
+      key.insert(key.end(), revision_prefix.begin(), revision_prefix.end());
+      append_key(key, uint64_t(revision));
+      return key;
+   }
+
+   // Format 4+: rebuild undo_stack from the revision keys, which must cover exactly
+   // revision() - undo_depth + 1 through revision()
+   void load_revision_keys() {
+      iterator_bounds                    bounds{ revision_prefix };
+      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(database::iterator_options(nullptr, bounds),
+                                                                       db.undo_column_family()) };
+      uint64_t                           next = state.revision - state.undo_depth + 1;
+      for (rocks_it->SeekToFirst(); rocks_it->Valid(); rocks_it->Next(), ++next) {
+         if (key_number(rocks_it->key()) != next || rocks_it->value().size() != sizeof(uint64_t))
+            throw exception("undo_stack::undo_stack: revision keys don't match the undo state");
+         uint64_t count;
+         memcpy(&count, rocks_it->value().data(), sizeof(count));
+         state.undo_stack.push_back(count);
+      }
+      check(rocks_it->status(), "undo_stack::undo_stack: iterate rocksdb: ");
+      if (state.undo_stack.size() != state.undo_depth)
+         throw exception("undo_stack::undo_stack: revision keys don't match the undo state");
+   }
+
+   // Move this undo_stack's keys from the default column family. Segments are copied in
+   // batches first; the final batch writes the state and removes the originals, so an
+   // interrupted migration restarts safely.
+   void migrate_to_undo_column_family() {
+      auto                   default_cf = db.rdb->DefaultColumnFamily();
+      rocksdb::PinnableSlice v;
+      auto                   stat = db.rdb->Get(rocksdb::ReadOptions(), default_cf, to_slice(state_prefix), &v);
+      if (stat.IsNotFound())
+         return;
+      check(stat, "undo_stack::migrate_to_undo_column_family: rocksdb::DB::Get: ");
+
+      rocksdb::WriteBatch                batch;
+      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(database::iterator_options(), default_cf) };
+      for (auto [begin, end] : { std::pair{ &revision_prefix, &revision_next_prefix },
+                                 std::pair{ &index_prefix, &index_next_prefix },
+                                 std::pair{ &segment_prefix, &segment_next_prefix } }) {
+         for (rocks_it->Seek(to_slice(*begin)); rocks_it->Valid() && compare_blob(rocks_it->key(), *end) < 0;
+              rocks_it->Next()) {
+            check(batch.Put(db.undo_column_family(), rocks_it->key(), rocks_it->value()),
+                  "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::Put: ");
+            if (batch.GetDataSize() >= undo_batch_size)
+               db.write(batch);
+         }
+         check(rocks_it->status(), "undo_stack::migrate_to_undo_column_family: iterate rocksdb: ");
+      }
+      check(batch.Put(db.undo_column_family(), to_slice(state_prefix), v),
+            "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::Put: ");
+      check(batch.Delete(default_cf, to_slice(state_prefix)),
+            "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::Delete: ");
+      check(batch.DeleteRange(default_cf, to_slice(segment_prefix), to_slice(segment_next_prefix)),
+            "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::DeleteRange: ");
+      check(batch.DeleteRange(default_cf, to_slice(index_prefix), to_slice(index_next_prefix)),
+            "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::DeleteRange: ");
+      check(batch.DeleteRange(default_cf, to_slice(revision_prefix), to_slice(revision_next_prefix)),
+            "undo_stack::migrate_to_undo_column_family: rocksdb::WriteBatch::DeleteRange: ");
+      db.write(batch);
+   }
 
-      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(rocksdb::ReadOptions()) };
-      auto                               first = create_segment_key(state.next_undo_segment - state.undo_stack.back());
+   // Format 2 changes the segment encoding; only switch when no segments remain. Format 3 only
+   // adds an entry kind, so format 2 segments stay valid. Format 4 only moves undo_stack into
+   // revision keys; the next write_state writes them all along with the state.
+   void upgrade_format() {
+      if (state.format_version < 2) {
+         for (auto n : state.undo_stack)
+            if (n)
+               return;
+         state.format_version = 2;
+      }
+      if (delta_values)
+         state.format_version = std::max<uint8_t>(state.format_version, 3);
+      if (revision_keys && state.format_version < 4) {
+         state.format_version = 4;
+         for (auto revision = first_revision() + 1; revision <= state.revision; ++revision) //
+            revision_changed(revision);
+      }
+   }
+
+   void check_no_undo_in_progress() {
+      if (state.undo_in_progress)
+         throw exception("an interrupted undo must be finished first");
+   }
+
+   // Load the newest segments of the top revision, up to about undo_batch_size bytes
+   void load_undo_batch(std::vector<std::pair<bytes, bytes>>& segments) {
+      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(database::iterator_options(),
+                                                                       db.undo_column_family()) };
+      auto first = create_segment_key(state.next_undo_segment - state.undo_stack.back());
       rocks_it->Seek(to_slice(segment_next_prefix));
       if (rocks_it->Valid())
          rocks_it->Prev();
-
-      while (rocks_it->Valid()) {
+      else if (rocks_it->status().ok())
+         rocks_it->SeekToLast(); // The undo column family has no sentinels
+      uint64_t batch_size = 0;
+      while (rocks_it->Valid() && (segments.empty() || batch_size < undo_batch_size)) {
          auto segment_key = rocks_it->key();
          if (compare_blob(segment_key, first) < 0)
             break;
-         write_now                           = true;
-         auto                        segment = rocks_it->value();
-         fc::datastream<const char*> ds(segment.data(), segment.size());
-         while (ds.remaining()) {
-            auto [key, key_size]             = get_bytes(ds);
-            auto [old_value, old_value_size] = get_optional_bytes(ds);
-            get_optional_bytes(ds);
-            if (old_value)
-               check(batch.Put({ key, key_size }, { old_value, old_value_size }),
-                     "undo_stack::undo: rocksdb::WriteBatch::Put: ");
-            else
-               check(batch.Delete({ key, key_size }), "undo_stack::undo: rocksdb::WriteBatch::Delete: ");
-         }
-         check(batch.Delete(segment_key), "undo_stack::undo: rocksdb::WriteBatch::Delete: ");
+         segments.emplace_back(to_bytes(segment_key), to_bytes(rocks_it->value()));
+         batch_size += segments.back().second.size();
          rocks_it->Prev();
       }
       check(rocks_it->status(), "undo_stack::undo: iterate rocksdb: ");
-
-      state.next_undo_segment -= state.undo_stack.back();
-      state.undo_stack.pop_back();
-      --state.revision;
-      if (write_now) {
-         write_state(batch);
-         db.write(batch);
-      }
    }
 
-   // Discard all undo history prior to revision
-   void commit(int64_t revision) {
-      revision            = std::min(revision, state.revision);
-      auto first_revision = state.revision - state.undo_stack.size();
-      if (first_revision < revision) {
-         rocksdb::WriteBatch batch;
-         state.undo_stack.erase(state.undo_stack.begin(), state.undo_stack.begin() + (revision - first_revision));
-         uint64_t keep_undo_segment = state.next_undo_segment;
-         for (auto n : state.undo_stack) //
-            keep_undo_segment -= n;
-         check(batch.DeleteRange(to_slice(create_segment_key(0)), to_slice(create_segment_key(keep_undo_segment))),
-               "undo_stack::commit: rocksdb::WriteBatch::DeleteRange: ");
-         write_state(batch);
-         db.write(batch);
-      }
+   // Decode segments; each thread gets a contiguous range. The result refers to segments.
+   std::vector<decoded_undo_segment> decode_undo_batch(const std::vector<std::pair<bytes, bytes>>& segments) {
+      std::vector<decoded_undo_segment> result(segments.size());
+      auto                              decode_range = [&](size_t begin, size_t end) {
+         for (size_t i = begin; i < end; ++i) //
+            result[i] = decode_undo_segment(to_slice(segments[i].second), state.format_version);
+      };
+      size_t num_tasks = std::min<size_t>(undo_threads, segments.size());
+      db.run_parallel(num_tasks, [&](size_t i) {
+         decode_range(segments.size() * i / num_tasks, segments.size() * (i + 1) / num_tasks);
+      });
+      return result;
    }
 
-   // Write changes in `change_list`. Everything in `change_list` must belong to `cache`.
-   //
-   // It is undefined behavior if any `orig_value` in `change_list` doesn't match the
-   // database's current state.
-   void write_changes(cache_map& cache, cache_map::iterator change_list) {
-      rocksdb::WriteBatch batch;
-      bytes               segment;
-      segment.reserve(target_segment_size);
-
-      auto write_segment = [&] {
-         if (segment.empty())
-            return;
-         auto key = create_segment_key(state.next_undo_segment++);
-         check(batch.Put(to_slice(key), to_slice(segment)), "undo_stack::write_changes: rocksdb::WriteBatch::Put: ");
-         ++state.undo_stack.back();
-         segment.clear();
-      };
+   // Rebuild old values stored as diffs against the key's value after the change. Entries are
+   // in the order undo() applies them, so that's the old value of the key's previous entry in
+   // the batch, or else the database's value.
+   void resolve_deltas(std::vector<decoded_undo_segment>& decoded) {
+      std::set<rocksdb::Slice, less_blob> delta_keys;
+      for (auto& segment : decoded)
+         for (auto& entry : segment.entries)
+            if (entry.delta)
+               delta_keys.insert(entry.key);
+      if (delta_keys.empty())
+         return;
 
-      auto append_segment = [&](auto f) {
-         fc::datastream<size_t> size_stream;
-         f(size_stream);
-         if (segment.size() + size_stream.tellp() > target_segment_size)
-            write_segment();
-         auto orig_size = segment.size();
-         segment.resize(segment.size() + size_stream.tellp());
-         fc::datastream<char*> ds(segment.data() + orig_size, size_stream.tellp());
-         f(ds);
-      };
+      std::set<rocksdb::Slice, less_blob> seen;
+      std::vector<rocksdb::Slice>         db_keys;
+      for (auto& segment : decoded)
+         for (auto& entry : segment.entries)
+            if (delta_keys.count(entry.key) && seen.insert(entry.key).second && entry.delta)
+               db_keys.push_back(entry.key);
+      std::vector<rocksdb::PinnableSlice> values(db_keys.size());
+      std::vector<rocksdb::Status>        statuses(db_keys.size());
+      db.rdb->MultiGet(rocksdb::ReadOptions(), db.rdb->DefaultColumnFamily(), db_keys.size(), db_keys.data(),
+                       values.data(), statuses.data());
 
-      auto it = change_list;
-      while (it != cache.end()) {
-         if (compare_value(it->second.orig_value, it->second.current_value)) {
-            if (it->second.current_value)
-               check(batch.Put(to_slice(it->first), to_slice(*it->second.current_value)),
-                     "undo_stack::write_changes: rocksdb::WriteBatch::Put: ");
-            else
-               check(batch.Delete(to_slice(it->first)), "undo_stack::write_changes: rocksdb::WriteBatch::Erase: ");
-            if (!state.undo_stack.empty()) {
-               append_segment([&](auto& stream) {
-                  pack_undo_segment(stream, it->first, it->second.orig_value.get(), it->second.current_value.get());
-               });
+      // Values of delta_keys at the current point of the undo
+      std::map<rocksdb::Slice, std::optional<rocksdb::Slice>, less_blob> current;
+      for (size_t i = 0; i < db_keys.size(); ++i) {
+         if (statuses[i].IsNotFound()) {
+            current[db_keys[i]] = std::nullopt;
+         } else {
+            check(statuses[i], "undo_stack::undo: rocksdb::DB::MultiGet: ");
+            current[db_keys[i]] = values[i];
+         }
+      }
+      for (auto& segment : decoded) {
+         for (auto& entry : segment.entries) {
+            if (!delta_keys.count(entry.key))
+               continue;
+            auto& value = current[entry.key];
+            if (entry.delta) {
+               if (!value)
+                  throw exception("undo_stack::undo: diff of an erased value");
+               apply_undo_delta(segment.resolved.emplace_back(), *value, *entry.delta);
+               entry.old_value = to_slice(segment.resolved.back());
+               entry.delta     = std::nullopt;
             }
+            value = entry.old_value;
          }
-         it = it->second.change_list_next;
       }
-
-      write_segment();
-      write_state(batch);
-      db.write(batch);
-   } // write_changes()
-
-   void write_state() {
-      rocksdb::WriteBatch batch;
-      write_state(batch);
-      db.write(batch);
-   }
-
- private:
-   void write_state(rocksdb::WriteBatch& batch) {
-      check(batch.Put(to_slice(state_prefix), to_slice(fc::raw::pack(state))),
-            "undo_stack::write_state: rocksdb::WriteBatch::Put: ");
    }
 
    bytes create_segment_key(uint64_t segment) {
@@ -465,8 +2793,214 @@ class undo_stack {
       append_key(key, segment);
       return key;
    }
+
+   // The number which ends a segment, history index, or revision key
+   static uint64_t key_number(const rocksdb::Slice& key) {
+      if (key.size() < sizeof(uint64_t))
+         throw exception("undo_stack: key is too short to hold a segment number");
+      char buf[sizeof(uint64_t)];
+      memcpy(buf, key.data() + key.size() - sizeof(buf), sizeof(buf));
+      std::reverse(std::begin(buf), std::end(buf));
+      uint64_t result;
+      memcpy(&result, buf, sizeof(result));
+      return result;
+   }
+
+   bytes create_index_key(const rocksdb::Slice& key, uint64_t segment) const {
+      auto result = history_key_prefix(key);
+      append_key(result, segment);
+      return result;
+   }
+
+   // The first segment written after revision; segments from here on hold changes made later
+   uint64_t first_segment_after(int64_t revision) const {
+      uint64_t segment = state.next_undo_segment;
+      for (auto i = revision - first_revision(); i < int64_t(state.undo_stack.size()); ++i) //
+         segment -= state.undo_stack[i];
+      return segment;
+   }
+
+   // Remove the index entries of segments below `end`
+   void remove_index_entries(rocksdb::WriteBatch& batch, uint64_t end) {
+      auto                               end_key = create_segment_key(end);
+      std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(database::iterator_options(),
+                                                                       db.undo_column_family()) };
+      for (rocks_it->Seek(to_slice(segment_prefix)); rocks_it->Valid() && compare_blob(rocks_it->key(), end_key) < 0;
+           rocks_it->Next()) {
+         auto number  = key_number(rocks_it->key());
+         auto decoded = decode_undo_segment(rocks_it->value(), state.format_version);
+         for (auto& entry : decoded.entries)
+            check(batch.Delete(db.undo_column_family(), to_slice(create_index_key(entry.key, number))),
+                  "undo_stack::commit: rocksdb::WriteBatch::Delete: ");
+      }
+      check(rocks_it->status(), "undo_stack::commit: iterate rocksdb: ");
+      history_cache.reset();
+   }
+
+   const decoded_undo_segment& load_history_segment(uint64_t segment) {
+      if (history_cache && history_cache->number == segment)
+         return history_cache->decoded;
+      history_cache.reset();
+      auto                   cached = std::make_unique<history_segment>();
+      rocksdb::PinnableSlice v;
+      check(db.rdb->Get(rocksdb::ReadOptions(), db.undo_column_family(), to_slice(create_segment_key(segment)), &v),
+            "undo_stack::get_at: rocksdb::DB::Get: ");
+      cached->number  = segment;
+      cached->data    = to_bytes(v);
+      cached->decoded = decode_undo_segment(to_slice(cached->data), state.format_version);
+      history_cache   = std::move(cached);
+      return history_cache->decoded;
+   }
 }; // undo_stack
 
+// Presents a write_session's cache layered over another iterator's keys, as if the cache's changes
+// had been written. Erased entries hide the underlying keys. The cache must not change while this
+// exists.
+class cache_overlay_iterator : public rocksdb::Iterator {
+   const cache_map&                   cache;
+   std::unique_ptr<rocksdb::Iterator> base;
+   const iterator_bounds*             bounds; // Optional; should match base's bounds
+   cache_map::const_iterator          cache_it; // Forward: first entry >= position. Backward: last <= position, or end.
+   bool                               forward  = true;
+   bool                               at_cache = false; // Position comes from cache_it instead of base
+   bool                               valid    = false;
+
+ public:
+   cache_overlay_iterator(const cache_map& cache, std::unique_ptr<rocksdb::Iterator> base,
+                          const iterator_bounds* bounds = nullptr)
+       : cache{ cache }, base{ std::move(base) }, bounds{ bounds }, cache_it{ cache.end() } {}
+
+   bool            Valid() const override { return valid; }
+   rocksdb::Slice  key() const override { return at_cache ? cache_it->first : base->key(); }
+   rocksdb::Slice  value() const override { return at_cache ? *cache_it->second.current_value : base->value(); }
+   rocksdb::Status status() const override { return base->status(); }
+
+   void SeekToFirst() override {
+      base->SeekToFirst();
+      cache_it = bounds ? cache.lower_bound(bounds->lower_slice) : cache.begin();
+      settle_forward();
+   }
+
+   void SeekToLast() override {
+      base->SeekToLast();
+      cache_it = last_before_upper();
+      settle_backward();
+   }
+
+   void Seek(const rocksdb::Slice& target) override {
+      base->Seek(target);
+      if (bounds && compare_blob(target, bounds->lower_slice) < 0)
+         cache_it = cache.lower_bound(bounds->lower_slice);
+      else
+         cache_it = cache.lower_bound(target);
+      settle_forward();
+   }
+
+   void SeekForPrev(const rocksdb::Slice& target) override {
+      base->SeekForPrev(target);
+      if (bounds && compare_blob(target, bounds->upper_slice) >= 0)
+         cache_it = last_before_upper();
+      else
+         cache_it = last_at_or_before(target);
+      settle_backward();
+   }
+
+   void Next() override {
+      if (!forward) {
+         auto k = to_bytes(key());
+         base->Seek(to_slice(k));
+         cache_it = cache.lower_bound(k);
+      }
+      if (at_cache) {
+         if (base->Valid() && !compare_blob(base->key(), cache_it->first))
+            base->Next();
+         ++cache_it;
+      } else {
+         base->Next();
+      }
+      settle_forward();
+   }
+
+   void Prev() override {
+      if (forward) {
+         auto k = to_bytes(key());
+         base->SeekForPrev(to_slice(k));
+         cache_it = last_at_or_before(to_slice(k));
+      }
+      if (at_cache) {
+         if (base->Valid() && !compare_blob(base->key(), cache_it->first))
+            base->Prev();
+         step_back();
+      } else {
+         base->Prev();
+      }
+      settle_backward();
+   }
+
+ private:
+   cache_map::const_iterator last_at_or_before(const rocksdb::Slice& k) const {
+      auto it = cache.upper_bound(k);
+      return it == cache.begin() ? cache.end() : std::prev(it);
+   }
+
+   cache_map::const_iterator last_before_upper() const {
+      auto it = bounds ? cache.lower_bound(bounds->upper_slice) : cache.end();
+      return it == cache.begin() ? cache.end() : std::prev(it);
+   }
+
+   void step_back() { cache_it = cache_it == cache.begin() ? cache.end() : std::prev(cache_it); }
+
+   // Position at the lowest of the two sources, skipping erased entries
+   void settle_forward() {
+      forward = true;
+      while (true) {
+         bool has_cache = cache_it != cache.end() &&
+                          (!bounds || compare_blob(cache_it->first, bounds->upper_slice) < 0);
+         bool has_base  = base->Valid();
+         valid          = has_cache || has_base;
+         if (!valid)
+            return;
+         int cmp = !has_cache ? 1 : !has_base ? -1 : compare_blob(cache_it->first, base->key());
+         if (cmp > 0) {
+            at_cache = false;
+            return;
+         }
+         if (cache_it->second.current_value) {
+            at_cache = true;
+            return;
+         }
+         if (!cmp)
+            base->Next();
+         ++cache_it;
+      }
+   }
+
+   // Position at the highest of the two sources, skipping erased entries
+   void settle_backward() {
+      forward = false;
+      while (true) {
+         bool has_cache = cache_it != cache.end() &&
+                          (!bounds || compare_blob(cache_it->first, bounds->lower_slice) >= 0);
+         bool has_base  = base->Valid();
+         valid          = has_cache || has_base;
+         if (!valid)
+            return;
+         int cmp = !has_cache ? -1 : !has_base ? 1 : compare_blob(cache_it->first, base->key());
+         if (cmp < 0) {
+            at_cache = false;
+            return;
+         }
+         if (cache_it->second.current_value) {
+            at_cache = true;
+            return;
+         }
+         if (!cmp)
+            base->Prev();
+         step_back();
+      }
+   }
+}; // cache_overlay_iterator
+
 // Supports reading and writing through a cache_map
 //
 // Caution: write_session will misbehave if it's used to read or write a key that
@@ -476,130 +3010,754 @@ class undo_stack {
 //
 // Extra keys stored in the cache used only as sentinels are exempt from this
 // restriction.
+//
+// Cached keys and map nodes live in `arena`; wipe_cache() releases them all at once.
+//
+// If `blind_writes` is set, set() and erase() don't read keys which are missing from the
+// cache. This skips a rocksdb::DB::Get per write, but no-op writes are no longer detected;
+// undo_stack::write_changes fetches the original values only if it needs to record undo.
 struct write_session {
    database&                db;
    const rocksdb::Snapshot* snapshot;
-   cache_map                cache;
-   cache_map::iterator      change_list = cache.end();
+   chain_kv::arena          arena;
+   cache_map                cache{ cache_map::allocator_type{ arena } };
+   cache_map::iterator      change_list  = cache.end();
+   bool                     blind_writes = false;
+
+   // rocksdb iterators released by view::iterator, ready for reuse. These see the same
+   // state as new iterators would, since nothing may change the database during this
+   // session's lifetime except write_changes(), which empties the pool.
+   struct pooled_iterator {
+      std::unique_ptr<iterator_bounds>   bounds; // Null if unbounded
+      std::unique_ptr<rocksdb::Iterator> it;
+   };
+   std::vector<pooled_iterator> iterator_pool;
+   size_t                       max_iterator_pool_size = 16;
+   uint64_t                     iterator_generation    = 0; // Bumped by wipe_cache()
+
+   // Prefixes whose bracketing sentinel keys are already in cache
+   slice_set sentinel_prefixes{ slice_set::allocator_type{ arena } };
+
+   // Set by fork(). A forked session reads through its parent's cache and records what it
+   // reads, so merge() can detect conflicts between forks.
+   const write_session*              parent = nullptr;
+   slice_set                         read_keys{ slice_set::allocator_type{ arena } };
+   std::set<std::pair<bytes, bytes>> read_ranges; // [begin, end) ranges iterated by view::iterator
+
+   // See push_savepoint(). While any savepoint exists, the journal records each entry's state
+   // before it changes.
+   struct savepoint {
+      size_t              journal_size;
+      cache_map::iterator change_list;
+   };
+   struct journal_entry {
+      cache_map::iterator           it;
+      std::optional<rocksdb::Slice> current_value;
+      bool                          in_change_list;
+      bool                          remove; // Entry was created by a blind write; rollback removes it
+   };
+   std::vector<savepoint>     savepoints;
+   std::vector<journal_entry> journal;
+
+   // Asynchronous reads (see get_async()). `read` runs on the database's read pool, then
+   // complete_reads() runs `complete` on the session's thread.
+   struct async_read {
+      std::function<void()> read;
+      std::function<void()> complete;
+      std::exception_ptr    error;
+   };
+   size_t                                  async_pending = 0; // Reads whose callbacks haven't run
+   std::mutex                              async_mutex;
+   std::condition_variable                 async_cv;
+   std::deque<std::shared_ptr<async_read>> async_done;        // Guarded by async_mutex
+   size_t                                  async_running = 0; // Guarded by async_mutex
+
+   // Set by write_changes_async(). The next read from the database or its read cache waits for
+   // the write; before it lands, both still hold the values it replaces.
+   bool own_write_pending = false;
+
+   // Waits for the database's pending asynchronous writes, so reads see them
+   write_session(database& db, const rocksdb::Snapshot* snapshot = nullptr) : db{ db }, snapshot{ snapshot } {
+      db.wait_for_writes();
+   }
+
+   // Waits for in-flight reads; their callbacks don't run
+   ~write_session() {
+      std::unique_lock lock{ async_mutex };
+      async_cv.wait(lock, [&] { return !async_running; });
+   }
+
+   // cache refers to arena
+   write_session(const write_session&) = delete;
+   write_session& operator=(const write_session&) = delete;
+
+   rocksdb::ReadOptions read_options() {
+      rocksdb::ReadOptions r;
+      r.snapshot = snapshot;
+      return r;
+   }
+
+   rocksdb::ReadOptions async_read_options() {
+      auto r     = read_options();
+      r.async_io = db.async_io;
+      return r;
+   }
+
+   // Iterate through the state this session started from: the database, or for a forked
+   // session, its parent's cache layered over the parent's state.
+   // The iterator only sees keys within bounds, if given.
+   std::unique_ptr<rocksdb::Iterator> new_iterator(const iterator_bounds* bounds = nullptr,
+                                                   size_t                 readahead_size = 0) const {
+      if (parent)
+         return std::make_unique<cache_overlay_iterator>(parent->cache, parent->new_iterator(bounds, readahead_size),
+                                                         bounds);
+      if (bounds)
+         return std::unique_ptr<rocksdb::Iterator>{ db.rdb->NewIterator(
+               database::iterator_options(snapshot, *bounds, readahead_size)) };
+      return std::unique_ptr<rocksdb::Iterator>{ db.rdb->NewIterator(database::iterator_options(snapshot)) };
+   }
+
+   void wait_for_own_write() {
+      if (!own_write_pending)
+         return;
+      db.wait_for_writes();
+      own_write_pending = false;
+   }
+
+   // Get an unbounded rocksdb iterator from the pool, or a new one if the pool has none
+   pooled_iterator acquire_iterator() {
+      wait_for_own_write();
+      for (auto it = iterator_pool.rbegin(); it != iterator_pool.rend(); ++it)
+         if (!it->bounds)
+            return take_pooled(it);
+      return { nullptr, new_iterator() };
+   }
+
+   // Get a rocksdb iterator bounded to [lower, upper) from the pool, or a new one if the pool has none
+   pooled_iterator acquire_iterator(const bytes& lower, const bytes& upper) {
+      wait_for_own_write();
+      for (auto it = iterator_pool.rbegin(); it != iterator_pool.rend(); ++it)
+         if (it->bounds && it->bounds->lower == lower && it->bounds->upper == upper)
+            return take_pooled(it);
+      auto bounds = std::make_unique<iterator_bounds>(lower, upper);
+      auto it     = new_iterator(bounds.get());
+      return { std::move(bounds), std::move(it) };
+   }
+
+   // Return an iterator from acquire_iterator() to the pool. `generation` is the value
+   // of iterator_generation when it was acquired.
+   void release_iterator(pooled_iterator&& it, uint64_t generation) {
+      if (it.it && generation == iterator_generation && iterator_pool.size() < max_iterator_pool_size)
+         iterator_pool.push_back(std::move(it));
+   }
+
+   pooled_iterator take_pooled(std::vector<pooled_iterator>::reverse_iterator it) {
+      auto result = std::move(*it);
+      iterator_pool.erase(std::next(it).base());
+      return result;
+   }
+
+   // Record an existing entry's state before changing it
+   void journal_change(cache_map::iterator it) {
+      if (!savepoints.empty())
+         journal.push_back({ it, it->second.current_value, it->second.in_change_list, false });
+   }
+
+   // Record that a changed entry was just created. Its previous value is orig_value.
+   void journal_created(cache_map::iterator it) {
+      if (!savepoints.empty())
+         journal.push_back({ it, it->second.orig_value, false, it->second.orig_value_pending });
+   }
+
+   // Start a savepoint, which rollback_to() can revert the cache to without touching the
+   // database. Savepoints nest. Returns an id for rollback_to() and release().
+   size_t push_savepoint() {
+      savepoints.push_back({ journal.size(), change_list });
+      return savepoints.size() - 1;
+   }
+
+   // Revert changes made since savepoint `id`, then remove it and any newer savepoints. Entries
+   // which come back into existence stay erased for iterators which were at them. Iterators must
+   // not be at keys blind-written since the savepoint.
+   void rollback_to(size_t id) {
+      if (id >= savepoints.size())
+         throw exception("write_session::rollback_to: no such savepoint");
+      auto sp = savepoints[id];
+      while (journal.size() > sp.journal_size) {
+         auto e = journal.back();
+         journal.pop_back();
+         if (e.remove) {
+            // The entry may have been a sentinel; view::iterator will find them again
+            cache.erase(e.it);
+            sentinel_prefixes.clear();
+            continue;
+         }
+         auto& v = e.it->second;
+         if (v.current_value && !e.current_value)
+            ++v.num_erases;
+         v.current_value  = e.current_value;
+         v.in_change_list = e.in_change_list;
+      }
+      change_list = sp.change_list;
+      savepoints.resize(id);
+   }
+
+   // Remove savepoint `id` and any newer savepoints, keeping their changes. Older savepoints
+   // still cover the changes.
+   void release(size_t id) {
+      if (id >= savepoints.size())
+         throw exception("write_session::release: no such savepoint");
+      savepoints.resize(id);
+      if (savepoints.empty())
+         journal.clear();
+   }
+
+   // Does change_list have any keys in [begin, end)? Scans only the cache entries in range.
+   bool has_changes_in(const rocksdb::Slice& begin, const rocksdb::Slice& end) const {
+      for (auto it = cache.lower_bound(begin); it != cache.end() && compare_blob(it->first, end) < 0; ++it)
+         if (it->second.in_change_list)
+            return true;
+      return false;
+   }
+
+   // Add item to change_list
+   void changed(cache_map::iterator it) {
+      if (it->second.in_change_list)
+         return;
+      it->second.in_change_list   = true;
+      it->second.change_list_next = change_list;
+      change_list                 = it;
+   }
+
+   // The database's read cache holds committed values, which only match what this
+   // session reads when it doesn't use a snapshot
+   read_cache* shared_read_cache() { return snapshot ? nullptr : db.shared_read_cache.get(); }
+
+   // Find k in the caches of the sessions this one was forked from, nearest first
+   const cached_value* find_in_parents(const rocksdb::Slice& k) const {
+      for (auto* p = parent; p; p = p->parent) {
+         auto it = p->cache.find(k);
+         if (it != p->cache.end())
+            return &it->second;
+      }
+      return nullptr;
+   }
+
+   // Forked sessions record keys read by get() and get_many(); see merge()
+   void record_read(const rocksdb::Slice& k) {
+      if (parent && read_keys.find(k) == read_keys.end())
+         read_keys.insert(arena.copy(k));
+   }
+
+   // Forked sessions record ranges iterated by view::iterator; see merge()
+   void record_range(const bytes& begin, const bytes& end) {
+      if (parent)
+         read_ranges.emplace(begin, end);
+   }
+
+   // Queue an asynchronous read; see async_read
+   void submit_read(std::function<void()> read, std::function<void()> complete) {
+      auto r = std::make_shared<async_read>(async_read{ std::move(read), std::move(complete), {} });
+      ++async_pending;
+      {
+         std::lock_guard lock{ async_mutex };
+         ++async_running;
+      }
+      db.read_async([this, r] {
+         try {
+            r->read();
+         } catch (...) { r->error = std::current_exception(); }
+         std::lock_guard lock{ async_mutex };
+         async_done.push_back(std::move(r));
+         --async_running;
+         async_cv.notify_all();
+      });
+   }
+
+   void check_no_reads_in_flight(const char* method) {
+      if (async_pending)
+         throw exception(std::string{ method } + ": asynchronous reads are in flight");
+   }
+
+   // get_many's first pass: fill result from the caches. Returns the indexes of keys which
+   // need a rocksdb read.
+   std::vector<size_t> get_cached(const std::vector<rocksdb::Slice>&         keys,
+                                  std::vector<std::optional<rocksdb::Slice>>& result) {
+      wait_for_own_write();
+      std::vector<size_t> misses;
+      auto*               rc = shared_read_cache();
+      for (size_t i = 0; i < keys.size(); ++i) {
+         record_read(keys[i]);
+         auto it = cache.find(keys[i]);
+         if (it != cache.end()) {
+            add_metric(metric::get_cache_hits);
+            result[i] = it->second.current_value;
+            continue;
+         }
+         if (auto* v = find_in_parents(keys[i])) {
+            add_metric(metric::get_cache_hits);
+            if (v->current_value) {
+               result[i] = arena.copy(*v->current_value);
+               cache.emplace(arena.copy(keys[i]), cached_value{ 0, result[i], result[i] });
+            }
+            continue;
+         }
+         bool in_read_cache = rc && rc->get(keys[i], [&](const auto& v) {
+            if (v) {
+               result[i] = arena.copy(*v);
+               cache.emplace(arena.copy(keys[i]), cached_value{ 0, result[i], result[i] });
+            }
+         });
+         if (in_read_cache)
+            add_metric(metric::get_read_cache_hits);
+         else
+            misses.push_back(i);
+      }
+      return misses;
+   }
+
+   // The keys at `misses`, sorted and unique. MultiGet is most efficient with those.
+   static std::vector<rocksdb::Slice> unique_keys(const std::vector<rocksdb::Slice>& keys, std::vector<size_t>& misses) {
+      std::sort(misses.begin(), misses.end(), [&](size_t a, size_t b) { return compare_blob(keys[a], keys[b]) < 0; });
+      std::vector<rocksdb::Slice> miss_keys;
+      for (auto i : misses)
+         if (miss_keys.empty() || compare_blob(miss_keys.back(), keys[i]))
+            miss_keys.push_back(keys[i]);
+      return miss_keys;
+   }
+
+   // Start reading keys from rocksdb. Returns the read cache generations which finish_reads() needs.
+   std::vector<uint64_t> begin_reads(const std::vector<rocksdb::Slice>& miss_keys) {
+      add_metric(metric::get_db_reads, miss_keys.size());
+      std::vector<uint64_t> generations;
+      if (auto* rc = shared_read_cache())
+         for (auto& k : miss_keys) //
+            generations.push_back(rc->begin_read(k));
+      return generations;
+   }
+
+   // Cache the values MultiGet read for miss_keys and fill in result. An entry which entered the
+   // cache while an asynchronous read was in flight is kept.
+   void finish_reads(const std::vector<rocksdb::Slice>& keys, const std::vector<size_t>& misses,
+                     const std::vector<rocksdb::Slice>& miss_keys, const std::vector<uint64_t>& generations,
+                     std::vector<rocksdb::PinnableSlice>& values, const std::vector<rocksdb::Status>& statuses,
+                     std::vector<std::optional<rocksdb::Slice>>& result, const char* error_prefix) {
+      auto*                                      rc = shared_read_cache();
+      std::vector<std::optional<rocksdb::Slice>> miss_values(miss_keys.size());
+      for (size_t j = 0; j < miss_keys.size(); ++j) {
+         if (statuses[j].IsNotFound()) {
+            if (rc)
+               rc->put(miss_keys[j], std::nullopt, generations[j]);
+         } else {
+            check(statuses[j], error_prefix);
+            if (rc)
+               rc->put(miss_keys[j], values[j], generations[j]);
+         }
+         auto it = cache.find(miss_keys[j]);
+         if (it != cache.end()) {
+            miss_values[j] = it->second.current_value;
+         } else if (!statuses[j].IsNotFound()) {
+            auto value = arena.copy(values[j]);
+            cache.emplace(arena.copy(miss_keys[j]), cached_value{ 0, value, value });
+            miss_values[j] = value;
+         }
+      }
+
+      size_t j = 0;
+      for (auto i : misses) {
+         if (compare_blob(miss_keys[j], keys[i]))
+            ++j;
+         result[i] = miss_values[j];
+      }
+   }
+
+   // Read a value from the parents' caches, the database's read cache, or rocksdb. The result points into arena.
+   std::optional<rocksdb::Slice> read_value(const rocksdb::Slice& k, const char* error_prefix) {
+      wait_for_own_write();
+      if (auto* v = find_in_parents(k)) {
+         add_metric(metric::get_cache_hits);
+         if (v->current_value)
+            return arena.copy(*v->current_value);
+         return {};
+      }
+
+      auto*                         rc = shared_read_cache();
+      std::optional<rocksdb::Slice> value;
+      uint64_t                      generation = 0;
+      if (rc) {
+         if (rc->get(k, [&](const auto& v) {
+                if (v)
+                   value = arena.copy(*v);
+             })) {
+            add_metric(metric::get_read_cache_hits);
+            return value;
+         }
+         generation = rc->begin_read(k);
+      }
+      add_metric(metric::get_db_reads);
+
+      rocksdb::PinnableSlice v;
+      auto                   stat = db.rdb->Get(read_options(), db.rdb->DefaultColumnFamily(), k, &v);
+      if (stat.IsNotFound()) {
+         if (rc)
+            rc->put(k, std::nullopt, generation);
+         return {};
+      }
+      check(stat, error_prefix);
+      if (rc)
+         rc->put(k, v, generation);
+      return arena.copy(v);
+   }
+
+   // Get a value. Includes any changes written to cache. Returns nullopt
+   // if key-value doesn't exist. The result remains valid until the cache is wiped.
+   //
+   // Keys may be any contiguous range of chars, e.g. a key_buffer; the cache only copies
+   // keys it keeps.
+   template <typename K>
+   std::optional<rocksdb::Slice> get(const K& key) {
+      rocksdb::Slice k{ key.data(), key.size() };
+      record_read(k);
+      auto it = cache.find(k);
+      if (it != cache.end()) {
+         add_metric(metric::get_cache_hits);
+         return it->second.current_value;
+      }
+
+      auto value = read_value(k, "write_session::get: rocksdb::DB::Get: ");
+      if (value)
+         cache.emplace(arena.copy(k), cached_value{ 0, value, value });
+      return value;
+   }
 
-   write_session(database& db, const rocksdb::Snapshot* snapshot = nullptr) : db{ db }, snapshot{ snapshot } {}
+   // Get multiple values. Equivalent to calling get() on each key, except that keys
+   // missing from the cache are read from rocksdb with a single MultiGet.
+   std::vector<std::optional<rocksdb::Slice>> get_many(const std::vector<rocksdb::Slice>& keys) {
+      std::vector<std::optional<rocksdb::Slice>> result(keys.size());
+      auto                                       misses = get_cached(keys, result);
+      if (misses.empty())
+         return result;
 
-   rocksdb::ReadOptions read_options() {
-      rocksdb::ReadOptions r;
-      r.snapshot = snapshot;
-      return r;
+      auto                                miss_keys   = unique_keys(keys, misses);
+      auto                                generations = begin_reads(miss_keys);
+      std::vector<rocksdb::PinnableSlice> values(miss_keys.size());
+      std::vector<rocksdb::Status>        statuses(miss_keys.size());
+      db.rdb->MultiGet(read_options(), db.rdb->DefaultColumnFamily(), miss_keys.size(), miss_keys.data(), values.data(),
+                       statuses.data(), true);
+      finish_reads(keys, misses, miss_keys, generations, values, statuses, result,
+                   "write_session::get_many: rocksdb::DB::MultiGet: ");
+      return result;
    }
 
-   // Add item to change_list
-   void changed(cache_map::iterator it) {
-      if (it->second.in_change_list)
-         return;
-      it->second.in_change_list   = true;
-      it->second.change_list_next = change_list;
-      change_list                 = it;
+   using get_callback      = std::function<void(const std::optional<rocksdb::Slice>&)>;
+   using get_many_callback = std::function<void(const std::vector<std::optional<rocksdb::Slice>>&)>;
+
+   // Like get(), but doesn't block on rocksdb. If the value is cached, callback runs before this
+   // returns; otherwise the read goes to the database's read pool and callback runs on this
+   // thread from a later complete_reads(). The key doesn't need to outlive the call, but it
+   // must not change while its read is in flight. See database_config::read_threads.
+   template <typename K>
+   void get_async(const K& key, get_callback callback) {
+      get_many_async({ rocksdb::Slice{ key.data(), key.size() } },
+                     [callback = std::move(callback)](const auto& values) { callback(values[0]); });
    }
 
-   // Get a value. Includes any changes written to cache. Returns nullptr
-   // if key-value doesn't exist.
-   std::shared_ptr<const bytes> get(bytes&& k) {
-      auto it = cache.find(k);
-      if (it != cache.end())
-         return it->second.current_value;
+   // Like get_many(), but doesn't block on rocksdb; see get_async()
+   void get_many_async(const std::vector<rocksdb::Slice>& keys, get_many_callback callback) {
+      auto result = std::make_shared<std::vector<std::optional<rocksdb::Slice>>>(keys.size());
+      auto misses = get_cached(keys, *result);
+      if (misses.empty()) {
+         callback(*result);
+         return;
+      }
 
-      rocksdb::PinnableSlice v;
-      auto                   stat = db.rdb->Get(read_options(), db.rdb->DefaultColumnFamily(), to_slice(k), &v);
-      if (stat.IsNotFound())
-         return nullptr;
-      check(stat, "write_session::get: rocksdb::DB::Get: ");
+      // The read owns copies of the keys
+      struct read {
+         std::vector<bytes>                  key_data;
+         std::vector<rocksdb::Slice>         keys;
+         std::vector<size_t>                 misses;
+         std::vector<rocksdb::Slice>         miss_keys;
+         std::vector<uint64_t>               generations;
+         std::vector<rocksdb::PinnableSlice> values;
+         std::vector<rocksdb::Status>        statuses;
+      };
+      auto r = std::make_shared<read>();
+      for (auto& k : keys) //
+         r->key_data.push_back(to_bytes(k));
+      for (auto& k : r->key_data) //
+         r->keys.push_back(to_slice(k));
+      r->misses      = std::move(misses);
+      r->miss_keys   = unique_keys(r->keys, r->misses);
+      r->generations = begin_reads(r->miss_keys);
+      submit_read(
+            [r, options = async_read_options(), rdb = db.rdb.get()] {
+               r->values.resize(r->miss_keys.size());
+               r->statuses.resize(r->miss_keys.size());
+               rdb->MultiGet(options, rdb->DefaultColumnFamily(), r->miss_keys.size(), r->miss_keys.data(),
+                             r->values.data(), r->statuses.data(), true);
+            },
+            [this, r, result, callback = std::move(callback)] {
+               finish_reads(r->keys, r->misses, r->miss_keys, r->generations, r->values, r->statuses, *result,
+                            "write_session::get_many_async: rocksdb::DB::MultiGet: ");
+               callback(*result);
+            });
+   }
 
-      auto value          = to_shared_bytes(v);
-      cache[std::move(k)] = cached_value{ 0, value, value };
-      return value;
+   // Run the callbacks of finished asynchronous reads on this thread. If wait is set and reads
+   // are in flight, waits until at least one finishes. Returns the number of callbacks run. If a
+   // read failed, its callback doesn't run and this throws its error; the rest stay queued.
+   size_t complete_reads(bool wait = false) {
+      std::deque<std::shared_ptr<async_read>> done;
+      {
+         std::unique_lock lock{ async_mutex };
+         if (wait)
+            async_cv.wait(lock, [&] { return !async_done.empty() || !async_running; });
+         done.swap(async_done);
+      }
+      size_t num_completed = 0;
+      try {
+         for (; !done.empty(); done.pop_front()) {
+            auto r = std::move(done.front());
+            --async_pending;
+            if (r->error)
+               std::rethrow_exception(r->error);
+            r->complete();
+            ++num_completed;
+         }
+      } catch (...) {
+         done.pop_front();
+         std::lock_guard lock{ async_mutex };
+         async_done.insert(async_done.begin(), done.begin(), done.end());
+         throw;
+      }
+      return num_completed;
    }
 
+   // Run callbacks until no asynchronous reads remain, including any the callbacks start
+   void wait_for_reads() {
+      while (async_pending) //
+         complete_reads(true);
+   }
+
+   // Asynchronous reads whose callbacks haven't run
+   size_t reads_in_flight() const { return async_pending; }
+
+   std::optional<rocksdb::Slice> get(bytes&& k) { return get<bytes>(k); }
+
    // Write a key-value to cache and add to change_list if changed.
-   void set(bytes&& k, const rocksdb::Slice& v) {
+   template <typename K>
+   void set(const K& key, const rocksdb::Slice& v) {
+      rocksdb::Slice k{ key.data(), key.size() };
       auto it = cache.find(k);
       if (it != cache.end()) {
          if (!it->second.current_value || compare_blob(*it->second.current_value, v)) {
-            it->second.current_value = to_shared_bytes(v);
+            journal_change(it);
+            it->second.current_value = arena.copy(v);
             changed(it);
          }
          return;
       }
 
-      rocksdb::PinnableSlice orig_v;
-      auto                   stat = db.rdb->Get(read_options(), db.rdb->DefaultColumnFamily(), to_slice(k), &orig_v);
-      if (stat.IsNotFound()) {
-         auto [it, b] =
-               cache.insert(cache_map::value_type{ std::move(k), cached_value{ 0, nullptr, to_shared_bytes(v) } });
+      if (blind_writes) {
+         auto [it, b] = cache.emplace(arena.copy(k), cached_value{ 0, std::nullopt, arena.copy(v) });
+         it->second.orig_value_pending = true;
+         journal_created(it);
          changed(it);
          return;
       }
 
-      check(stat, "write_session::set: rocksdb::DB::Get: ");
-      if (compare_blob(v, orig_v)) {
-         auto [it, b] = cache.insert(
-               cache_map::value_type{ std::move(k), cached_value{ 0, to_shared_bytes(orig_v), to_shared_bytes(v) } });
+      auto orig_v = read_value(k, "write_session::set: rocksdb::DB::Get: ");
+      if (!orig_v) {
+         auto [it, b] = cache.emplace(arena.copy(k), cached_value{ 0, std::nullopt, arena.copy(v) });
+         journal_created(it);
+         changed(it);
+      } else if (compare_blob(v, *orig_v)) {
+         auto [it, b] = cache.emplace(arena.copy(k), cached_value{ 0, orig_v, arena.copy(v) });
+         journal_created(it);
          changed(it);
       } else {
-         auto value          = to_shared_bytes(orig_v);
-         cache[std::move(k)] = cached_value{ 0, value, value };
+         // A no-op depends on the value read; if another fork changed it, merge() must not drop this write
+         record_read(k);
+         cache.emplace(arena.copy(k), cached_value{ 0, orig_v, orig_v });
       }
    }
 
+   void set(bytes&& k, const rocksdb::Slice& v) { set<bytes>(k, v); }
+
    // Mark key as erased in the cache and add to change_list if changed. Bumps `num_erases` to invalidate iterators.
-   void erase(bytes&& k) {
+   template <typename K>
+   void erase(const K& key) {
+      rocksdb::Slice k{ key.data(), key.size() };
       {
          auto it = cache.find(k);
          if (it != cache.end()) {
             if (it->second.current_value) {
+               journal_change(it);
                ++it->second.num_erases;
-               it->second.current_value = nullptr;
+               it->second.current_value = std::nullopt;
                changed(it);
             }
             return;
          }
       }
 
-      rocksdb::PinnableSlice orig_v;
-      auto                   stat = db.rdb->Get(read_options(), db.rdb->DefaultColumnFamily(), to_slice(k), &orig_v);
-      if (stat.IsNotFound()) {
-         cache[std::move(k)] = cached_value{ 0, nullptr, nullptr };
+      if (blind_writes) {
+         auto [it, b] = cache.emplace(arena.copy(k), cached_value{ 1 });
+         it->second.orig_value_pending = true;
+         journal_created(it);
+         changed(it);
+         return;
+      }
+
+      auto orig_v = read_value(k, "write_session::erase: rocksdb::DB::Get: ");
+      if (!orig_v) {
+         record_read(k); // See set()
+         cache.emplace(arena.copy(k), cached_value{});
          return;
       }
 
-      check(stat, "write_session::erase: rocksdb::DB::Get: ");
-      auto [it, b] =
-            cache.insert(cache_map::value_type{ std::move(k), cached_value{ 1, to_shared_bytes(orig_v), nullptr } });
+      auto [it, b] = cache.emplace(arena.copy(k), cached_value{ 1, orig_v, std::nullopt });
+      journal_created(it);
       changed(it);
    }
 
+   void erase(bytes&& k) { erase<bytes>(k); }
+
    // Fill cache with a key-value pair read from the database. Does not undo any changes (e.g. set() or erase())
    // already made to the cache. Returns an iterator to the freshly-created or already-existing cache entry.
    cache_map::iterator fill_cache(const rocksdb::Slice& k, const rocksdb::Slice& v) {
-      cache_map::iterator it;
-      bool                b;
-      it = cache.find(k);
+      auto it = cache.find(k);
       if (it != cache.end())
          return it;
-      auto value      = to_shared_bytes(v);
-      std::tie(it, b) = cache.insert(cache_map::value_type{ to_bytes(k), cached_value{ 0, value, value } });
-      return it;
+      add_metric(metric::iterator_fill_cache);
+      auto value = arena.copy(v);
+      return cache.emplace(arena.copy(k), cached_value{ 0, value, value }).first;
    }
 
    // Write changes in `change_list` to database. See undo_stack::write_changes.
    //
    // Caution: write_changes wipes the cache, which invalidates iterators
    void write_changes(undo_stack& u) {
-      u.write_changes(cache, change_list);
+      check_not_forked();
+      check_no_reads_in_flight("write_session::write_changes");
+      {
+         latency_timer timer{ latency::write_changes };
+         u.write_changes(cache, change_list);
+      }
+      wipe_cache();
+   }
+
+   // Like write_changes, but the database write happens in the background; see
+   // undo_stack::write_changes_async. New sessions, and this session's next read, wait for the
+   // write.
+   std::future<void> write_changes_async(undo_stack& u) {
+      check_not_forked();
+      check_no_reads_in_flight("write_session::write_changes_async");
+      auto result = u.write_changes_async(cache, change_list);
       wipe_cache();
+      own_write_pending = true;
+      return result;
    }
 
-   // Wipe the cache. Invalidates iterators.
+   // Wipe the cache. Invalidates iterators and values returned by get(). Asynchronous reads must
+   // complete first.
    void wipe_cache() {
-      cache.clear();
+      check_no_reads_in_flight("write_session::wipe_cache");
+      // Everything the map owns lives in arena and needs no destruction, so the
+      // map is abandoned instead of being cleared node by node.
+      static_assert(std::is_trivially_destructible_v<cache_map::value_type>);
+      static_assert(std::is_trivially_destructible_v<slice_set::value_type>);
+      add_metric(metric::sessions_wiped);
+      add_metric(metric::session_cache_entries, cache.size());
+      add_metric(metric::session_cache_bytes, arena.used());
+      arena.clear();
+      new (&cache) cache_map{ cache_map::allocator_type{ arena } };
+      new (&sentinel_prefixes) slice_set{ slice_set::allocator_type{ arena } };
+      new (&read_keys) slice_set{ slice_set::allocator_type{ arena } };
+      read_ranges.clear();
+      savepoints.clear();
+      journal.clear();
       change_list = cache.end();
+      iterator_pool.clear();
+      ++iterator_generation;
+   }
+
+   // Create a session which starts from this session's current state, e.g. to execute one of
+   // several transactions in parallel. Forks may run on separate threads, but this session must
+   // not change until they are merged or discarded.
+   std::unique_ptr<write_session> fork() const {
+      auto child          = std::make_unique<write_session>(db, snapshot);
+      child->parent       = this;
+      child->blind_writes = blind_writes;
+      return child;
+   }
+
+   // Merge forked sessions into this one, in order. A fork conflicts if it read a key, or iterated
+   // a range containing a key, which an earlier fork in `children` wrote; it might have behaved
+   // differently had it run after that fork. Conflicting forks aren't merged and should be
+   // re-executed in new forks. Returns the indexes of conflicting forks. Discard the forks afterwards.
+   std::vector<size_t> merge(const std::vector<write_session*>& children) {
+      std::vector<size_t>                 conflicts;
+      std::set<rocksdb::Slice, less_blob> written; // Points into cache
+      for (size_t i = 0; i < children.size(); ++i) {
+         auto& child = *children[i];
+         if (child.parent != this)
+            throw exception("write_session::merge: session was not forked from this one");
+         if (has_conflict(child, written)) {
+            conflicts.push_back(i);
+            continue;
+         }
+         for (auto it = child.change_list; it != child.cache.end(); it = it->second.change_list_next)
+            written.insert(apply_change(it->first, it->second)->first);
+      }
+      return conflicts;
+   }
+
+ private:
+   void check_not_forked() {
+      if (parent)
+         throw exception("forked write_session can't write changes; merge it into its parent");
+   }
+
+   static bool has_conflict(const write_session& child, const std::set<rocksdb::Slice, less_blob>& written) {
+      for (auto& k : child.read_keys)
+         if (written.count(k))
+            return true;
+      for (auto& [begin, end] : child.read_ranges) {
+         auto it = written.lower_bound(to_slice(begin));
+         if (it != written.end() && compare_blob(*it, to_slice(end)) < 0)
+            return true;
+      }
+      return false;
+   }
+
+   // Apply a fork's change to this session's cache
+   cache_map::iterator apply_change(const rocksdb::Slice& k, const cached_value& v) {
+      auto copy = [&](const std::optional<rocksdb::Slice>& x) -> std::optional<rocksdb::Slice> {
+         if (x)
+            return arena.copy(*x);
+         return {};
+      };
+      auto it = cache.find(k);
+      if (it == cache.end()) {
+         it = cache.emplace(arena.copy(k), cached_value{ v.num_erases, copy(v.orig_value), copy(v.current_value) })
+                    .first;
+         it->second.orig_value_pending = v.orig_value_pending;
+         journal_created(it);
+      } else if (v.current_value) {
+         if (it->second.current_value && !compare_blob(*it->second.current_value, *v.current_value))
+            return it;
+         journal_change(it);
+         it->second.current_value = arena.copy(*v.current_value);
+      } else {
+         if (!it->second.current_value)
+            return it;
+         journal_change(it);
+         ++it->second.num_erases;
+         it->second.current_value = std::nullopt;
+      }
+      changed(it);
+      return it;
    }
 }; // write_session
 
@@ -626,68 +3784,116 @@ class view {
       bytes                              next_prefix;
       cache_map::iterator                cache_it;
       uint64_t                           cache_it_num_erases = 0;
-      std::unique_ptr<rocksdb::Iterator> rocks_it;
+      std::unique_ptr<iterator_bounds>   rocks_bounds;
+      std::unique_ptr<rocksdb::Iterator> rocks_it; // Bounded to [prefix, next_prefix)
+      uint64_t                           rocks_it_generation;
 
       iterator_impl(chain_kv::view& view, uint64_t contract, const rocksdb::Slice& prefix)
-          : view{ view },                                                                         //
-            prefix{ create_full_key(view.prefix, contract, prefix) },                             //
-            hidden_prefix_size{ view.prefix.size() + sizeof(contract) },                          //
-            rocks_it{ view.write_session.db.rdb->NewIterator(view.write_session.read_options()) } //
+          : view{ view },                                                        //
+            prefix{ create_full_key(view.prefix, contract, prefix) },            //
+            hidden_prefix_size{ view.prefix.size() + sizeof(contract) },         //
+            rocks_it_generation{ view.write_session.iterator_generation }        //
       {
+         auto& ws    = view.write_session;
          next_prefix = get_next_prefix(this->prefix);
+         ws.record_range(this->prefix, next_prefix);
 
          // Fill the cache with sentinel keys to simplify iteration logic. These may be either
-         // the reserved 0x00 or 0xff sentinels, or keys from regions neighboring prefix.
-         rocks_it->Seek(to_slice(this->prefix));
-         check(rocks_it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Seek: ");
-         view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
-         rocks_it->Prev();
-         check(rocks_it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Prev: ");
-         view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
-         rocks_it->Seek(to_slice(next_prefix));
-         check(rocks_it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Seek: ");
-         view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
+         // the reserved 0x00 or 0xff sentinels, or keys from regions neighboring prefix. They
+         // keep cache_it within the cache on both sides of the range. The bounded iterator
+         // can't reach them, so an unbounded one finds them.
+         if (ws.sentinel_prefixes.find(to_slice(this->prefix)) == ws.sentinel_prefixes.end()) {
+            auto s = ws.acquire_iterator();
+            s.it->Seek(to_slice(this->prefix));
+            check(s.it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Seek: ");
+            ws.fill_cache(s.it->key(), s.it->value());
+            s.it->Prev();
+            check(s.it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Prev: ");
+            ws.fill_cache(s.it->key(), s.it->value());
+            s.it->Seek(to_slice(next_prefix));
+            check(s.it->status(), "view::iterator_impl::iterator_impl: rocksdb::Iterator::Seek: ");
+            ws.fill_cache(s.it->key(), s.it->value());
+            ws.sentinel_prefixes.insert(ws.arena.copy(to_slice(this->prefix)));
+            ws.release_iterator(std::move(s), rocks_it_generation);
+         }
 
+         auto r       = ws.acquire_iterator(this->prefix, next_prefix);
+         rocks_bounds = std::move(r.bounds);
+         rocks_it     = std::move(r.it);
          move_to_end();
       }
 
+      ~iterator_impl() {
+         view.write_session.release_iterator({ std::move(rocks_bounds), std::move(rocks_it) }, rocks_it_generation);
+      }
+
+      // Cache rocks_it's current key-value, if it's valid
+      void fill_from_rocks() {
+         if (rocks_it->Valid())
+            view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
+      }
+
+      bool at_or_past_end(cache_map::iterator it) { return compare_blob(it->first, next_prefix) >= 0; }
+
       iterator_impl(const iterator_impl&) = delete;
       iterator_impl& operator=(const iterator_impl&) = delete;
 
-      void move_to_begin() { lower_bound_full_key(prefix); }
+      void move_to_begin() { lower_bound_full_key(to_slice(prefix)); }
 
       void move_to_end() { cache_it = view.write_session.cache.end(); }
 
       void lower_bound(const char* key, size_t size) {
+         key_buffer full_key = lower_bound_key(key, size);
+         lower_bound_full_key(to_slice(full_key));
+      }
+
+      // Seek rocks_it on the read pool, then merge its position with the cache and run callback.
+      // Nothing else touches rocks_it until the read completes.
+      void lower_bound_async(const char* key, size_t size, std::function<void()> callback) {
+         auto full_key = std::make_shared<bytes>(to_bytes(to_slice(lower_bound_key(key, size))));
+         view.write_session.submit_read(
+               [full_key, it = rocks_it.get()] {
+                  it->Seek(to_slice(*full_key));
+                  check(it->status(), "view::iterator_impl::lower_bound_async: rocksdb::Iterator::Seek: ");
+               },
+               [this, full_key, callback = std::move(callback)] {
+                  lower_bound_after_seek(to_slice(*full_key));
+                  callback();
+               });
+      }
+
+      // Keys before the iterator's prefix go to its start
+      key_buffer lower_bound_key(const char* key, size_t size) {
          auto x = compare_blob(rocksdb::Slice{ key, size }, rocksdb::Slice{ prefix.data() + hidden_prefix_size,
                                                                             prefix.size() - hidden_prefix_size });
          if (x < 0) {
             key  = prefix.data() + hidden_prefix_size;
             size = prefix.size() - hidden_prefix_size;
          }
-
-         bytes full_key;
-         full_key.reserve(hidden_prefix_size + size);
-         full_key.insert(full_key.end(), prefix.data(), prefix.data() + hidden_prefix_size);
-         full_key.insert(full_key.end(), key, key + size);
-         lower_bound_full_key(full_key);
+         return { prefix.data(), hidden_prefix_size, key, size };
       }
 
-      void lower_bound_full_key(const bytes& full_key) {
-         rocks_it->Seek(to_slice(full_key));
+      // An invalid rocks_it has run off an end of the range; stepping loops treat it as being past
+      // everything in the direction they're going.
+      void lower_bound_full_key(const rocksdb::Slice& full_key) {
+         rocks_it->Seek(full_key);
          check(rocks_it->status(), "view::iterator_impl::lower_bound_full_key: rocksdb::Iterator::Seek: ");
-         cache_it = view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
-         if (compare_blob(cache_it->first, to_slice(full_key)))
-            cache_it = view.write_session.cache.lower_bound(full_key);
-         while (!cache_it->second.current_value) {
-            while (compare_blob(rocks_it->key(), cache_it->first) <= 0) {
+         lower_bound_after_seek(full_key);
+      }
+
+      // The rest of lower_bound_full_key, once rocks_it is at full_key's lower bound
+      void lower_bound_after_seek(const rocksdb::Slice& full_key) {
+         fill_from_rocks();
+         cache_it = view.write_session.cache.lower_bound(full_key);
+         while (!at_or_past_end(cache_it) && !cache_it->second.current_value) {
+            while (rocks_it->Valid() && compare_blob(rocks_it->key(), cache_it->first) <= 0) {
                rocks_it->Next();
                check(rocks_it->status(), "view::iterator_impl::lower_bound_full_key: rocksdb::Iterator::Next: ");
-               view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
+               fill_from_rocks();
             }
             ++cache_it;
          }
-         if (compare_blob(cache_it->first, next_prefix) >= 0)
+         if (at_or_past_end(cache_it))
             cache_it = view.write_session.cache.end();
          else
             cache_it_num_erases = cache_it->second.num_erases;
@@ -700,7 +3906,7 @@ class view {
             throw exception("kv iterator is at an erased value");
          return key_value{ rocksdb::Slice{ cache_it->first.data() + hidden_prefix_size,
                                            cache_it->first.size() - hidden_prefix_size },
-                           to_slice(*cache_it->second.current_value) };
+                           *cache_it->second.current_value };
       }
 
       bool is_end() { return cache_it == view.write_session.cache.end(); }
@@ -714,20 +3920,27 @@ class view {
       }
 
       iterator_impl& operator++() {
+         add_metric(metric::iterator_steps);
          if (cache_it == view.write_session.cache.end()) {
             move_to_begin();
             return *this;
          } else if (cache_it_num_erases != cache_it->second.num_erases)
             throw exception("kv iterator is at an erased value");
+         if (!rocks_it->Valid()) {
+            // It may have run off the other end
+            rocks_it->Seek(cache_it->first);
+            check(rocks_it->status(), "view::iterator_impl::operator++: rocksdb::Iterator::Seek: ");
+            fill_from_rocks();
+         }
          do {
-            while (compare_blob(rocks_it->key(), cache_it->first) <= 0) {
+            while (rocks_it->Valid() && compare_blob(rocks_it->key(), cache_it->first) <= 0) {
                rocks_it->Next();
                check(rocks_it->status(), "view::iterator_impl::operator++: rocksdb::Iterator::Next: ");
-               view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
+               fill_from_rocks();
             }
             ++cache_it;
-         } while (!cache_it->second.current_value);
-         if (compare_blob(cache_it->first, next_prefix) >= 0)
+         } while (!at_or_past_end(cache_it) && !cache_it->second.current_value);
+         if (at_or_past_end(cache_it))
             cache_it = view.write_session.cache.end();
          else
             cache_it_num_erases = cache_it->second.num_erases;
@@ -735,22 +3948,28 @@ class view {
       }
 
       iterator_impl& operator--() {
+         add_metric(metric::iterator_steps);
          if (cache_it == view.write_session.cache.end()) {
-            rocks_it->Seek(to_slice(next_prefix));
-            check(rocks_it->status(), "view::iterator_impl::operator--: rocksdb::Iterator::Seek: ");
-            cache_it = view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
-            if (compare_blob(cache_it->first, to_slice(next_prefix)))
-               cache_it = view.write_session.cache.lower_bound(next_prefix);
-         } else if (cache_it_num_erases != cache_it->second.num_erases)
+            rocks_it->SeekToLast();
+            check(rocks_it->status(), "view::iterator_impl::operator--: rocksdb::Iterator::SeekToLast: ");
+            fill_from_rocks();
+            cache_it = view.write_session.cache.lower_bound(next_prefix);
+         } else if (cache_it_num_erases != cache_it->second.num_erases) {
             throw exception("kv iterator is at an erased value");
+         } else if (!rocks_it->Valid()) {
+            // It may have run off the other end
+            rocks_it->SeekForPrev(cache_it->first);
+            check(rocks_it->status(), "view::iterator_impl::operator--: rocksdb::Iterator::SeekForPrev: ");
+            fill_from_rocks();
+         }
          do {
-            while (compare_blob(rocks_it->key(), cache_it->first) >= 0) {
+            while (rocks_it->Valid() && compare_blob(rocks_it->key(), cache_it->first) >= 0) {
                rocks_it->Prev();
                check(rocks_it->status(), "view::iterator_impl::operator--: rocksdb::Iterator::Prev: ");
-               view.write_session.fill_cache(rocks_it->key(), rocks_it->value());
+               fill_from_rocks();
             }
             --cache_it;
-         } while (!cache_it->second.current_value);
+         } while (compare_blob(cache_it->first, prefix) >= 0 && !cache_it->second.current_value);
          if (compare_blob(cache_it->first, prefix) < 0)
             cache_it = view.write_session.cache.end();
          else
@@ -829,6 +4048,19 @@ class view {
 
       void lower_bound(const bytes& key) { lower_bound(key.data(), key.size()); }
 
+      // Like lower_bound(), but the rocksdb seek happens on the database's read pool; callback
+      // runs on the session's thread once the iterator has moved. See write_session::get_async.
+      // The iterator must not be used or destroyed until then. Stepping past erased entries
+      // the session's cache holds may still read synchronously.
+      void lower_bound_async(const char* key, size_t size, std::function<void()> callback) {
+         check_initialized();
+         impl->lower_bound_async(key, size, std::move(callback));
+      }
+
+      void lower_bound_async(const bytes& key, std::function<void()> callback) {
+         lower_bound_async(key.data(), key.size(), std::move(callback));
+      }
+
       bool is_end() const {
          check_initialized();
          return impl->is_end();
@@ -854,6 +4086,221 @@ class view {
       }
    };
 
+   // Iterates through a user-provided prefix like iterator does, but doesn't copy what it steps
+   // over into the session's cache, so large scans don't grow the cache. If the session has no
+   // changes in the range, results come straight from rocksdb; otherwise the cache is merged in.
+   // Results are valid until the iterator moves. The session must not change keys in the range
+   // while a scan_iterator exists.
+   class scan_iterator {
+      const chain_kv::view*              view;
+      size_t                             hidden_prefix_size;
+      iterator_bounds                    bounds; // [prefix, next_prefix)
+      std::unique_ptr<rocksdb::Iterator> rocks_it;
+
+      void check_status(const char* error_prefix) { check(rocks_it->status(), error_prefix); }
+
+    public:
+      scan_iterator(chain_kv::view& view, uint64_t contract, const rocksdb::Slice& prefix)
+          : view{ &view }, hidden_prefix_size{ view.prefix.size() + sizeof(contract) },
+            bounds{ create_full_key(view.prefix, contract, prefix) } {
+         auto& ws = view.write_session;
+         ws.record_range(bounds.lower, bounds.upper);
+         ws.wait_for_own_write();
+         rocks_it = ws.new_iterator(&bounds, ws.db.scan_readahead_size);
+         if (ws.has_changes_in(bounds.lower_slice, bounds.upper_slice))
+            rocks_it = std::make_unique<cache_overlay_iterator>(ws.cache, std::move(rocks_it), &bounds);
+      }
+
+      scan_iterator(const scan_iterator&) = delete;
+      scan_iterator& operator=(const scan_iterator&) = delete;
+
+      // Compare 2 iterators. Throws if the iterators are from different views. non-end
+      // iterators compare less than end iterators.
+      friend int compare(const scan_iterator& a, const scan_iterator& b) {
+         if (a.view != b.view)
+            throw exception("iterators are from different views");
+         return compare_key(a.get_kv(), b.get_kv());
+      }
+
+      friend bool operator==(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) == 0; }
+      friend bool operator!=(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) != 0; }
+      friend bool operator<(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) < 0; }
+      friend bool operator<=(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) <= 0; }
+      friend bool operator>(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) > 0; }
+      friend bool operator>=(const scan_iterator& a, const scan_iterator& b) { return compare(a, b) >= 0; }
+
+      scan_iterator& operator++() {
+         add_metric(metric::iterator_steps);
+         if (!rocks_it->Valid())
+            move_to_begin();
+         else {
+            rocks_it->Next();
+            check_status("view::scan_iterator::operator++: rocksdb::Iterator::Next: ");
+         }
+         return *this;
+      }
+
+      scan_iterator& operator--() {
+         add_metric(metric::iterator_steps);
+         if (!rocks_it->Valid()) {
+            rocks_it->SeekToLast();
+            check_status("view::scan_iterator::operator--: rocksdb::Iterator::SeekToLast: ");
+         } else {
+            rocks_it->Prev();
+            check_status("view::scan_iterator::operator--: rocksdb::Iterator::Prev: ");
+         }
+         return *this;
+      }
+
+      void move_to_begin() {
+         rocks_it->SeekToFirst();
+         check_status("view::scan_iterator::move_to_begin: rocksdb::Iterator::SeekToFirst: ");
+      }
+
+      void move_to_end() {
+         // Seeking to the upper bound leaves the iterator invalid (end) without scanning
+         rocks_it->Seek(bounds.upper_slice);
+         check_status("view::scan_iterator::move_to_end: rocksdb::Iterator::Seek: ");
+      }
+
+      void lower_bound(const char* key, size_t size) {
+         auto& prefix   = bounds.lower;
+         auto  user_key = rocksdb::Slice{ prefix.data() + hidden_prefix_size, prefix.size() - hidden_prefix_size };
+         if (compare_blob(rocksdb::Slice{ key, size }, user_key) < 0) {
+            key  = prefix.data() + hidden_prefix_size;
+            size = prefix.size() - hidden_prefix_size;
+         }
+
+         key_buffer full_key{ prefix.data(), hidden_prefix_size, key, size };
+         rocks_it->Seek(to_slice(full_key));
+         check_status("view::scan_iterator::lower_bound: rocksdb::Iterator::Seek: ");
+      }
+
+      void lower_bound(const bytes& key) { lower_bound(key.data(), key.size()); }
+
+      bool is_end() const { return !rocks_it->Valid(); }
+      bool is_valid() const { return rocks_it->Valid(); }
+      bool is_erased() const { return false; }
+
+      // Get key_value at current position. Returns nullopt if at end. The result is valid until
+      // the iterator moves. The returned key does not include the view's prefix or the contract.
+      std::optional<key_value> get_kv() const {
+         if (!rocks_it->Valid())
+            return {};
+         auto k = rocks_it->key();
+         return key_value{ rocksdb::Slice{ k.data() + hidden_prefix_size, k.size() - hidden_prefix_size },
+                           rocks_it->value() };
+      }
+   }; // scan_iterator
+
+   // Iterates forward through a user-provided prefix as it was when undo.revision() was
+   // `revision`; see undo_stack::get_at. Keys come from the database and undo's history index,
+   // not the session's cache. Results are copies, so they stay valid after the iterator moves.
+   // The undo_stack must not change while a history_iterator exists.
+   class history_iterator {
+      chain_kv::undo_stack&              undo;
+      int64_t                            revision;
+      size_t                             hidden_prefix_size;
+      iterator_bounds                    bounds;       // [prefix, next_prefix)
+      iterator_bounds                    index_bounds; // History index keys of bounds
+      std::unique_ptr<rocksdb::Iterator> rocks_it;
+      std::unique_ptr<rocksdb::Iterator> index_it;
+      bool                               at_end = true;
+      bytes                              key;
+      bytes                              value;
+
+      // Step to the next key which existed at revision, starting with the lower of the two
+      // iterators' keys
+      void settle() {
+         at_end = true;
+         while (rocks_it->Valid() || index_it->Valid()) {
+            std::optional<bytes> index_key;
+            if (index_it->Valid())
+               index_key = undo.history_key(index_it->key());
+            bytes candidate = index_key && (!rocks_it->Valid() || compare_blob(*index_key, rocks_it->key()) < 0)
+                                    ? *index_key
+                                    : to_bytes(rocks_it->key());
+
+            // Keys without index entries haven't changed since revision
+            std::optional<bytes> v;
+            bool                 live = rocks_it->Valid() && !compare_blob(rocks_it->key(), candidate);
+            if (index_key && !compare_blob(*index_key, candidate))
+               v = undo.get_at(revision, to_slice(candidate));
+            else
+               v = to_bytes(rocks_it->value());
+            if (live)
+               rocks_it->Next();
+            while (index_it->Valid() && !compare_blob(undo.history_key(index_it->key()), candidate)) //
+               index_it->Next();
+            check(rocks_it->status(), "view::history_iterator: rocksdb::Iterator::Next: ");
+            check(index_it->status(), "view::history_iterator: rocksdb::Iterator::Next: ");
+            if (v) {
+               key    = std::move(candidate);
+               value  = std::move(*v);
+               at_end = false;
+               return;
+            }
+         }
+      }
+
+    public:
+      history_iterator(chain_kv::view& view, chain_kv::undo_stack& undo, int64_t revision, uint64_t contract,
+                       const rocksdb::Slice& prefix)
+          : undo{ undo }, revision{ revision },
+            hidden_prefix_size{ view.prefix.size() + sizeof(contract) },
+            bounds{ create_full_key(view.prefix, contract, prefix) },
+            index_bounds{ undo.history_key_prefix(to_slice(bounds.lower)),
+                          undo.history_key_prefix(to_slice(bounds.upper)) } {
+         auto& db = view.write_session.db;
+         db.wait_for_writes();
+         rocks_it.reset(db.rdb->NewIterator(database::iterator_options(nullptr, bounds)));
+         index_it.reset(
+               db.rdb->NewIterator(database::iterator_options(nullptr, index_bounds), db.undo_column_family()));
+      }
+
+      history_iterator(const history_iterator&) = delete;
+      history_iterator& operator=(const history_iterator&) = delete;
+
+      void move_to_begin() {
+         rocks_it->SeekToFirst();
+         index_it->SeekToFirst();
+         check(rocks_it->status(), "view::history_iterator::move_to_begin: rocksdb::Iterator::SeekToFirst: ");
+         check(index_it->status(), "view::history_iterator::move_to_begin: rocksdb::Iterator::SeekToFirst: ");
+         settle();
+      }
+
+      void lower_bound(const rocksdb::Slice& k) {
+         key_buffer full_key{ bounds.lower.data(), hidden_prefix_size, k.data(), k.size() };
+         auto target = compare_blob(to_slice(full_key), bounds.lower) < 0 ? bounds.lower_slice : to_slice(full_key);
+         rocks_it->Seek(target);
+         index_it->Seek(to_slice(undo.history_key_prefix(target)));
+         check(rocks_it->status(), "view::history_iterator::lower_bound: rocksdb::Iterator::Seek: ");
+         check(index_it->status(), "view::history_iterator::lower_bound: rocksdb::Iterator::Seek: ");
+         settle();
+      }
+
+      // Moving past the end restarts at the beginning, like the other iterators
+      history_iterator& operator++() {
+         add_metric(metric::iterator_steps);
+         if (at_end)
+            move_to_begin();
+         else
+            settle();
+         return *this;
+      }
+
+      bool is_end() const { return at_end; }
+
+      // Get key_value at current position. Returns nullopt if at end. The returned key does not
+      // include the view's prefix or the contract.
+      std::optional<key_value> get_kv() const {
+         if (at_end)
+            return {};
+         return key_value{ rocksdb::Slice{ key.data() + hidden_prefix_size, key.size() - hidden_prefix_size },
+                           to_slice(value) };
+      }
+   }; // history_iterator
+
    view(struct write_session& write_session, bytes prefix)
        : write_session{ write_session }, prefix{ std::move(prefix) } {
       if (this->prefix.empty())
@@ -865,21 +4312,220 @@ class view {
          throw exception("view may not have a prefix which begins with 0x00 or 0xff");
    }
 
-   // Get a value. Includes any changes written to cache. Returns nullptr
-   // if key doesn't exist.
-   std::shared_ptr<const bytes> get(uint64_t contract, const rocksdb::Slice& k) {
-      return write_session.get(create_full_key(prefix, contract, k));
+   // Get a value. Includes any changes written to cache. Returns nullopt
+   // if key doesn't exist. The result remains valid until the cache is wiped.
+   std::optional<rocksdb::Slice> get(uint64_t contract, const rocksdb::Slice& k) {
+      return write_session.get(key_buffer{ prefix, contract, k });
+   }
+
+   // Get multiple values. See write_session::get_many.
+   std::vector<std::optional<rocksdb::Slice>> get_many(uint64_t contract, const std::vector<rocksdb::Slice>& keys) {
+      bytes buffer;
+      return write_session.get_many(create_full_keys(buffer, prefix, contract, keys));
+   }
+
+   // Like get(), but doesn't block on rocksdb; see write_session::get_async
+   void get_async(uint64_t contract, const rocksdb::Slice& k, chain_kv::write_session::get_callback callback) {
+      write_session.get_async(key_buffer{ prefix, contract, k }, std::move(callback));
+   }
+
+   // Like get_many(), but doesn't block on rocksdb; see write_session::get_async
+   void get_many_async(uint64_t contract, const std::vector<rocksdb::Slice>& keys,
+                       chain_kv::write_session::get_many_callback callback) {
+      bytes buffer;
+      write_session.get_many_async(create_full_keys(buffer, prefix, contract, keys), std::move(callback));
+   }
+
+   // The value a key had when undo.revision() was `revision`; see undo_stack::get_at. Changes in
+   // this view's session which haven't been written aren't seen.
+   std::optional<bytes> get_at(undo_stack& undo, int64_t revision, uint64_t contract, const rocksdb::Slice& k) {
+      return undo.get_at(revision, to_slice(key_buffer{ prefix, contract, k }));
    }
 
    // Set a key-value pair
    void set(uint64_t contract, const rocksdb::Slice& k, const rocksdb::Slice& v) {
-      write_session.set(create_full_key(prefix, contract, k), v);
+      write_session.set(key_buffer{ prefix, contract, k }, v);
    }
 
    // Erase a key-value pair
-   void erase(uint64_t contract, const rocksdb::Slice& k) { write_session.erase(create_full_key(prefix, contract, k)); }
+   void erase(uint64_t contract, const rocksdb::Slice& k) { write_session.erase(key_buffer{ prefix, contract, k }); }
 }; // view
 
+// Reads from a database snapshot. Unlike write_session, read_session has no cache and its
+// methods are const, so any number of threads may share one, e.g. to serve API requests against
+// a consistent state while another thread writes.
+struct read_session {
+   database&                                db;
+   std::shared_ptr<const rocksdb::Snapshot> snapshot;
+
+   explicit read_session(database& db) : db{ db }, snapshot{ db.snapshot() } {}
+   read_session(database& db, std::shared_ptr<const rocksdb::Snapshot> snapshot)
+       : db{ db }, snapshot{ std::move(snapshot) } {}
+
+   rocksdb::ReadOptions read_options() const {
+      rocksdb::ReadOptions r;
+      r.snapshot = snapshot.get();
+      return r;
+   }
+
+   // Get a value. Returns false if key doesn't exist.
+   bool get(const rocksdb::Slice& k, rocksdb::PinnableSlice& v) const {
+      auto stat = db.rdb->Get(read_options(), db.rdb->DefaultColumnFamily(), k, &v);
+      if (stat.IsNotFound())
+         return false;
+      check(stat, "read_session::get: rocksdb::DB::Get: ");
+      return true;
+   }
+
+   std::optional<bytes> get(const rocksdb::Slice& k) const {
+      rocksdb::PinnableSlice v;
+      if (!get(k, v))
+         return {};
+      return to_bytes(v);
+   }
+
+   // Get multiple values with a single rocksdb::DB::MultiGet
+   std::vector<std::optional<bytes>> get_many(const std::vector<rocksdb::Slice>& keys) const {
+      std::vector<rocksdb::PinnableSlice> values(keys.size());
+      std::vector<rocksdb::Status>        statuses(keys.size());
+      db.rdb->MultiGet(read_options(), db.rdb->DefaultColumnFamily(), keys.size(), keys.data(), values.data(),
+                       statuses.data());
+      std::vector<std::optional<bytes>> result(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i) {
+         if (statuses[i].IsNotFound())
+            continue;
+         check(statuses[i], "read_session::get_many: rocksdb::DB::MultiGet: ");
+         result[i] = to_bytes(values[i]);
+      }
+      return result;
+   }
+}; // read_session
+
+// Read-only counterpart of view over a read_session. Iterators read straight from rocksdb
+// iterators bounded to their prefix, and follow view::iterator's wrap-around behavior. Each
+// iterator must stay on one thread.
+class read_view {
+ public:
+   const chain_kv::read_session& read_session;
+   const bytes                   prefix;
+
+   class iterator {
+      const read_view*                   view = nullptr;
+      size_t                             hidden_prefix_size;
+      iterator_bounds                    bounds; // [prefix, next_prefix)
+      std::unique_ptr<rocksdb::Iterator> rocks_it;
+
+      void check_status(const char* error_prefix) { check(rocks_it->status(), error_prefix); }
+
+    public:
+      iterator(const read_view& view, uint64_t contract, const rocksdb::Slice& prefix)
+          : view{ &view }, hidden_prefix_size{ view.prefix.size() + sizeof(contract) },
+            bounds{ create_full_key(view.prefix, contract, prefix) } {
+         rocks_it.reset(view.read_session.db.rdb->NewIterator(
+               database::iterator_options(view.read_session.snapshot.get(), bounds)));
+      }
+
+      // rocks_it refers to the bounds
+      iterator(const iterator&) = delete;
+      iterator& operator=(const iterator&) = delete;
+
+      // Compare 2 iterators. Throws if the iterators are from different views. non-end
+      // iterators compare less than end iterators.
+      friend int compare(const iterator& a, const iterator& b) {
+         if (a.view != b.view)
+            throw exception("iterators are from different views");
+         return compare_key(a.get_kv(), b.get_kv());
+      }
+
+      friend bool operator==(const iterator& a, const iterator& b) { return compare(a, b) == 0; }
+      friend bool operator!=(const iterator& a, const iterator& b) { return compare(a, b) != 0; }
+      friend bool operator<(const iterator& a, const iterator& b) { return compare(a, b) < 0; }
+      friend bool operator<=(const iterator& a, const iterator& b) { return compare(a, b) <= 0; }
+      friend bool operator>(const iterator& a, const iterator& b) { return compare(a, b) > 0; }
+      friend bool operator>=(const iterator& a, const iterator& b) { return compare(a, b) >= 0; }
+
+      iterator& operator++() {
+         if (!rocks_it->Valid())
+            move_to_begin();
+         else {
+            rocks_it->Next();
+            check_status("read_view::iterator::operator++: rocksdb::Iterator::Next: ");
+         }
+         return *this;
+      }
+
+      iterator& operator--() {
+         if (!rocks_it->Valid()) {
+            rocks_it->SeekToLast();
+            check_status("read_view::iterator::operator--: rocksdb::Iterator::SeekToLast: ");
+         } else {
+            rocks_it->Prev();
+            check_status("read_view::iterator::operator--: rocksdb::Iterator::Prev: ");
+         }
+         return *this;
+      }
+
+      void move_to_begin() {
+         rocks_it->SeekToFirst();
+         check_status("read_view::iterator::move_to_begin: rocksdb::Iterator::SeekToFirst: ");
+      }
+
+      void move_to_end() {
+         // Seeking to the upper bound leaves the iterator invalid (end) without scanning
+         rocks_it->Seek(bounds.upper_slice);
+         check_status("read_view::iterator::move_to_end: rocksdb::Iterator::Seek: ");
+      }
+
+      void lower_bound(const char* key, size_t size) {
+         auto& prefix   = bounds.lower;
+         auto  user_key = rocksdb::Slice{ prefix.data() + hidden_prefix_size, prefix.size() - hidden_prefix_size };
+         if (compare_blob(rocksdb::Slice{ key, size }, user_key) < 0) {
+            key  = prefix.data() + hidden_prefix_size;
+            size = prefix.size() - hidden_prefix_size;
+         }
+
+         key_buffer full_key{ prefix.data(), hidden_prefix_size, key, size };
+         rocks_it->Seek(to_slice(full_key));
+         check_status("read_view::iterator::lower_bound: rocksdb::Iterator::Seek: ");
+      }
+
+      void lower_bound(const bytes& key) { lower_bound(key.data(), key.size()); }
+
+      bool is_end() const { return !rocks_it->Valid(); }
+
+      // Same as !is_end(); snapshots don't change
+      bool is_valid() const { return rocks_it->Valid(); }
+      bool is_erased() const { return false; }
+
+      // Get key_value at current position. Returns nullopt if at end. The result is valid until
+      // the iterator moves. The returned key does not include the view's prefix or the contract.
+      std::optional<key_value> get_kv() const {
+         if (!rocks_it->Valid())
+            return {};
+         auto k = rocks_it->key();
+         return key_value{ rocksdb::Slice{ k.data() + hidden_prefix_size, k.size() - hidden_prefix_size },
+                           rocks_it->value() };
+      }
+   }; // iterator
+
+   read_view(const chain_kv::read_session& read_session, bytes prefix)
+       : read_session{ read_session }, prefix{ std::move(prefix) } {
+      if (this->prefix.empty())
+         throw exception("kv view may not have empty prefix");
+      if (this->prefix[0] == 0x00 || this->prefix[0] == (char)0xff)
+         throw exception("view may not have a prefix which begins with 0x00 or 0xff");
+   }
+
+   std::optional<bytes> get(uint64_t contract, const rocksdb::Slice& k) const {
+      return read_session.get(to_slice(key_buffer{ prefix, contract, k }));
+   }
+
+   std::vector<std::optional<bytes>> get_many(uint64_t contract, const std::vector<rocksdb::Slice>& keys) const {
+      bytes buffer;
+      return read_session.get_many(create_full_keys(buffer, prefix, contract, keys));
+   }
+}; // read_view
+
 } // namespace chain_kv
 
 FC_REFLECT(chain_kv::undo_state, (format_version)(revision)(undo_stack)(next_undo_segment))
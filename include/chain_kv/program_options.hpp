@@ -0,0 +1,166 @@
+#pragma once
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+#include <chain_kv/chain_kv.hpp>
+#include <fstream>
+
+namespace chain_kv {
+
+inline rocksdb::CompressionType compression_from_string(const std::string& name) {
+   if (name == "none")
+      return rocksdb::kNoCompression;
+   if (name == "snappy")
+      return rocksdb::kSnappyCompression;
+   if (name == "zlib")
+      return rocksdb::kZlibCompression;
+   if (name == "lz4")
+      return rocksdb::kLZ4Compression;
+   if (name == "lz4hc")
+      return rocksdb::kLZ4HCCompression;
+   if (name == "zstd")
+      return rocksdb::kZSTD;
+   throw exception("unknown compression type: " + name);
+}
+
+inline database_config database_config_preset(const std::string& name) {
+   if (name == "default")
+      return {};
+   if (name == "validator")
+      return database_config::validator();
+   if (name == "api-node")
+      return database_config::api_node();
+   if (name == "bulk-replay")
+      return database_config::bulk_replay();
+   throw exception("unknown database preset: " + name);
+}
+
+// Add database_config's options to desc. Options which aren't given keep the preset's values.
+inline void add_database_config_options(boost::program_options::options_description& desc,
+                                        const std::string&                           prefix = "chain-kv-") {
+   namespace po = boost::program_options;
+   auto add = [&](const char* name, const po::value_semantic* value, const char* description) {
+      desc.add_options()((prefix + name).c_str(), value, description);
+   };
+   add("preset", po::value<std::string>(), "Starting point: default, validator, api-node, or bulk-replay");
+   add("threads", po::value<uint32_t>(), "Background threads");
+   add("max-open-files", po::value<int>(), "Maximum open files; -1 is unlimited");
+   add("read-cache-size-mb", po::value<uint64_t>(), "Size of the shared read cache");
+   add("bloom-bits-per-key", po::value<double>(), "Bloom filter bits per key; 0 disables filters");
+   add("whole-key-filtering", po::value<bool>(), "Add whole keys to the filters");
+   add("view-prefix-size", po::value<size_t>(), "Length of view prefixes; enables prefix filters");
+   add("memtable-prefix-bloom-ratio", po::value<double>(), "Memtable prefix bloom size, as a fraction of write buffer");
+   add("block-cache-size-mb", po::value<uint64_t>(), "Size of the block cache");
+   add("block-cache-shard-bits", po::value<int>(), "Block cache shards are 2^n; -1 is automatic");
+   add("block-size", po::value<size_t>(), "Approximate size of uncompressed data per block");
+   add("row-cache-size-mb", po::value<uint64_t>(), "Size of the row cache; 0 disables it");
+   add("compression-per-level", po::value<std::string>(),
+       "Comma-separated compression for each level: none, snappy, zlib, lz4, lz4hc, zstd");
+   add("bottommost-compression", po::value<std::string>(), "Compression for the bottommost level");
+   add("write-buffer-size-mb", po::value<uint64_t>(), "Size of each memtable");
+   add("max-write-buffer-number", po::value<int>(), "Maximum number of memtables");
+   add("max-background-jobs", po::value<int>(), "Maximum concurrent flushes and compactions");
+   add("pipelined-write", po::value<bool>(), "Pipeline WAL and memtable writes");
+   add("bytes-per-sync", po::value<uint64_t>(), "Incrementally sync files after this many bytes");
+   add("direct-reads", po::value<bool>(), "Use O_DIRECT for reads");
+   add("direct-io-flush-compaction", po::value<bool>(), "Use O_DIRECT for flush and compaction");
+   add("disable-wal", po::value<bool>(), "Don't use the write-ahead log");
+   add("manual-wal-flush", po::value<bool>(), "Buffer WAL writes until the WAL is synced");
+   add("sync-wal-on-revision", po::value<bool>(), "Sync the WAL at each undo push and commit");
+   add("scan-readahead-size", po::value<size_t>(), "Readahead for range scans; 0 grows it automatically");
+   add("statistics", po::value<bool>(), "Collect rocksdb statistics");
+   add("memtable-insert-hint-per-batch", po::value<bool>(), "Reuse memtable insert positions within a batch");
+   add("read-threads", po::value<uint32_t>(), "Threads for asynchronous reads; 0 reads on the calling thread");
+   add("async-io", po::value<bool>(), "Use rocksdb's async_io for asynchronous reads");
+   add("undo-column-family", po::value<bool>(), "Keep undo data in its own column family");
+   add("undo-blob-files", po::value<bool>(), "Store large undo segments in blob files");
+   add("undo-min-blob-size", po::value<uint64_t>(), "Minimum size of undo segments stored in blob files");
+   add("undo-compaction-trigger", po::value<uint32_t>(), "Compact removed undo after this many range deletions");
+   add("undo-deletion-window", po::value<size_t>(), "Entries per window when counting undo deletions");
+   add("undo-deletion-trigger", po::value<size_t>(), "Deletions in a window which mark an undo file for compaction");
+   add("rate-limit-bytes-per-sec", po::value<int64_t>(), "Limit flush and compaction writes; 0 is unlimited");
+}
+
+// Build a database_config from options registered by add_database_config_options()
+inline database_config database_config_from_options(const boost::program_options::variables_map& vm,
+                                                    const std::string&                          prefix = "chain-kv-") {
+   auto has = [&](const char* name) { return vm.count(prefix + name) > 0; };
+   auto get = [&](auto& dest, const char* name) {
+      if (has(name))
+         dest = vm[prefix + name].as<std::decay_t<decltype(dest)>>();
+   };
+   auto get_opt = [&](auto& dest, const char* name) {
+      if (has(name))
+         dest = vm[prefix + name].as<typename std::decay_t<decltype(dest)>::value_type>();
+   };
+   auto get_mb = [&](std::optional<size_t>& dest, const char* name) {
+      if (has(name))
+         dest = size_t(vm[prefix + name].as<uint64_t>() << 20);
+   };
+
+   database_config config;
+   if (has("preset"))
+      config = database_config_preset(vm[prefix + "preset"].as<std::string>());
+   get_opt(config.threads, "threads");
+   get_opt(config.max_open_files, "max-open-files");
+   get_mb(config.read_cache_size, "read-cache-size-mb");
+   get(config.bloom_bits_per_key, "bloom-bits-per-key");
+   get(config.whole_key_filtering, "whole-key-filtering");
+   get_opt(config.view_prefix_size, "view-prefix-size");
+   get(config.memtable_prefix_bloom_size_ratio, "memtable-prefix-bloom-ratio");
+   get_mb(config.block_cache_size, "block-cache-size-mb");
+   get(config.block_cache_shard_bits, "block-cache-shard-bits");
+   get_opt(config.block_size, "block-size");
+   get_mb(config.row_cache_size, "row-cache-size-mb");
+   if (config.row_cache_size == size_t(0))
+      config.row_cache_size = {};
+   if (has("compression-per-level")) {
+      std::vector<std::string> names;
+      boost::split(names, vm[prefix + "compression-per-level"].as<std::string>(), boost::is_any_of(","));
+      config.compression_per_level.clear();
+      for (auto& name : names)
+         config.compression_per_level.push_back(compression_from_string(boost::trim_copy(name)));
+   }
+   if (has("bottommost-compression"))
+      config.bottommost_compression = compression_from_string(vm[prefix + "bottommost-compression"].as<std::string>());
+   get_mb(config.write_buffer_size, "write-buffer-size-mb");
+   get_opt(config.max_write_buffer_number, "max-write-buffer-number");
+   get_opt(config.max_background_jobs, "max-background-jobs");
+   get(config.enable_pipelined_write, "pipelined-write");
+   get(config.bytes_per_sync, "bytes-per-sync");
+   get(config.use_direct_reads, "direct-reads");
+   get(config.use_direct_io_for_flush_and_compaction, "direct-io-flush-compaction");
+   get(config.disable_wal, "disable-wal");
+   get(config.manual_wal_flush, "manual-wal-flush");
+   get(config.sync_wal_on_revision, "sync-wal-on-revision");
+   get(config.scan_readahead_size, "scan-readahead-size");
+   get(config.statistics, "statistics");
+   get(config.memtable_insert_hint_per_batch, "memtable-insert-hint-per-batch");
+   get(config.read_threads, "read-threads");
+   get(config.async_io, "async-io");
+   get(config.undo_column_family, "undo-column-family");
+   get(config.undo_blob_files, "undo-blob-files");
+   get(config.undo_min_blob_size, "undo-min-blob-size");
+   get(config.undo_compaction_trigger, "undo-compaction-trigger");
+   get(config.undo_deletion_window, "undo-deletion-window");
+   get(config.undo_deletion_trigger, "undo-deletion-trigger");
+   get(config.rate_limit_bytes_per_sec, "rate-limit-bytes-per-sec");
+   return config;
+}
+
+// Load a database_config from a file of `name = value` lines. Names are the options from
+// add_database_config_options() without a prefix.
+inline database_config load_database_config(const std::string& path) {
+   namespace po = boost::program_options;
+   std::ifstream file{ path };
+   if (!file)
+      throw exception("load_database_config: can't open " + path);
+   po::options_description desc;
+   add_database_config_options(desc, "");
+   po::variables_map vm;
+   po::store(po::parse_config_file(file, desc), vm);
+   po::notify(vm);
+   return database_config_from_options(vm, "");
+}
+
+} // namespace chain_kv
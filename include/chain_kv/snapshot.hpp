@@ -0,0 +1,255 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <chain_kv/chain_kv.hpp>
+#include <istream>
+#include <ostream>
+#include <rocksdb/sst_file_writer.h>
+
+namespace chain_kv {
+
+// Snapshot format. Integers are little-endian.
+//    header:  magic (8 bytes), format version (u32), revision (i64), crc32 of the preceding fields (u32)
+//    chunks:  payload size (u32, non-zero), crc32 of payload (u32), payload
+//    trailer: 0 (u32), number of key-value pairs (u64), crc32 of the count (u32)
+//
+// A payload holds key-value pairs in key order: key size (u32), key, value size (u32), value.
+// Keys are in ascending order across the whole snapshot.
+inline constexpr char     snapshot_magic[8]       = { 'c', 'h', 'a', 'i', 'n', '-', 'k', 'v' };
+inline constexpr uint32_t snapshot_format_version = 1;
+
+namespace snapshot_detail {
+
+   inline void append_u32(bytes& dest, uint32_t v) {
+      for (int i = 0; i < 4; ++i) //
+         dest.push_back(char(v >> (8 * i)));
+   }
+
+   inline void append_u64(bytes& dest, uint64_t v) {
+      for (int i = 0; i < 8; ++i) //
+         dest.push_back(char(v >> (8 * i)));
+   }
+
+   inline uint64_t read_le(const char* src, int size) {
+      uint64_t v = 0;
+      for (int i = 0; i < size; ++i) //
+         v |= uint64_t(uint8_t(src[i])) << (8 * i);
+      return v;
+   }
+
+   inline uint32_t checksum(const char* data, size_t size) {
+      return ::crc32(::crc32(0, nullptr, 0), (const Bytef*)data, size);
+   }
+
+   inline void read_exact(std::istream& in, char* dest, size_t size) {
+      if (!in.read(dest, size))
+         throw exception("import_snapshot: snapshot is truncated");
+   }
+
+   inline uint64_t read_int(std::istream& in, int size, uint32_t* crc = nullptr) {
+      char buf[8];
+      read_exact(in, buf, size);
+      if (crc)
+         *crc = ::crc32(*crc, (const Bytef*)buf, size);
+      return read_le(buf, size);
+   }
+
+   // Decode a chunk's payload into an sst file
+   inline uint64_t write_sst(const rocksdb::Options& options, const std::string& path,
+                             const std::vector<std::pair<bytes, uint32_t>>& chunks) {
+      rocksdb::SstFileWriter writer{ rocksdb::EnvOptions{}, options };
+      check(writer.Open(path), "import_snapshot: rocksdb::SstFileWriter::Open: ");
+      uint64_t num_pairs = 0;
+      for (auto& [payload, crc] : chunks) {
+         if (checksum(payload.data(), payload.size()) != crc)
+            throw exception("import_snapshot: chunk checksum mismatch");
+         size_t pos  = 0;
+         auto   read = [&]() -> rocksdb::Slice {
+            if (payload.size() - pos < 4)
+               throw exception("import_snapshot: invalid chunk");
+            auto size = read_le(payload.data() + pos, 4);
+            pos += 4;
+            if (payload.size() - pos < size)
+               throw exception("import_snapshot: invalid chunk");
+            rocksdb::Slice result{ payload.data() + pos, size };
+            pos += size;
+            return result;
+         };
+         while (pos < payload.size()) {
+            auto k = read();
+            auto v = read();
+            check(writer.Put(k, v), "import_snapshot: rocksdb::SstFileWriter::Put: ");
+            ++num_pairs;
+         }
+      }
+      check(writer.Finish(), "import_snapshot: rocksdb::SstFileWriter::Finish: ");
+      return num_pairs;
+   }
+
+} // namespace snapshot_detail
+
+// Write the database's contents to `out` in the snapshot format, from a consistent rocksdb
+// snapshot. Exports keys which begin with `prefix`, or all keys if it's empty, except the
+// sentinels and undo_stack's data. The snapshot records undo's revision, so nothing else
+// should write to the database while this starts. Returns the number of key-value pairs.
+inline uint64_t export_snapshot(database& db, const undo_stack& undo, std::ostream& out, const bytes& prefix = {},
+                                size_t chunk_size = 1024 * 1024) {
+   using namespace snapshot_detail;
+   auto snapshot = db.snapshot();
+
+   bytes header{ std::begin(snapshot_magic), std::end(snapshot_magic) };
+   append_u32(header, snapshot_format_version);
+   append_u64(header, undo.revision());
+   append_u32(header, checksum(header.data(), header.size()));
+   out.write(header.data(), header.size());
+
+   std::unique_ptr<iterator_bounds>   bounds;
+   std::unique_ptr<rocksdb::Iterator> rocks_it;
+   if (prefix.empty()) {
+      rocks_it.reset(db.rdb->NewIterator(database::iterator_options(snapshot.get())));
+   } else {
+      bounds = std::make_unique<iterator_bounds>(prefix);
+      rocks_it.reset(db.rdb->NewIterator(database::iterator_options(snapshot.get(), *bounds)));
+   }
+
+   auto  undo_prefix = to_slice(undo.prefix());
+   bytes payload;
+   bytes chunk_header;
+   auto  write_chunk = [&] {
+      chunk_header.clear();
+      append_u32(chunk_header, payload.size());
+      append_u32(chunk_header, checksum(payload.data(), payload.size()));
+      out.write(chunk_header.data(), chunk_header.size());
+      out.write(payload.data(), payload.size());
+      payload.clear();
+   };
+
+   uint64_t num_pairs = 0;
+   for (rocks_it->SeekToFirst(); rocks_it->Valid(); rocks_it->Next()) {
+      auto k = rocks_it->key();
+      if ((k.size() == 1 && (k[0] == 0x00 || k[0] == (char)0xff)) || k.starts_with(undo_prefix))
+         continue;
+      auto v = rocks_it->value();
+      append_u32(payload, k.size());
+      payload.insert(payload.end(), k.data(), k.data() + k.size());
+      append_u32(payload, v.size());
+      payload.insert(payload.end(), v.data(), v.data() + v.size());
+      ++num_pairs;
+      if (payload.size() >= chunk_size)
+         write_chunk();
+   }
+   check(rocks_it->status(), "export_snapshot: rocksdb::Iterator::Next: ");
+   if (!payload.empty())
+      write_chunk();
+
+   bytes trailer;
+   append_u32(trailer, 0);
+   append_u64(trailer, num_pairs);
+   append_u32(trailer, checksum(trailer.data() + 4, 8));
+   out.write(trailer.data(), trailer.size());
+   if (!out)
+      throw exception("export_snapshot: write failed");
+   return num_pairs;
+}
+
+struct snapshot_import_config {
+   std::string temp_dir;                          // Holds sst files until rocksdb ingests them
+   uint32_t    threads       = 0;                 // sst files built in parallel; 0 is hardware concurrency
+   uint64_t    sst_file_size = 256 * 1024 * 1024; // Approximate payload bytes per sst file
+};
+
+// Load a snapshot from export_snapshot() into db, then set undo's revision to the snapshot's.
+// Chunks are checksummed and turned into sst files in parallel, which rocksdb ingests in one
+// step, bypassing the write path. undo's stack must be empty. Keys in the snapshot replace
+// existing ones. Returns the number of key-value pairs.
+inline uint64_t import_snapshot(database& db, undo_stack& undo, std::istream& in,
+                                const snapshot_import_config& config) {
+   using namespace snapshot_detail;
+   if (undo.first_revision() != undo.revision())
+      throw exception("import_snapshot: undo stack isn't empty");
+
+   char     magic[sizeof(snapshot_magic)];
+   uint32_t header_crc = ::crc32(0, nullptr, 0);
+   read_exact(in, magic, sizeof(magic));
+   header_crc = ::crc32(header_crc, (const Bytef*)magic, sizeof(magic));
+   if (memcmp(magic, snapshot_magic, sizeof(magic)))
+      throw exception("import_snapshot: not a snapshot");
+   if (read_int(in, 4, &header_crc) != snapshot_format_version)
+      throw exception("import_snapshot: unsupported snapshot format");
+   auto revision = int64_t(read_int(in, 8, &header_crc));
+   if (read_int(in, 4) != header_crc)
+      throw exception("import_snapshot: header checksum mismatch");
+   if (revision < undo.revision())
+      throw exception("import_snapshot: revision cannot decrease");
+
+   auto threads = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+   auto options = db.rdb->GetOptions();
+   boost::filesystem::create_directories(config.temp_dir);
+
+   std::vector<std::string>                files;
+   std::deque<std::future<uint64_t>>       pending;
+   std::vector<std::pair<bytes, uint32_t>> chunks;
+   uint64_t                                chunks_size = 0;
+   uint64_t                                num_pairs   = 0;
+   auto                                    flush       = [&] {
+      if (chunks.empty())
+         return;
+      if (pending.size() >= threads) {
+         num_pairs += pending.front().get();
+         pending.pop_front();
+      }
+      files.push_back((boost::filesystem::path(config.temp_dir) / (std::to_string(files.size()) + ".sst")).string());
+      pending.push_back(std::async(std::launch::async, write_sst, std::cref(options), files.back(), std::move(chunks)));
+      chunks.clear();
+      chunks_size = 0;
+   };
+
+   try {
+      while (true) {
+         auto size = read_int(in, 4);
+         if (!size)
+            break;
+         auto  crc = uint32_t(read_int(in, 4));
+         bytes payload(size);
+         read_exact(in, payload.data(), size);
+         chunks_size += size;
+         chunks.emplace_back(std::move(payload), crc);
+         if (chunks_size >= config.sst_file_size)
+            flush();
+      }
+      uint32_t count_crc      = ::crc32(0, nullptr, 0);
+      auto     expected_pairs = read_int(in, 8, &count_crc);
+      if (read_int(in, 4) != count_crc)
+         throw exception("import_snapshot: trailer checksum mismatch");
+      flush();
+      for (; !pending.empty(); pending.pop_front()) //
+         num_pairs += pending.front().get();
+      if (num_pairs != expected_pairs)
+         throw exception("import_snapshot: snapshot has the wrong number of key-value pairs");
+
+      if (!files.empty()) {
+         rocksdb::IngestExternalFileOptions ingest;
+         ingest.move_files = true;
+         check(db.rdb->IngestExternalFile(files, ingest), "import_snapshot: rocksdb::DB::IngestExternalFile: ");
+      }
+      // rocksdb copies instead of moving when it can't link
+      for (auto& f : files) //
+         boost::filesystem::remove(f);
+   } catch (...) {
+      for (auto& p : pending) {
+         try {
+            p.get();
+         } catch (...) {}
+      }
+      for (auto& f : files) //
+         boost::filesystem::remove(f);
+      throw;
+   }
+
+   if (db.shared_read_cache)
+      db.shared_read_cache->clear();
+   undo.set_revision(revision);
+   return num_pairs;
+}
+
+} // namespace chain_kv
@@ -0,0 +1,88 @@
+#include "chain_kv_tests.hpp"
+#include <boost/filesystem.hpp>
+#include <chain_kv/backup.hpp>
+
+using chain_kv::bytes;
+using chain_kv::to_slice;
+
+BOOST_AUTO_TEST_SUITE(backup_tests)
+
+void write(chain_kv::database& db, chain_kv::undo_stack& undo_stack, char key, char value) {
+   chain_kv::write_session session{ db };
+   undo_stack.push();
+   session.set({ 0x70, key }, to_slice({ value }));
+   session.write_changes(undo_stack);
+}
+
+BOOST_AUTO_TEST_CASE(test_checkpoint) {
+   boost::filesystem::remove_all("test-checkpoint-db");
+   boost::filesystem::remove_all("test-checkpoint-copy");
+   chain_kv::database_config config;
+   config.undo_column_family = true;
+   {
+      chain_kv::database   db{ "test-checkpoint-db", true, config };
+      chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+      write(db, undo_stack, 0x01, 0x11);
+      write(db, undo_stack, 0x02, 0x22);
+      undo_stack.checkpoint("test-checkpoint-copy");
+      BOOST_REQUIRE_THROW(undo_stack.checkpoint("test-checkpoint-copy"), chain_kv::exception);
+      write(db, undo_stack, 0x03, 0x33);
+   }
+   BOOST_REQUIRE_EQUAL(chain_kv::undo_stack::checkpoint_revision("test-checkpoint-copy"), 2);
+   KV_REQUIRE_EXCEPTION(chain_kv::undo_stack::checkpoint_revision("test-checkpoint-db"),
+                        "database::read_checkpoint_metadata: test-checkpoint-db isn't a checkpoint");
+
+   chain_kv::database   db{ "test-checkpoint-copy", false, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 2);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), (kv_values{ { { { 0x70, 0x01 }, { 0x11 } },  //
+                                                             { { 0x70, 0x02 }, { 0x22 } } } }));
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), (kv_values{ { { { 0x70, 0x01 }, { 0x11 } } } }));
+}
+
+BOOST_AUTO_TEST_CASE(test_backup) {
+   boost::filesystem::remove_all("test-backup-db");
+   boost::filesystem::remove_all("test-backup-restored-db");
+   boost::filesystem::remove_all("test-backups");
+   {
+      chain_kv::database      db{ "test-backup-db", true };
+      chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+      chain_kv::backup_engine engine{ "test-backups", 2 };
+      write(db, undo_stack, 0x01, 0x11);
+      auto first = engine.create_backup(db, undo_stack);
+      write(db, undo_stack, 0x02, 0x22);
+      write(db, undo_stack, 0x03, 0x33);
+      auto second = engine.create_backup(db, undo_stack);
+      BOOST_REQUIRE(first != second);
+      engine.verify_backup(second);
+
+      auto backups = engine.backups();
+      BOOST_REQUIRE_EQUAL(backups.size(), 2u);
+      BOOST_REQUIRE_EQUAL(backups[0].id, first);
+      BOOST_REQUIRE_EQUAL(backups[0].revision, 1);
+      BOOST_REQUIRE_EQUAL(backups[1].id, second);
+      BOOST_REQUIRE_EQUAL(backups[1].revision, 3);
+   }
+
+   chain_kv::backup_engine engine{ "test-backups" };
+   engine.restore("test-backup-restored-db", engine.backups()[0].id);
+   {
+      chain_kv::database   db{ "test-backup-restored-db", false };
+      chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 1);
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), (kv_values{ { { { 0x70, 0x01 }, { 0x11 } } } }));
+   }
+
+   engine.purge_old_backups(1);
+   BOOST_REQUIRE_EQUAL(engine.backups().size(), 1u);
+   engine.restore("test-backup-restored-db");
+   chain_kv::database   db{ "test-backup-restored-db", false };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 3);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), (kv_values{ { { { 0x70, 0x01 }, { 0x11 } },  //
+                                                            { { 0x70, 0x02 }, { 0x22 } },
+                                                            { { 0x70, 0x03 }, { 0x33 } } } }));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
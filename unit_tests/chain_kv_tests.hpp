@@ -46,9 +46,11 @@ S& operator<<(S& s, const kv_values& v) {
       return false;                                                                                                    \
    });
 
-inline kv_values get_all(chain_kv::database& db, const chain_kv::bytes& prefix) {
+inline kv_values get_all(chain_kv::database& db, const chain_kv::bytes& prefix,
+                         rocksdb::ColumnFamilyHandle* cf = nullptr) {
    kv_values                          result;
-   std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(rocksdb::ReadOptions()) };
+   std::unique_ptr<rocksdb::Iterator> rocks_it{ db.rdb->NewIterator(rocksdb::ReadOptions(),
+                                                                    cf ? cf : db.rdb->DefaultColumnFamily()) };
    rocks_it->Seek(chain_kv::to_slice(prefix));
    while (rocks_it->Valid()) {
       auto k = rocks_it->key();
@@ -68,14 +70,15 @@ inline kv_values get_values(chain_kv::write_session& session, const std::vector<
    for (auto& key : keys) {
       chain_kv::bytes value;
       if (auto value = session.get(chain_kv::bytes{ key }))
-         result.values.push_back({ key, *value });
+         result.values.push_back({ key, chain_kv::to_bytes(*value) });
    }
    return result;
 }
 
-inline kv_values get_matching(chain_kv::view& view, uint64_t contract, const chain_kv::bytes& prefix = {}) {
-   kv_values                result;
-   chain_kv::view::iterator it{ view, contract, chain_kv::to_slice(prefix) };
+template <typename View>
+kv_values get_matching(View& view, uint64_t contract, const chain_kv::bytes& prefix = {}) {
+   kv_values               result;
+   typename View::iterator it{ view, contract, chain_kv::to_slice(prefix) };
    ++it;
    while (!it.is_end()) {
       auto kv = it.get_kv();
@@ -87,9 +90,10 @@ inline kv_values get_matching(chain_kv::view& view, uint64_t contract, const cha
    return result;
 }
 
-inline kv_values get_matching2(chain_kv::view& view, uint64_t contract, const chain_kv::bytes& prefix = {}) {
-   kv_values                result;
-   chain_kv::view::iterator it{ view, contract, chain_kv::to_slice(prefix) };
+template <typename View>
+kv_values get_matching2(View& view, uint64_t contract, const chain_kv::bytes& prefix = {}) {
+   kv_values               result;
+   typename View::iterator it{ view, contract, chain_kv::to_slice(prefix) };
    --it;
    while (!it.is_end()) {
       auto kv = it.get_kv();
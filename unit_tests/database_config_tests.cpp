@@ -0,0 +1,164 @@
+#include "chain_kv_tests.hpp"
+#include <boost/filesystem.hpp>
+#include <chain_kv/program_options.hpp>
+
+using chain_kv::bytes;
+using chain_kv::to_slice;
+
+BOOST_AUTO_TEST_SUITE(database_config_tests)
+
+void round_trip(const chain_kv::database_config& config) {
+   boost::filesystem::remove_all("test-database-config-db");
+   {
+      chain_kv::database      db{ "test-database-config-db", true, config };
+      chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      undo_stack.push();
+      view.set(0x1234, to_slice({ 0x30 }), to_slice({ 0x40 }));
+      session.write_changes(undo_stack);
+   }
+   chain_kv::database      db{ "test-database-config-db", false, config };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+   BOOST_REQUIRE(view.get(0x1234, to_slice({ 0x30 })) == std::optional{ to_slice({ 0x40 }) });
+}
+
+BOOST_AUTO_TEST_CASE(test_presets) {
+   round_trip({});
+   round_trip(chain_kv::database_config::validator());
+   round_trip(chain_kv::database_config::api_node());
+   round_trip(chain_kv::database_config::bulk_replay());
+}
+
+BOOST_AUTO_TEST_CASE(test_sync_wal_on_revision) {
+   chain_kv::database_config config;
+   config.disable_wal          = false;
+   config.manual_wal_flush     = true;
+   config.sync_wal_on_revision = true;
+   round_trip(config);
+
+   auto wal_syncs = [] { return chain_kv::get_metrics()[chain_kv::metric::wal_syncs]; };
+   boost::filesystem::remove_all("test-database-config-db");
+   {
+      chain_kv::database   db{ "test-database-config-db", true, config };
+      chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+      auto                 before = wal_syncs();
+      for (char i = 0; i < 3; ++i) {
+         chain_kv::write_session session{ db };
+         undo_stack.push();
+         session.set({ 0x70, i }, to_slice({ i }));
+         session.set({ 0x71, i }, to_slice({ i }));
+         session.write_changes(undo_stack);
+      }
+      BOOST_REQUIRE_EQUAL(wal_syncs() - before, 3u); // One per revision, not per write
+      undo_stack.commit(2);
+      BOOST_REQUIRE_EQUAL(wal_syncs() - before, 4u);
+   }
+   chain_kv::database   db{ "test-database-config-db", false, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 3);
+   BOOST_REQUIRE_EQUAL(undo_stack.first_revision(), 2);
+
+   config.disable_wal = true;
+   KV_REQUIRE_EXCEPTION((chain_kv::database{ "test-database-config-db", false, config }),
+                        "database::database: sync_wal_on_revision requires the WAL");
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_compaction) {
+   chain_kv::database_config config;
+   config.undo_column_family       = true;
+   config.undo_compaction_trigger  = 2;
+   config.undo_deletion_window     = 128;
+   config.undo_deletion_trigger    = 64;
+   config.rate_limit_bytes_per_sec = 64 << 20;
+   round_trip(config);
+
+   auto compactions = [] { return chain_kv::get_metrics()[chain_kv::metric::undo_compactions]; };
+   boost::filesystem::remove_all("test-database-config-db");
+   chain_kv::database   db{ "test-database-config-db", true, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   for (char i = 0; i < 5; ++i) {
+      chain_kv::write_session session{ db };
+      undo_stack.push();
+      session.set({ 0x70, i }, to_slice({ i }));
+      session.write_changes(undo_stack);
+   }
+   auto before = compactions();
+   undo_stack.commit(1);
+   db.wait_for_compactions();
+   BOOST_REQUIRE_EQUAL(compactions() - before, 0u);
+   undo_stack.commit(2);
+   db.wait_for_compactions();
+   BOOST_REQUIRE_EQUAL(compactions() - before, 1u); // Both commits' ranges at once
+   undo_stack.commit(3);
+   undo_stack.squash();
+   undo_stack.squash();
+   db.wait_for_compactions();
+   BOOST_REQUIRE_EQUAL(compactions() - before, 2u);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), kv_values{});
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }).values.size(), 5u);
+
+   config.undo_compaction_trigger = 0;
+   boost::filesystem::remove_all("test-database-config-db2");
+   chain_kv::database   db2{ "test-database-config-db2", true, config };
+   chain_kv::undo_stack undo_stack2{ db2, { 0x10 } };
+   undo_stack2.push();
+   undo_stack2.commit(1);
+   db2.wait_for_compactions();
+   BOOST_REQUIRE_EQUAL(compactions() - before, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(test_program_options) {
+   namespace po = boost::program_options;
+   po::options_description desc;
+   chain_kv::add_database_config_options(desc);
+
+   const char* argv[] = { "test",
+                          "--chain-kv-preset=api-node",
+                          "--chain-kv-block-cache-size-mb=64",
+                          "--chain-kv-row-cache-size-mb=0",
+                          "--chain-kv-compression-per-level=none, lz4,zstd",
+                          "--chain-kv-disable-wal=false",
+                          "--chain-kv-manual-wal-flush=true",
+                          "--chain-kv-undo-compaction-trigger=8",
+                          "--chain-kv-rate-limit-bytes-per-sec=1000000" };
+   po::variables_map vm;
+   po::store(po::parse_command_line(std::size(argv), argv, desc), vm);
+   po::notify(vm);
+   auto config = chain_kv::database_config_from_options(vm);
+
+   BOOST_REQUIRE(config.block_cache_size == size_t(64 << 20));
+   BOOST_REQUIRE(!config.row_cache_size);
+   BOOST_REQUIRE(config.compression_per_level ==
+                 (std::vector{ rocksdb::kNoCompression, rocksdb::kLZ4Compression, rocksdb::kZSTD }));
+   BOOST_REQUIRE(!config.disable_wal);
+   BOOST_REQUIRE(config.manual_wal_flush);
+   BOOST_REQUIRE_EQUAL(config.undo_compaction_trigger, 8u);
+   BOOST_REQUIRE_EQUAL(config.rate_limit_bytes_per_sec, 1000000);
+   BOOST_REQUIRE(config.use_direct_reads); // From preset
+   BOOST_REQUIRE_EQUAL(config.bloom_bits_per_key, 10);
+   BOOST_REQUIRE_EQUAL(config.scan_readahead_size, 2 << 20);
+
+   KV_REQUIRE_EXCEPTION(chain_kv::database_config_preset("x"), "unknown database preset: x");
+   KV_REQUIRE_EXCEPTION(chain_kv::compression_from_string("x"), "unknown compression type: x");
+}
+
+BOOST_AUTO_TEST_CASE(test_config_file) {
+   {
+      std::ofstream file{ "test-database-config.ini" };
+      file << "preset = bulk-replay\n"
+           << "max-background-jobs = 3\n"
+           << "view-prefix-size = 1\n";
+   }
+   auto config = chain_kv::load_database_config("test-database-config.ini");
+   BOOST_REQUIRE(config.max_background_jobs == 3);
+   BOOST_REQUIRE(config.view_prefix_size == size_t(1));
+   BOOST_REQUIRE(config.write_buffer_size == size_t(256 << 20)); // From preset
+   round_trip(config);
+
+   KV_REQUIRE_EXCEPTION(chain_kv::load_database_config("test-database-config-missing.ini"),
+                        "load_database_config: can't open test-database-config-missing.ini");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,112 @@
+#include "chain_kv_tests.hpp"
+#include <boost/filesystem.hpp>
+
+using chain_kv::bytes;
+using chain_kv::latency;
+using chain_kv::metric;
+using chain_kv::to_slice;
+
+BOOST_AUTO_TEST_SUITE(metrics_tests)
+
+// Counters are process-wide, so compare before and after
+struct metrics_delta {
+   chain_kv::stats_snapshot before = chain_kv::get_metrics();
+
+   uint64_t operator()(metric m) const { return chain_kv::get_metrics()[m] - before[m]; }
+   uint64_t operator()(latency l) const { return chain_kv::get_metrics()[l].count - before[l].count; }
+};
+
+BOOST_AUTO_TEST_CASE(test_metrics) {
+   boost::filesystem::remove_all("test-metrics-db");
+   chain_kv::database_config config;
+   config.read_cache_size = 1024 * 1024;
+   config.statistics      = true;
+   chain_kv::database   db{ "test-metrics-db", true, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+
+   {
+      metrics_delta           delta;
+      chain_kv::write_session session{ db };
+      undo_stack.push();
+      session.set({ 0x20, 0x01 }, to_slice({ 0x11 }));
+      session.set({ 0x20, 0x02 }, to_slice({ 0x22 }));
+      session.set({ 0x20, 0x03 }, to_slice({ 0x33 }));
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE_EQUAL(delta(metric::undo_revision_writes), 1u);
+      BOOST_REQUIRE_EQUAL(delta(metric::undo_segments), 1u);
+      BOOST_REQUIRE(delta(metric::undo_segment_bytes) > 0);
+      BOOST_REQUIRE(delta(metric::db_writes) >= 1);
+      BOOST_REQUIRE(delta(metric::db_write_bytes) > 0);
+      BOOST_REQUIRE_EQUAL(delta(latency::db_write), delta(metric::db_writes));
+      BOOST_REQUIRE_EQUAL(delta(latency::write_changes), 1u);
+      BOOST_REQUIRE_EQUAL(delta(metric::sessions_wiped), 1u);
+      BOOST_REQUIRE_EQUAL(delta(metric::session_cache_entries), 3u);
+      BOOST_REQUIRE(delta(metric::session_cache_bytes) > 0);
+   }
+
+   {
+      metrics_delta           delta;
+      chain_kv::write_session session{ db };
+      session.get({ 0x20, 0x01 });
+      session.get({ 0x20, 0x01 });
+      session.get_many({ to_slice({ 0x20, 0x01 }), to_slice({ 0x20, 0x02 }), to_slice({ 0x20, 0x04 }) });
+      // set() read the first 3 keys, which put them in the read cache
+      BOOST_REQUIRE_EQUAL(delta(metric::get_read_cache_hits), 2u);
+      BOOST_REQUIRE_EQUAL(delta(metric::get_cache_hits), 2u);
+      BOOST_REQUIRE_EQUAL(delta(metric::get_db_reads), 1u);
+
+      chain_kv::write_session session2{ db };
+      session2.get({ 0x20, 0x02 });
+      session2.get_many({ to_slice({ 0x20, 0x01 }), to_slice({ 0x20, 0x04 }) });
+      BOOST_REQUIRE_EQUAL(delta(metric::get_read_cache_hits), 5u);
+      BOOST_REQUIRE_EQUAL(delta(metric::get_db_reads), 1u);
+   }
+
+   {
+      metrics_delta           delta;
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      view.set(0x1234, to_slice({ 0x01 }), to_slice({ 0x11 }));
+      view.set(0x1234, to_slice({ 0x02 }), to_slice({ 0x22 }));
+      session.write_changes(undo_stack);
+
+      chain_kv::view::iterator it{ view, 0x1234, {} };
+      it.move_to_begin();
+      ++it;
+      ++it;
+      BOOST_REQUIRE(it.is_end());
+      BOOST_REQUIRE_EQUAL(delta(metric::iterator_steps), 2u);
+      BOOST_REQUIRE(delta(metric::iterator_fill_cache) >= 2);
+   }
+
+   {
+      metrics_delta delta;
+      undo_stack.undo();
+      BOOST_REQUIRE_EQUAL(delta(latency::undo), 1u);
+   }
+
+   auto stats = db.stats();
+   BOOST_REQUIRE(stats[metric::db_writes] > 0);
+   BOOST_REQUIRE(stats[latency::db_write].percentile_ns(0.5) > 0);
+   BOOST_REQUIRE(!stats.rocksdb_statistics.empty());
+   BOOST_REQUIRE(stats.to_string().find("get_cache_hits ") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_metrics) {
+   metrics_delta delta;
+   std::thread   t{ [] { chain_kv::add_metric(metric::iterator_steps, 5); } };
+   t.join();
+   BOOST_REQUIRE_EQUAL(delta(metric::iterator_steps), 5u);
+}
+
+BOOST_AUTO_TEST_CASE(test_perf_scope) {
+   auto prev = rocksdb::GetPerfLevel();
+   {
+      chain_kv::perf_scope scope;
+      BOOST_REQUIRE(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kEnableTimeExceptForMutex);
+      BOOST_REQUIRE(!scope.to_string().empty());
+   }
+   BOOST_REQUIRE(rocksdb::GetPerfLevel() == prev);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
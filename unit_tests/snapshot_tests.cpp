@@ -0,0 +1,118 @@
+#include "chain_kv_tests.hpp"
+#include <boost/filesystem.hpp>
+#include <chain_kv/snapshot.hpp>
+#include <sstream>
+
+using chain_kv::bytes;
+using chain_kv::to_slice;
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+void fill(chain_kv::database& db, chain_kv::undo_stack& undo_stack) {
+   chain_kv::write_session session{ db };
+   for (int i = 0; i < 300; ++i) {
+      session.set({ 0x70, char(i >> 8), char(i) }, to_slice(bytes(i % 17, char(i))));
+      session.set({ 0x71, char(i >> 8), char(i) }, to_slice({ char(i), 0x01 }));
+   }
+   undo_stack.push();
+   session.set({ 0x71, 0x00, 0x05 }, to_slice({ 0x55 }));
+   session.erase({ 0x70, 0x00, 0x07 });
+   session.write_changes(undo_stack);
+   undo_stack.commit(undo_stack.revision());
+}
+
+void test_round_trip(bool undo_column_family) {
+   chain_kv::database_config config;
+   config.undo_column_family = undo_column_family;
+   boost::filesystem::remove_all("test-snapshot-src-db");
+   boost::filesystem::remove_all("test-snapshot-dst-db");
+   boost::filesystem::remove_all("test-snapshot-tmp");
+
+   chain_kv::database   src{ "test-snapshot-src-db", true, config };
+   chain_kv::undo_stack src_undo{ src, { 0x10 } };
+   src_undo.set_revision(10);
+   fill(src, src_undo);
+
+   std::stringstream ss;
+   BOOST_REQUIRE_EQUAL(chain_kv::export_snapshot(src, src_undo, ss, {}, 1000), 599u);
+
+   chain_kv::database   dst{ "test-snapshot-dst-db", true, config };
+   chain_kv::undo_stack dst_undo{ dst, { 0x10 } };
+   BOOST_REQUIRE_EQUAL(chain_kv::import_snapshot(dst, dst_undo, ss, { "test-snapshot-tmp", 2, 4000 }), 599u);
+   BOOST_REQUIRE_EQUAL(dst_undo.revision(), 11);
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x70 }), get_all(src, { 0x70 }));
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x71 }), get_all(src, { 0x71 }));
+
+   // The imported data can be changed and undone like any other
+   chain_kv::write_session session{ dst };
+   dst_undo.push();
+   session.set({ 0x71, 0x00, 0x05 }, to_slice({ 0x66 }));
+   session.write_changes(dst_undo);
+   dst_undo.undo();
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x71 }), get_all(src, { 0x71 }));
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot) {
+   test_round_trip(false);
+   test_round_trip(true);
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot_prefix) {
+   boost::filesystem::remove_all("test-snapshot-src-db");
+   boost::filesystem::remove_all("test-snapshot-dst-db");
+   boost::filesystem::remove_all("test-snapshot-tmp");
+
+   chain_kv::database   src{ "test-snapshot-src-db", true };
+   chain_kv::undo_stack src_undo{ src, { 0x10 } };
+   fill(src, src_undo);
+
+   std::stringstream ss;
+   BOOST_REQUIRE_EQUAL(chain_kv::export_snapshot(src, src_undo, ss, { 0x71 }), 300u);
+
+   chain_kv::database   dst{ "test-snapshot-dst-db", true };
+   chain_kv::undo_stack dst_undo{ dst, { 0x10 } };
+   BOOST_REQUIRE_EQUAL(chain_kv::import_snapshot(dst, dst_undo, ss, { "test-snapshot-tmp" }), 300u);
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x70 }), kv_values{});
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x71 }), get_all(src, { 0x71 }));
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot_errors) {
+   boost::filesystem::remove_all("test-snapshot-src-db");
+   boost::filesystem::remove_all("test-snapshot-dst-db");
+   boost::filesystem::remove_all("test-snapshot-tmp");
+
+   chain_kv::database   src{ "test-snapshot-src-db", true };
+   chain_kv::undo_stack src_undo{ src, { 0x10 } };
+   src_undo.set_revision(10);
+   fill(src, src_undo);
+   std::stringstream ss;
+   chain_kv::export_snapshot(src, src_undo, ss, {}, 1000);
+   auto snapshot = ss.str();
+
+   chain_kv::database   dst{ "test-snapshot-dst-db", true };
+   chain_kv::undo_stack dst_undo{ dst, { 0x10 } };
+   auto                 import = [&](const std::string& s) {
+      std::istringstream in{ s };
+      chain_kv::import_snapshot(dst, dst_undo, in, { "test-snapshot-tmp", 2, 1000 });
+   };
+
+   auto corrupt = snapshot;
+   corrupt[0]   = 'x';
+   KV_REQUIRE_EXCEPTION(import(corrupt), "import_snapshot: not a snapshot");
+   corrupt = snapshot;
+   corrupt[12] ^= 1;
+   KV_REQUIRE_EXCEPTION(import(corrupt), "import_snapshot: header checksum mismatch");
+   corrupt = snapshot;
+   corrupt[snapshot.size() / 2] ^= 1;
+   KV_REQUIRE_EXCEPTION(import(corrupt), "import_snapshot: chunk checksum mismatch");
+   KV_REQUIRE_EXCEPTION(import(snapshot.substr(0, snapshot.size() - 1)), "import_snapshot: snapshot is truncated");
+   BOOST_REQUIRE_EQUAL(get_all(dst, { 0x70 }), kv_values{});
+   BOOST_REQUIRE_EQUAL(dst_undo.revision(), 0);
+
+   dst_undo.set_revision(12);
+   KV_REQUIRE_EXCEPTION(import(snapshot), "import_snapshot: revision cannot decrease");
+   dst_undo.push();
+   KV_REQUIRE_EXCEPTION(import(snapshot), "import_snapshot: undo stack isn't empty");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
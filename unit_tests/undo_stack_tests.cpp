@@ -6,14 +6,17 @@ using chain_kv::to_slice;
 
 BOOST_AUTO_TEST_SUITE(undo_stack_tests)
 
-void undo_tests(bool reload_undo, uint64_t target_segment_size) {
+void undo_tests(bool reload_undo, uint64_t target_segment_size, const chain_kv::database_config& db_config = {},
+                bool revision_keys = false) {
    boost::filesystem::remove_all("test-undo-db");
-   chain_kv::database                    db{ "test-undo-db", true };
+   chain_kv::database                    db{ "test-undo-db", true, db_config };
    std::unique_ptr<chain_kv::undo_stack> undo_stack;
+   chain_kv::undo_stack_config           undo_config{ target_segment_size };
+   undo_config.revision_keys = revision_keys;
 
    auto reload = [&] {
       if (!undo_stack || reload_undo)
-         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, target_segment_size);
+         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, undo_config);
    };
    reload();
 
@@ -31,7 +34,7 @@ void undo_tests(bool reload_undo, uint64_t target_segment_size) {
    }
    KV_REQUIRE_EXCEPTION(undo_stack->undo(), "nothing to undo");
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 0);
-   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
    BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
                                                     { { 0x20, 0x00 }, {} },
                                                     { { 0x20, 0x01 }, { 0x50 } },
@@ -49,7 +52,7 @@ void undo_tests(bool reload_undo, uint64_t target_segment_size) {
       session.set({ 0x20, 0x00 }, to_slice({ 0x70 }));
       session.write_changes(*undo_stack);
    }
-   BOOST_REQUIRE_NE(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // has undo segments
+   BOOST_REQUIRE_NE(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // has undo segments
    BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
                                                     { { 0x20, 0x00 }, { 0x70 } },
                                                     { { 0x20, 0x03 }, { 0x60 } },
@@ -60,7 +63,7 @@ void undo_tests(bool reload_undo, uint64_t target_segment_size) {
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 1);
    KV_REQUIRE_EXCEPTION(undo_stack->set_revision(2), "cannot set revision while there is an existing undo stack");
    undo_stack->undo();
-   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 0);
    reload();
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 0);
@@ -81,7 +84,7 @@ void undo_tests(bool reload_undo, uint64_t target_segment_size) {
       session.set({ 0x20, 0x00 }, to_slice({ 0x70 }));
       session.write_changes(*undo_stack);
    }
-   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
    reload();
    undo_stack->push();
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 11);
@@ -109,14 +112,17 @@ void undo_tests(bool reload_undo, uint64_t target_segment_size) {
 
 } // undo_tests()
 
-void squash_tests(bool reload_undo, uint64_t target_segment_size) {
+void squash_tests(bool reload_undo, uint64_t target_segment_size, const chain_kv::database_config& db_config = {},
+                  bool revision_keys = false) {
    boost::filesystem::remove_all("test-squash-db");
-   chain_kv::database                    db{ "test-squash-db", true };
+   chain_kv::database                    db{ "test-squash-db", true, db_config };
    std::unique_ptr<chain_kv::undo_stack> undo_stack;
+   chain_kv::undo_stack_config           undo_config{ target_segment_size };
+   undo_config.revision_keys = revision_keys;
 
    auto reload = [&] {
       if (!undo_stack || reload_undo)
-         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, target_segment_size);
+         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, undo_config);
    };
    reload();
 
@@ -252,14 +258,17 @@ void squash_tests(bool reload_undo, uint64_t target_segment_size) {
    BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {} }));
 } // squash_tests()
 
-void commit_tests(bool reload_undo, uint64_t target_segment_size) {
+void commit_tests(bool reload_undo, uint64_t target_segment_size, const chain_kv::database_config& db_config = {},
+                  bool revision_keys = false) {
    boost::filesystem::remove_all("test-commit-db");
-   chain_kv::database                    db{ "test-commit-db", true };
+   chain_kv::database                    db{ "test-commit-db", true, db_config };
    std::unique_ptr<chain_kv::undo_stack> undo_stack;
+   chain_kv::undo_stack_config           undo_config{ target_segment_size };
+   undo_config.revision_keys = revision_keys;
 
    auto reload = [&] {
       if (!undo_stack || reload_undo)
-         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, target_segment_size);
+         undo_stack = std::make_unique<chain_kv::undo_stack>(db, bytes{ 0x10 }, undo_config);
    };
    reload();
 
@@ -363,7 +372,7 @@ void commit_tests(bool reload_undo, uint64_t target_segment_size) {
    // Can't undo revision 1
    KV_REQUIRE_EXCEPTION(undo_stack->undo(), "nothing to undo");
 
-   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
 
    // revision 2
    undo_stack->push();
@@ -414,7 +423,7 @@ void commit_tests(bool reload_undo, uint64_t target_segment_size) {
    // Can't undo
    KV_REQUIRE_EXCEPTION(undo_stack->undo(), "nothing to undo");
 
-   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
 
    reload();
    BOOST_REQUIRE_EQUAL(undo_stack->revision(), 3);
@@ -433,11 +442,714 @@ void commit_tests(bool reload_undo, uint64_t target_segment_size) {
                                               } }));
 } // commit_tests()
 
+void blind_write_tests(uint64_t target_segment_size, bool sorted_changes = false) {
+   boost::filesystem::remove_all("test-blind-db");
+   chain_kv::database          db{ "test-blind-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = target_segment_size;
+   config.sorted_changes      = sorted_changes;
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+
+   // No undo stack; nothing needs the original values
+   {
+      chain_kv::write_session session{ db };
+      session.blind_writes = true;
+      session.set({ 0x20, 0x01 }, to_slice({ 0x50 }));
+      session.set({ 0x20, 0x02 }, to_slice({ 0x60 }));
+      session.set({ 0x20, 0x03 }, to_slice({ 0x70 }));
+      session.erase({ 0x20, 0x04 });
+      session.write_changes(undo_stack);
+   }
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x01 }, { 0x50 } },
+                                                    { { 0x20, 0x02 }, { 0x60 } },
+                                                    { { 0x20, 0x03 }, { 0x70 } },
+                                              } }));
+
+   // Original values are fetched for the undo segment
+   undo_stack.push();
+   {
+      chain_kv::write_session session{ db };
+      session.blind_writes = true;
+      session.erase({ 0x20, 0x01 });
+      session.set({ 0x20, 0x02 }, to_slice({ 0x61 }));
+      session.set({ 0x20, 0x03 }, to_slice({ 0x70 }));
+      session.set({ 0x20, 0x05 }, to_slice({ 0x05 }));
+      session.erase({ 0x20, 0x06 });
+      session.set({ 0x20, 0x06 }, to_slice({ 0x06 }));
+      BOOST_REQUIRE_EQUAL(get_values(session, { { 0x20, 0x01 }, { 0x20, 0x02 }, { 0x20, 0x06 } }),
+                          (kv_values{ {
+                                { { 0x20, 0x02 }, { 0x61 } },
+                                { { 0x20, 0x06 }, { 0x06 } },
+                          } }));
+      session.write_changes(undo_stack);
+   }
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x02 }, { 0x61 } },
+                                                    { { 0x20, 0x03 }, { 0x70 } },
+                                                    { { 0x20, 0x05 }, { 0x05 } },
+                                                    { { 0x20, 0x06 }, { 0x06 } },
+                                              } }));
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x01 }, { 0x50 } },
+                                                    { { 0x20, 0x02 }, { 0x60 } },
+                                                    { { 0x20, 0x03 }, { 0x70 } },
+                                              } }));
+} // blind_write_tests()
+
+void streaming_undo_tests(uint64_t undo_batch_size, uint32_t undo_threads, uint64_t target_segment_size = 0,
+                          chain_kv::undo_codec codec = chain_kv::undo_codec::none, bool store_new_value = true,
+                          bool sorted_changes = false, uint32_t encode_threads = 1) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database          db{ "test-undo-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = target_segment_size;
+   config.codec               = codec;
+   config.store_new_value     = store_new_value;
+   config.undo_batch_size     = undo_batch_size;
+   config.undo_threads        = undo_threads;
+   config.sorted_changes      = sorted_changes;
+   config.encode_threads      = encode_threads;
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+
+   auto write = [&](int revision) {
+      chain_kv::write_session session{ db };
+      for (int i = 0; i < 20; ++i) {
+         if ((i + revision) % 7 == 0)
+            session.erase({ 0x20, (char)i });
+         else
+            session.set({ 0x20, (char)i }, to_slice({ (char)revision, (char)i }));
+      }
+      session.write_changes(undo_stack);
+   };
+
+   std::vector<kv_values> states;
+   write(0);
+   states.push_back(get_all(db, { 0x20 }));
+   for (int revision = 1; revision <= 4; ++revision) {
+      undo_stack.push();
+      write(revision);
+      write(revision + 10);
+      states.push_back(get_all(db, { 0x20 }));
+   }
+   if (sorted_changes) {
+      for (auto& [k, v] : get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()).values) {
+         auto segment = chain_kv::decode_undo_segment(to_slice(v), undo_stack.format_version());
+         BOOST_REQUIRE(std::is_sorted(segment.entries.begin(), segment.entries.end(), [](auto& a, auto& b) {
+            return chain_kv::compare_blob(a.key, b.key) < 0;
+         }));
+      }
+   }
+   while (!states.empty()) {
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), states.back());
+      states.pop_back();
+      if (undo_stack.revision())
+         undo_stack.undo();
+   }
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 0);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
+} // streaming_undo_tests()
+
+BOOST_AUTO_TEST_CASE(test_streaming_undo) {
+   streaming_undo_tests(0, 1);
+   streaming_undo_tests(0, 4);
+   streaming_undo_tests(50, 3);
+   streaming_undo_tests(1024 * 1024, 1);
+   streaming_undo_tests(1024 * 1024, 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_run_parallel) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+
+   // Workers are started once and reused
+   for (int round = 0; round < 3; ++round) {
+      std::vector<int> done(8);
+      db.run_parallel(done.size(), [&](size_t i) { done[i] = 1; });
+      BOOST_REQUIRE((done == std::vector<int>(8, 1)));
+   }
+   db.run_parallel(0, [](size_t) { BOOST_FAIL("task ran"); });
+
+   // Every task finishes before an error is rethrown
+   std::atomic<int> finished = 0;
+   KV_REQUIRE_EXCEPTION(db.run_parallel(4,
+                                        [&](size_t i) {
+                                           ++finished;
+                                           if (i == 2)
+                                              throw chain_kv::exception("task failed");
+                                        }),
+                        "task failed");
+   BOOST_REQUIRE_EQUAL(finished, 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_codecs) {
+   for (auto codec : { chain_kv::undo_codec::none, chain_kv::undo_codec::zlib, chain_kv::undo_codec::zstd,
+                       chain_kv::undo_codec::lz4 }) {
+      if (!chain_kv::undo_codec_available(codec)) {
+         KV_REQUIRE_EXCEPTION(streaming_undo_tests(0, 1, 0, codec), "undo codec isn't available in this build");
+         continue;
+      }
+      for (bool store_new_value : { false, true }) {
+         streaming_undo_tests(0, 1, 0, codec, store_new_value);
+         streaming_undo_tests(0, 1, 64 * 1024 * 1024, codec, store_new_value);
+         streaming_undo_tests(1024 * 1024, 4, 100, codec, store_new_value);
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_format_upgrade) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+
+   // A format 0 database with a live segment
+   {
+      chain_kv::undo_state state;
+      state.revision          = 1;
+      state.undo_stack        = { 1 };
+      state.next_undo_segment = 1;
+      bytes segment;
+      {
+         fc::datastream<size_t> size_stream;
+         chain_kv::pack_undo_segment(size_stream, to_slice({ 0x20, 0x01 }), to_slice({ 0x50 }), to_slice({ 0x51 }));
+         segment.resize(size_stream.tellp());
+         fc::datastream<char*> ds(segment.data(), segment.size());
+         chain_kv::pack_undo_segment(ds, to_slice({ 0x20, 0x01 }), to_slice({ 0x50 }), to_slice({ 0x51 }));
+      }
+      rocksdb::WriteBatch batch;
+      batch.Put(to_slice({ 0x10, 0x00 }), to_slice(fc::raw::pack(state)));
+      batch.Put(to_slice({ 0x10, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0 }), to_slice(segment));
+      batch.Put(to_slice({ 0x20, 0x01 }), to_slice({ 0x51 }));
+      db.write(batch);
+   }
+
+   chain_kv::undo_stack_config config;
+   config.codec           = chain_kv::undo_codec::zlib;
+   config.store_new_value = false;
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 1); // Waits for the old segment to go away
+      undo_stack.undo();
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                       { { 0x20, 0x01 }, { 0x50 } },
+                                                 } }));
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 1);
+
+      undo_stack.push();
+      chain_kv::write_session session{ db };
+      session.set({ 0x20, 0x01 }, to_slice({ 0x52 }));
+      session.set({ 0x20, 0x02 }, to_slice({ 0x53 }));
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 2);
+   }
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+   BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 2);
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x01 }, { 0x50 } },
+                                              } }));
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_undo) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+   {
+      chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 }, 0 };
+      chain_kv::write_session session{ db };
+      session.set({ 0x20, 0x01 }, to_slice({ 0x50 }));
+      session.write_changes(undo_stack);
+      undo_stack.push();
+      session.set({ 0x20, 0x01 }, to_slice({ 0x51 }));
+      session.set({ 0x20, 0x02 }, to_slice({ 0x52 }));
+      session.write_changes(undo_stack);
+   }
+
+   // Simulate a crash after undo() wrote its first batch: the remaining segments
+   // are still present and the state is marked
+   auto state_kv = get_all(db, { 0x10, 0x00 }).values.at(0);
+   auto state    = chain_kv::unpack_undo_state(to_slice(state_kv.second));
+   BOOST_REQUIRE_EQUAL(state.revision, 1);
+   state.undo_in_progress = true;
+   {
+      fc::datastream<size_t> size_stream;
+      chain_kv::pack_undo_state(size_stream, state);
+      bytes                 data(size_stream.tellp());
+      fc::datastream<char*> ds(data.data(), data.size());
+      chain_kv::pack_undo_state(ds, state);
+      rocksdb::WriteBatch batch;
+      batch.Put(to_slice(state_kv.first), to_slice(data));
+      db.write(batch);
+   }
+
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 } };
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 0);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{})); // no undo segments
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x01 }, { 0x50 } },
+                                              } }));
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_format_versions) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+
+   auto write_state = [&](const chain_kv::undo_state& state) {
+      rocksdb::WriteBatch batch;
+      batch.Put(to_slice({ 0x10, 0x00 }), to_slice(fc::raw::pack(state)));
+      db.write(batch);
+   };
+
+   // Format 0 has no undo_in_progress
+   chain_kv::undo_state state;
+   state.revision = 5;
+   write_state(state);
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 } };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 5);
+      undo_stack.push();
+   }
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 } };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 6);
+   }
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x00 }).values[0].second[0], 2); // 3 and 4 are opt-in; see undo_stack_config
+
+   state.format_version = chain_kv::undo_state::max_format_version + 1;
+   write_state(state);
+   KV_REQUIRE_EXCEPTION((chain_kv::undo_stack{ db, bytes{ 0x10 } }), "invalid undo format");
+}
+
+BOOST_AUTO_TEST_CASE(test_blind_writes) {
+   blind_write_tests(0);
+   blind_write_tests(64 * 1024 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_changes) {
+   streaming_undo_tests(0, 1, 0, chain_kv::undo_codec::none, true, true);
+   streaming_undo_tests(0, 1, 64 * 1024 * 1024, chain_kv::undo_codec::none, false, true);
+   streaming_undo_tests(1024 * 1024, 4, 100, chain_kv::undo_codec::zlib, true, true);
+   blind_write_tests(0, true);
+   blind_write_tests(64 * 1024 * 1024, true);
+
+   chain_kv::database_config db_config;
+   db_config.memtable_insert_hint_per_batch = true;
+   undo_tests(false, 0, db_config);
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_delta_encoding) {
+   auto round_trip = [](const bytes& target, const bytes& base) {
+      bytes delta{ 0x77 };
+      if (!chain_kv::append_undo_delta(delta, to_slice(target), to_slice(base))) {
+         BOOST_REQUIRE(delta == bytes{ 0x77 });
+         return false;
+      }
+      BOOST_REQUIRE(delta.size() - 1 < target.size());
+      bytes result;
+      chain_kv::apply_undo_delta(result, to_slice(base), { delta.data() + 1, delta.size() - 1 });
+      BOOST_REQUIRE(result == target);
+      return true;
+   };
+   bytes row(200, 0x11);
+   auto  changed = [&](std::vector<std::pair<size_t, char>> changes) {
+      auto r = row;
+      for (auto [pos, c] : changes) //
+         r[pos] = c;
+      return r;
+   };
+   BOOST_REQUIRE(round_trip(changed({ { 0, 0x01 } }), row));
+   BOOST_REQUIRE(round_trip(changed({ { 199, 0x01 } }), row));
+   BOOST_REQUIRE(round_trip(changed({ { 40, 0x01 }, { 41, 0x02 }, { 44, 0x03 }, { 120, 0x04 } }), row));
+   BOOST_REQUIRE(round_trip(row, changed({ { 3, 0x01 }, { 150, 0x02 } })));
+   auto longer = row;
+   longer.insert(longer.begin() + 50, 30, 0x22);
+   BOOST_REQUIRE(round_trip(longer, row));
+   BOOST_REQUIRE(round_trip(row, longer));
+   BOOST_REQUIRE(round_trip(bytes(190, 0x11), row));
+   BOOST_REQUIRE(!round_trip(bytes(200, 0x33), row));
+   BOOST_REQUIRE(!round_trip(bytes{ 0x01 }, bytes{ 0x02 }));
+
+   bytes result;
+   KV_REQUIRE_EXCEPTION(chain_kv::apply_undo_delta(result, to_slice({ 0x01 }), to_slice({ 0x02, 0x00, 0x00 })),
+                        "apply_undo_delta: diff doesn't fit its base");
+}
+
+// Rows which change a few bytes at a time. Returns the bytes of undo segments written.
+uint64_t delta_undo_tests(bool delta_values, bool store_new_value, uint64_t target_segment_size,
+                          uint64_t undo_batch_size, chain_kv::undo_codec codec = chain_kv::undo_codec::none) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database          db{ "test-undo-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = target_segment_size;
+   config.codec               = codec;
+   config.store_new_value     = store_new_value;
+   config.undo_batch_size     = undo_batch_size;
+   config.delta_values        = delta_values;
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+   BOOST_REQUIRE_EQUAL(undo_stack.format_version(), delta_values ? 3 : 2);
+
+   std::map<bytes, bytes> rows;
+   auto                   write = [&](int revision) {
+      chain_kv::write_session session{ db };
+      for (int i = 0; i < 20; ++i) {
+         bytes key{ 0x20, (char)i };
+         auto& row = rows[key];
+         if (row.empty())
+            row.assign(200, (char)i);
+         row[10 + revision % 7] = (char)revision;
+         row[100 + i]           = (char)(revision + i);
+         if (i == 3)
+            row.push_back((char)revision);
+         if ((i + revision) % 9 == 0)
+            session.erase(key);
+         else
+            session.set(key, to_slice(row));
+      }
+      session.write_changes(undo_stack);
+   };
+
+   std::vector<kv_values> states;
+   write(0);
+   states.push_back(get_all(db, { 0x20 }));
+   for (int revision = 1; revision <= 4; ++revision) {
+      undo_stack.push();
+      write(revision);
+      write(revision + 10);
+      states.push_back(get_all(db, { 0x20 }));
+   }
+   uint64_t undo_bytes = 0;
+   for (auto& [k, v] : get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()).values) //
+      undo_bytes += v.size();
+
+   while (!states.empty()) {
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), states.back());
+      states.pop_back();
+      if (undo_stack.revision())
+         undo_stack.undo();
+   }
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 0);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{}));
+   return undo_bytes;
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_deltas) {
+   for (bool store_new_value : { false, true }) {
+      auto full = delta_undo_tests(false, store_new_value, 64 * 1024 * 1024, 256 * 1024 * 1024);
+      auto diff = delta_undo_tests(true, store_new_value, 64 * 1024 * 1024, 256 * 1024 * 1024);
+      BOOST_REQUIRE(diff * 4 < full * (store_new_value ? 3 : 1));
+      delta_undo_tests(true, store_new_value, 0, 0);
+      delta_undo_tests(true, store_new_value, 1000, 0);
+      delta_undo_tests(true, store_new_value, 1000, 3000, chain_kv::undo_codec::zlib);
+   }
+
+   // Format 2 segments stay readable after the upgrade
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+   {
+      chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 } };
+      chain_kv::write_session session{ db };
+      undo_stack.push();
+      session.set({ 0x20, 0x01 }, to_slice(bytes(100, 0x01)));
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 2);
+   }
+   chain_kv::undo_stack_config config;
+   config.delta_values = true;
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+   BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 3);
+   {
+      chain_kv::write_session session{ db };
+      undo_stack.push();
+      session.set({ 0x20, 0x01 }, to_slice(bytes(100, 0x02)));
+      session.write_changes(undo_stack);
+   }
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ { { { 0x20, 0x01 }, bytes(100, 0x01) } } }));
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), kv_values{});
+}
+
+// The undo segments after writing 200 keys
+kv_values encoded_segments(uint64_t target_segment_size, chain_kv::undo_codec codec, uint32_t encode_threads) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database          db{ "test-undo-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = target_segment_size;
+   config.codec               = codec;
+   config.encode_threads      = encode_threads;
+   chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 }, config };
+   chain_kv::write_session session{ db };
+   undo_stack.push();
+   for (int i = 0; i < 200; ++i)
+      session.set({ 0x20, (char)(i >> 4), (char)i }, to_slice(bytes(i % 13, (char)i)));
+   session.write_changes(undo_stack);
+   return get_all(db, { 0x10, (char)0x80 }, db.undo_column_family());
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_encode) {
+   streaming_undo_tests(0, 1, 0, chain_kv::undo_codec::none, true, false, 4);
+   streaming_undo_tests(1024 * 1024, 4, 100, chain_kv::undo_codec::zlib, false, false, 3);
+   streaming_undo_tests(1024 * 1024, 4, 100, chain_kv::undo_codec::zlib, true, true, 0);
+
+   for (auto codec : { chain_kv::undo_codec::none, chain_kv::undo_codec::zlib }) {
+      for (uint64_t target_segment_size : { 0, 100, 1000, 64 * 1024 * 1024 }) {
+         auto serial = encoded_segments(target_segment_size, codec, 1);
+         BOOST_REQUIRE(!serial.values.empty());
+         BOOST_REQUIRE_EQUAL(encoded_segments(target_segment_size, codec, 4), serial);
+         BOOST_REQUIRE_EQUAL(encoded_segments(target_segment_size, codec, 0), serial);
+      }
+   }
+
+   // Encoding reuses the database's workers instead of starting threads per revision
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database          db{ "test-undo-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = 100;
+   config.encode_threads      = 4;
+   chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 }, config };
+   chain_kv::write_session session{ db };
+   for (int revision = 0; revision < 5; ++revision) {
+      undo_stack.push();
+      for (int i = 0; i < 50; ++i)
+         session.set({ 0x20, (char)i }, to_slice(bytes(20, (char)revision)));
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE_EQUAL(db.parallel_workers->size(), 3);
+   }
+}
+
+// Checks get_at and history_iterator against the contents recorded after each revision
+void history_tests(bool store_new_value, bool delta_values, uint64_t target_segment_size) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database          db{ "test-undo-db", true };
+   chain_kv::undo_stack_config config;
+   config.target_segment_size = target_segment_size;
+   config.store_new_value     = store_new_value;
+   config.delta_values        = delta_values;
+   config.history_index       = true;
+   chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 }, config };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+
+   // Keys which are prefixes of each other and contain 0x00 exercise the index's key escaping
+   std::vector<bytes> keys{ { 0x01 }, { 0x01, 0x00 }, { 0x01, 0x00, 0x07 }, { 0x01, 0x01 }, { 0x02 } };
+   std::map<int64_t, kv_values> contents;
+   auto                         check_history = [&] {
+      for (auto revision = undo_stack.first_revision(); revision <= undo_stack.revision(); ++revision) {
+         kv_values values;
+         for (auto& k : keys)
+            if (auto v = view.get_at(undo_stack, revision, 0x1234, to_slice(k)))
+               values.values.push_back({ chain_kv::create_full_key(view.prefix, 0x1234, k), *v });
+         BOOST_REQUIRE_EQUAL(values, contents[revision]);
+
+         kv_values                          iterated;
+         chain_kv::view::history_iterator it{ view, undo_stack, revision, 0x1234, {} };
+         for (it.move_to_begin(); !it.is_end(); ++it) {
+            auto kv = it.get_kv();
+            iterated.values.push_back(
+                  { chain_kv::create_full_key(view.prefix, 0x1234, kv->key), chain_kv::to_bytes(kv->value) });
+         }
+         BOOST_REQUIRE_EQUAL(iterated, contents[revision]);
+
+         auto& expected = contents[revision].values;
+         auto  target   = chain_kv::create_full_key(view.prefix, 0x1234, bytes{ 0x01, 0x00, 0x01 });
+         auto  pos      = std::find_if(expected.begin(), expected.end(),
+                                       [&](auto& kv) { return chain_kv::compare_blob(kv.first, target) >= 0; });
+         it.lower_bound(to_slice({ 0x01, 0x00, 0x01 }));
+         BOOST_REQUIRE_EQUAL(it.is_end(), pos == expected.end());
+         if (!it.is_end())
+            BOOST_REQUIRE(target.size() - 3 + it.get_kv()->key.size() == pos->first.size() &&
+                          chain_kv::to_bytes(it.get_kv()->value) == pos->second);
+      }
+   };
+
+   auto change = [&](int round) {
+      for (size_t i = 0; i < keys.size(); ++i) {
+         auto r = (round * 7 + i * 3) % 5;
+         if (r == 0)
+            view.erase(0x1234, to_slice(keys[i]));
+         else if (r != 1) {
+            bytes value(40 + i, char(i));
+            value[round % value.size()] = char(round);
+            view.set(0x1234, to_slice(keys[i]), to_slice(value));
+         }
+      }
+   };
+
+   change(0);
+   session.write_changes(undo_stack);
+   contents[0] = get_all(db, { 0x70 });
+   for (int round = 1; round <= 8; ++round) {
+      undo_stack.push();
+      change(round);
+      session.write_changes(undo_stack);
+      change(round + 10);
+      session.write_changes(undo_stack);
+      contents[undo_stack.revision()] = get_all(db, { 0x70 });
+   }
+   check_history();
+
+   undo_stack.undo();
+   undo_stack.undo();
+   check_history();
+   undo_stack.push();
+   change(20);
+   session.write_changes(undo_stack);
+   contents[undo_stack.revision()] = get_all(db, { 0x70 });
+   check_history();
+
+   undo_stack.commit(3);
+   check_history();
+   KV_REQUIRE_EXCEPTION(undo_stack.get_at(2, to_slice({ 0x70 })), "undo_stack::get_at: revision is out of range");
+   KV_REQUIRE_EXCEPTION(undo_stack.get_at(8, to_slice({ 0x70 })), "undo_stack::get_at: revision is out of range");
+
+   undo_stack.squash();
+   contents[undo_stack.revision()] = contents[undo_stack.revision() + 1];
+   check_history();
+
+   undo_stack.commit(undo_stack.revision());
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x40 }, db.undo_column_family()), kv_values{});
+   check_history();
+
+   undo_stack.push();
+   change(30);
+   session.write_changes(undo_stack);
+   BOOST_REQUIRE(!get_all(db, { 0x10, 0x40 }, db.undo_column_family()).values.empty());
+   undo_stack.squash();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x40 }, db.undo_column_family()), kv_values{});
+   contents[undo_stack.revision()] = get_all(db, { 0x70 });
+   check_history();
+}
+
+BOOST_AUTO_TEST_CASE(test_history_index) {
+   history_tests(true, false, 64 * 1024 * 1024);
+   history_tests(false, false, 0);
+   history_tests(false, true, 64 * 1024 * 1024);
+   history_tests(false, true, 100);
+   history_tests(true, true, 0);
+
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database   db{ "test-undo-db", true };
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 } };
+   KV_REQUIRE_EXCEPTION(undo_stack.get_at(0, to_slice({ 0x70 })), "undo_stack::get_at: history_index isn't enabled");
+}
+
+BOOST_AUTO_TEST_CASE(test_revision_keys) {
+   boost::filesystem::remove_all("test-undo-db");
+   chain_kv::database db{ "test-undo-db", true };
+   auto               write = [&](chain_kv::undo_stack& undo_stack, char key, char value) {
+      chain_kv::write_session session{ db };
+      session.set({ 0x20, key }, to_slice({ value }));
+      session.write_changes(undo_stack);
+   };
+
+   // A format 2 stack upgrades in place
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 } };
+      for (char i = 1; i <= 3; ++i) {
+         undo_stack.push();
+         write(undo_stack, i, i);
+      }
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 2);
+   }
+   chain_kv::undo_stack_config config;
+   config.revision_keys = true;
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.format_version(), 4);
+      undo_stack.write_state();
+   }
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x01 }, db.undo_column_family()).values.size(), 3u);
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 3);
+      BOOST_REQUIRE_EQUAL(undo_stack.first_revision(), 0);
+      undo_stack.undo();
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ { { { 0x20, 0x01 }, { 0x01 } },  //
+                                                               { { 0x20, 0x02 }, { 0x02 } } } }));
+   }
+
+   // Unwritten pushes and squashes reach the revision keys with the next write
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      undo_stack.push(false);
+      undo_stack.push(false);
+      undo_stack.squash(false);
+      undo_stack.push(false);
+      write(undo_stack, 0x03, 0x33);
+      undo_stack.squash(false);
+      undo_stack.push(false);
+      undo_stack.push(false);
+      undo_stack.write_state();
+   }
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 5);
+      BOOST_REQUIRE_EQUAL(undo_stack.first_revision(), 0);
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x01 }, db.undo_column_family()).values.size(), 5u);
+      undo_stack.undo();
+      undo_stack.undo();
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ { { { 0x20, 0x01 }, { 0x01 } },  //
+                                                               { { 0x20, 0x02 }, { 0x02 } },
+                                                               { { 0x20, 0x03 }, { 0x33 } } } }));
+      undo_stack.commit(2);
+   }
+   {
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 3);
+      BOOST_REQUIRE_EQUAL(undo_stack.first_revision(), 2);
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x01 }, db.undo_column_family()).values.size(), 1u);
+   }
+
+   // Missing or stray revision keys are corruption, not a shorter stack
+   {
+      auto                revision_keys = get_all(db, { 0x10, 0x01 }, db.undo_column_family());
+      auto&               [key, count]  = revision_keys.values.at(0);
+      rocksdb::WriteBatch batch;
+      batch.Delete(db.undo_column_family(), to_slice(key));
+      db.write(batch);
+      KV_REQUIRE_EXCEPTION((chain_kv::undo_stack{ db, bytes{ 0x10 }, config }),
+                           "undo_stack::undo_stack: revision keys don't match the undo state");
+      auto stray = key;
+      ++stray.back();
+      batch.Put(db.undo_column_family(), to_slice(key), to_slice(count));
+      batch.Put(db.undo_column_family(), to_slice(stray), to_slice(count));
+      db.write(batch);
+      KV_REQUIRE_EXCEPTION((chain_kv::undo_stack{ db, bytes{ 0x10 }, config }),
+                           "undo_stack::undo_stack: revision keys don't match the undo state");
+      batch.Delete(db.undo_column_family(), to_slice(stray));
+      db.write(batch);
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+      BOOST_REQUIRE_EQUAL(undo_stack.first_revision(), 2);
+   }
+
+   // The state's size and the bytes written per revision don't depend on the stack's depth
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, config };
+   auto                 push_bytes = [&] {
+      auto before = chain_kv::get_metrics()[chain_kv::metric::db_write_bytes];
+      undo_stack.push();
+      undo_stack.squash();
+      undo_stack.push();
+      return chain_kv::get_metrics()[chain_kv::metric::db_write_bytes] - before;
+   };
+   auto state_size = get_all(db, { 0x10, 0x00 }, db.undo_column_family()).values.at(0).second.size();
+   auto shallow    = push_bytes();
+   for (int i = 0; i < 1000; ++i) {
+      undo_stack.push();
+      write(undo_stack, char(i), char(i));
+   }
+   BOOST_REQUIRE_EQUAL(push_bytes(), shallow);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x00 }, db.undo_column_family()).values.at(0).second.size(), state_size);
+   undo_stack.commit(undo_stack.revision());
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, 0x01 }, db.undo_column_family()), kv_values{});
+}
+
 BOOST_AUTO_TEST_CASE(test_undo) {
    undo_tests(false, 0);
    undo_tests(true, 0);
    undo_tests(false, 64 * 1024 * 1024);
    undo_tests(true, 64 * 1024 * 1024);
+   undo_tests(false, 0, {}, true);
+   undo_tests(true, 0, {}, true);
 }
 
 BOOST_AUTO_TEST_CASE(test_squash) {
@@ -445,6 +1157,8 @@ BOOST_AUTO_TEST_CASE(test_squash) {
    squash_tests(true, 0);
    squash_tests(false, 64 * 1024 * 1024);
    squash_tests(true, 64 * 1024 * 1024);
+   squash_tests(false, 0, {}, true);
+   squash_tests(true, 0, {}, true);
 }
 
 BOOST_AUTO_TEST_CASE(test_commit) {
@@ -452,6 +1166,59 @@ BOOST_AUTO_TEST_CASE(test_commit) {
    commit_tests(true, 0);
    commit_tests(false, 64 * 1024 * 1024);
    commit_tests(true, 64 * 1024 * 1024);
+   commit_tests(false, 0, {}, true);
+   commit_tests(true, 0, {}, true);
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_column_family) {
+   chain_kv::database_config db_config;
+   db_config.undo_column_family = true;
+   undo_tests(false, 0, db_config);
+   undo_tests(true, 64 * 1024 * 1024, db_config);
+   squash_tests(false, 0, db_config);
+   squash_tests(true, 64 * 1024 * 1024, db_config);
+   commit_tests(false, 0, db_config);
+   commit_tests(true, 64 * 1024 * 1024, db_config);
+   db_config.undo_blob_files = true;
+   undo_tests(true, 0, db_config);
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_column_family_migration) {
+   boost::filesystem::remove_all("test-undo-db");
+   {
+      chain_kv::database      db{ "test-undo-db", true };
+      chain_kv::undo_stack    undo_stack{ db, bytes{ 0x10 }, 0 };
+      chain_kv::write_session session{ db };
+      session.set({ 0x20, 0x01 }, to_slice({ 0x50 }));
+      session.write_changes(undo_stack);
+      undo_stack.push();
+      session.set({ 0x20, 0x01 }, to_slice({ 0x51 }));
+      session.set({ 0x20, 0x02 }, to_slice({ 0x52 }));
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE_NE(get_all(db, { 0x10, (char)0x80 }), (kv_values{}));
+   }
+
+   chain_kv::database_config db_config;
+   db_config.undo_column_family = true;
+   {
+      chain_kv::database db{ "test-undo-db", false, db_config };
+      BOOST_REQUIRE(db.undo_column_family() != db.rdb->DefaultColumnFamily());
+      chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, 0 };
+      BOOST_REQUIRE_EQUAL(undo_stack.revision(), 1);
+      BOOST_REQUIRE_EQUAL(get_all(db, { 0x10 }), (kv_values{})); // moved out of the default column family
+      BOOST_REQUIRE_NE(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{}));
+   }
+
+   // The undo column family is opened even if the config doesn't ask for it
+   chain_kv::database db{ "test-undo-db", false };
+   BOOST_REQUIRE(db.undo_column_family() != db.rdb->DefaultColumnFamily());
+   chain_kv::undo_stack undo_stack{ db, bytes{ 0x10 }, 0 };
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 0);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x20 }), (kv_values{ {
+                                                    { { 0x20, 0x01 }, { 0x50 } },
+                                              } }));
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x10, (char)0x80 }, db.undo_column_family()), (kv_values{}));
 }
 
 BOOST_AUTO_TEST_SUITE_END();
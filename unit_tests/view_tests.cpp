@@ -2,13 +2,14 @@
 #include <boost/filesystem.hpp>
 
 using chain_kv::bytes;
+using chain_kv::to_bytes;
 using chain_kv::to_slice;
 
 BOOST_AUTO_TEST_SUITE(view_tests)
 
-void view_test(bool reload_session) {
+void view_test(bool reload_session, const chain_kv::database_config& config = {}) {
    boost::filesystem::remove_all("test-write-session-db");
-   chain_kv::database                       db{ "test-write-session-db", true };
+   chain_kv::database                       db{ "test-write-session-db", true, config };
    chain_kv::undo_stack                     undo_stack{ db, { 0x10 } };
    std::unique_ptr<chain_kv::write_session> session;
    std::unique_ptr<chain_kv::view>          view;
@@ -208,9 +209,380 @@ void view_test(bool reload_session) {
    BOOST_REQUIRE_EQUAL(get_matching(*view, 0xf00df00d, { 0x20 }), get_matching2(*view, 0xf00df00d, { 0x20 }));
 } // view_test()
 
+BOOST_AUTO_TEST_CASE(test_view_get_many) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database      db{ "test-write-session-db", true };
+   chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+
+   view.set(0x1234, to_slice({ 0x30 }), to_slice({ 0x50 }));
+   view.set(0x5678, to_slice({ 0x30 }), to_slice({ 0x60 }));
+   session.write_changes(undo_stack);
+
+   bytes k1{ 0x30 }, k2{ 0x31 };
+   auto  values = view.get_many(0x1234, { to_slice(k1), to_slice(k2), to_slice(k1) });
+   BOOST_REQUIRE_EQUAL(values.size(), 3);
+   BOOST_REQUIRE(chain_kv::to_bytes(*values[0]) == (bytes{ 0x50 }));
+   BOOST_REQUIRE(!values[1]);
+   BOOST_REQUIRE(chain_kv::to_bytes(*values[2]) == (bytes{ 0x50 }));
+   values = view.get_many(0x5678, { to_slice(k1) });
+   BOOST_REQUIRE(chain_kv::to_bytes(*values[0]) == (bytes{ 0x60 }));
+}
+
+void async_read_test(uint32_t read_threads) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database_config config;
+   config.read_threads = read_threads;
+   config.async_io     = true;
+   chain_kv::database   db{ "test-write-session-db", true, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      for (char i = 0; i < 20; ++i) //
+         view.set(0x1234, to_slice({ 0x30, i }), to_slice({ char(0x50 + i) }));
+      session.write_changes(undo_stack);
+   }
+
+   chain_kv::write_session               session{ db };
+   chain_kv::view                        view{ session, bytes{ 0x70 } };
+   std::map<bytes, std::optional<bytes>> results;
+   auto                                  get = [&](bytes k) {
+      view.get_async(0x1234, to_slice(k), [&results, k](const auto& v) {
+         results[k] = v ? std::optional{ to_bytes(*v) } : std::nullopt;
+      });
+   };
+   for (char i = 0; i < 20; i += 2) //
+      get({ 0x30, i });
+   get({ 0x31 });
+   view.set(0x1234, to_slice({ 0x30, 0x01 }), to_slice({ 0x01 }));
+   get({ 0x30, 0x01 }); // Cached; completes immediately
+   BOOST_REQUIRE((results[bytes{ 0x30, 0x01 }] == bytes{ 0x01 }));
+   BOOST_REQUIRE_EQUAL(session.reads_in_flight(), 11u);
+   KV_REQUIRE_EXCEPTION(session.write_changes(undo_stack),
+                        "write_session::write_changes: asynchronous reads are in flight");
+
+   std::vector<std::optional<rocksdb::Slice>> many;
+   bytes                                      k1{ 0x30, 0x03 }, k2{ 0x32 };
+   view.get_many_async(0x1234, { to_slice(k1), to_slice(k2), to_slice(k1) }, [&](const auto& v) { many = v; });
+
+   chain_kv::view::iterator it{ view, 0x1234, {} };
+   bool                     moved = false;
+   it.lower_bound_async({ 0x30, 0x05 }, [&] {
+      moved = true;
+      // Callbacks may start more reads
+      get({ 0x30, 0x13 });
+   });
+
+   session.wait_for_reads();
+   BOOST_REQUIRE_EQUAL(session.reads_in_flight(), 0u);
+   BOOST_REQUIRE_EQUAL(session.complete_reads(), 0u);
+   for (char i = 0; i < 20; i += 2)
+      BOOST_REQUIRE((results[bytes{ 0x30, i }] == bytes{ char(0x50 + i) }));
+   BOOST_REQUIRE((results[bytes{ 0x30, 0x13 }] == bytes{ 0x63 }));
+   BOOST_REQUIRE(!results[bytes{ 0x31 }]);
+   BOOST_REQUIRE_EQUAL(many.size(), 3u);
+   BOOST_REQUIRE(to_bytes(*many[0]) == (bytes{ 0x53 }));
+   BOOST_REQUIRE(!many[1]);
+   BOOST_REQUIRE(to_bytes(*many[2]) == (bytes{ 0x53 }));
+   BOOST_REQUIRE(moved);
+   BOOST_REQUIRE(to_bytes(it.get_kv()->key) == (bytes{ 0x30, 0x05 }));
+   BOOST_REQUIRE(to_bytes(*view.get(0x1234, to_slice({ 0x30, 0x02 }))) == (bytes{ 0x52 }));
+
+   // The seek runs on the pool; the callback steps past keys the session erased
+   view.erase(0x1234, to_slice({ 0x30, 0x0a }));
+   it.lower_bound_async({ 0x30, 0x0a }, [] {});
+   BOOST_REQUIRE_EQUAL(session.reads_in_flight(), 1u);
+   session.wait_for_reads();
+   BOOST_REQUIRE(to_bytes(it.get_kv()->key) == (bytes{ 0x30, 0x0b }));
+
+   // A read sees changes the session made while it was in flight
+   get({ 0x30, 0x07 });
+   view.erase(0x1234, to_slice({ 0x30, 0x07 }));
+   while (session.reads_in_flight()) //
+      session.complete_reads(true);
+   BOOST_REQUIRE((!results[bytes{ 0x30, 0x07 }]));
+   session.write_changes(undo_stack);
+
+   // The session may be destroyed with reads in flight
+   chain_kv::write_session other{ db };
+   other.get_async(bytes{ 0x70 }, [](const auto&) { BOOST_FAIL("callback ran"); });
+}
+
+BOOST_AUTO_TEST_CASE(test_async_reads) {
+   async_read_test(0);
+   async_read_test(3);
+}
+
+BOOST_AUTO_TEST_CASE(test_iterator_reuse) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database      db{ "test-write-session-db", true };
+   chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+
+   view.set(0x1234, to_slice({ 0x30, 0x40 }), to_slice({ 0x50 }));
+   view.set(0x1234, to_slice({ 0x30, 0x41 }), to_slice({ 0x51 }));
+   session.write_changes(undo_stack);
+
+   kv_values expected{ {
+         { { 0x30, 0x40 }, { 0x50 } },
+         { { 0x30, 0x41 }, { 0x51 } },
+   } };
+   // One unbounded iterator found the sentinels; another is bounded to the range
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(session.iterator_pool.size(), 2);
+   BOOST_REQUIRE_EQUAL(session.sentinel_prefixes.size(), 1);
+   auto cache_size = session.cache.size();
+
+   // Repeat iterators reuse the rocksdb iterator and the sentinels
+   for (int i = 0; i < 10; ++i) {
+      BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), expected);
+      BOOST_REQUIRE_EQUAL(get_matching2(view, 0x1234), expected);
+   }
+   BOOST_REQUIRE_EQUAL(session.iterator_pool.size(), 2);
+   BOOST_REQUIRE_EQUAL(session.sentinel_prefixes.size(), 1);
+   BOOST_REQUIRE_EQUAL(session.cache.size(), cache_size);
+
+   // Another range shares the unbounded iterator, but needs its own bounded one
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1235), (kv_values{}));
+   BOOST_REQUIRE_EQUAL(session.iterator_pool.size(), 3);
+   BOOST_REQUIRE_EQUAL(session.sentinel_prefixes.size(), 2);
+
+   // Changes are visible to reused iterators
+   view.set(0x1234, to_slice({ 0x30, 0x42 }), to_slice({ 0x52 }));
+   view.erase(0x1234, to_slice({ 0x30, 0x40 }));
+   kv_values changed{ {
+         { { 0x30, 0x41 }, { 0x51 } },
+         { { 0x30, 0x42 }, { 0x52 } },
+   } };
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), changed);
+   BOOST_REQUIRE_EQUAL(get_matching2(view, 0x1234), changed);
+
+   // write_changes empties the pool; an iterator from before doesn't go back in
+   {
+      chain_kv::view::iterator it{ view, 0x1234, {} };
+      session.write_changes(undo_stack);
+      BOOST_REQUIRE(session.iterator_pool.empty());
+      BOOST_REQUIRE(session.sentinel_prefixes.empty());
+   }
+   BOOST_REQUIRE(session.iterator_pool.empty());
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), changed);
+   BOOST_REQUIRE_EQUAL(session.iterator_pool.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_key_buffer) {
+   // Short keys are built inline, long ones on the heap; both match create_full_key
+   for (size_t size : { 0, 10, 86, 87, 300 }) {
+      bytes                key(size, 0x42);
+      chain_kv::key_buffer k{ bytes{ 0x70 }, 0x1234, key };
+      BOOST_REQUIRE(to_slice(k) == to_slice(chain_kv::create_full_key(bytes{ 0x70 }, 0x1234, key)));
+   }
+
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database      db{ "test-write-session-db", true };
+   chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+   kv_values               expected;
+   for (size_t size : { 1, 100, 200 }) {
+      bytes key(size, 0x30);
+      view.set(0x1234, to_slice(key), to_slice({ char(size) }));
+      expected.values.push_back({ key, { char(size) } });
+   }
+   view.erase(0x1234, to_slice(bytes(300, 0x30)));
+   session.write_changes(undo_stack);
+
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), expected);
+   BOOST_REQUIRE(*view.get(0x1234, to_slice(bytes(200, 0x30))) == to_slice({ char(200) }));
+   auto values = view.get_many(0x1234, { to_slice(bytes(100, 0x30)), to_slice(bytes(101, 0x30)) });
+   BOOST_REQUIRE(*values[0] == to_slice({ 100 }));
+   BOOST_REQUIRE(!values[1]);
+   chain_kv::view::iterator it{ view, 0x1234, {} };
+   it.lower_bound(bytes(150, 0x30));
+   BOOST_REQUIRE_EQUAL(get_it(it), (kv_values{ { expected.values[2] } }));
+}
+
+kv_values scan(chain_kv::view& view, uint64_t contract, bool reverse) {
+   kv_values                     result;
+   chain_kv::view::scan_iterator it{ view, contract, {} };
+   for (reverse ? --it : ++it; !it.is_end(); reverse ? --it : ++it) {
+      auto kv = it.get_kv();
+      result.values.push_back({ chain_kv::to_bytes(kv->key), chain_kv::to_bytes(kv->value) });
+   }
+   if (reverse)
+      std::reverse(result.values.begin(), result.values.end());
+   return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_scan_iterator) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      for (char i = 0; i < 20; ++i)
+         view.set(0x1234, to_slice({ 0x30, i }), to_slice({ 0x50, i }));
+      view.set(0x1233, to_slice({ 0x30 }), to_slice({ 0x40 }));
+      view.set(0x1235, to_slice({ 0x30 }), to_slice({ 0x60 }));
+      session.write_changes(undo_stack);
+   }
+
+   // Without changes in range, scans don't touch the cache
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+   view.set(0x1235, to_slice({ 0x31 }), to_slice({ 0x61 }));
+   auto cache_size = session.cache.size();
+   auto expected   = scan(view, 0x1234, false);
+   BOOST_REQUIRE_EQUAL(expected.values.size(), 20);
+   BOOST_REQUIRE_EQUAL(scan(view, 0x1234, true), expected);
+   BOOST_REQUIRE_EQUAL(session.cache.size(), cache_size);
+   BOOST_REQUIRE_EQUAL(get_matching(view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(scan(view, 0x1235, false), (kv_values{ {
+                                                      { { 0x30 }, { 0x60 } },
+                                                      { { 0x31 }, { 0x61 } },
+                                                } }));
+
+   // Changes in range are merged in
+   view.erase(0x1234, to_slice({ 0x30, 0x00 }));
+   view.erase(0x1234, to_slice({ 0x30, 0x07 }));
+   view.set(0x1234, to_slice({ 0x30, 0x08 }), to_slice({ 0x01 }));
+   view.set(0x1234, to_slice({ 0x30, 0x40 }), to_slice({ 0x02 }));
+   view.set(0x1234, to_slice({ 0x20 }), to_slice({ 0x03 }));
+   expected = get_matching(view, 0x1234);
+   BOOST_REQUIRE_EQUAL(expected.values.size(), 20);
+   BOOST_REQUIRE_EQUAL(scan(view, 0x1234, false), expected);
+   BOOST_REQUIRE_EQUAL(scan(view, 0x1234, true), expected);
+
+   // Matches view::iterator behavior, including wrap-around
+   chain_kv::view::scan_iterator a{ view, 0x1234, {} };
+   chain_kv::view::iterator      b{ view, 0x1234, {} };
+   auto                          same = [&] {
+      BOOST_REQUIRE_EQUAL(a.is_end(), b.is_end());
+      if (!a.is_end())
+         BOOST_REQUIRE(chain_kv::to_bytes(a.get_kv()->key) == chain_kv::to_bytes(b.get_kv()->key));
+   };
+   for (auto& key : std::vector<bytes>{ {}, { 0x20 }, { 0x30 }, { 0x30, 0x07 }, { 0x30, 0x13 }, { 0x30, 0x41 } }) {
+      a.lower_bound(key);
+      b.lower_bound(key);
+      same();
+      for (int i = 0; i < 25; ++i) {
+         ++a;
+         ++b;
+         same();
+      }
+      for (int i = 0; i < 25; ++i) {
+         --a;
+         --b;
+         same();
+      }
+   }
+}
+
+void read_session_test(const chain_kv::database_config& config = {}) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true, config };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      for (char i = 0; i < 20; ++i)
+         view.set(0x1234, to_slice({ 0x30, i }), to_slice({ 0x50, i }));
+      view.set(0x1233, to_slice({ 0x30 }), to_slice({ 0x40 }));
+      view.set(0x1235, to_slice({ 0x30 }), to_slice({ 0x60 }));
+      session.write_changes(undo_stack);
+   }
+
+   chain_kv::read_session read_session{ db };
+   chain_kv::read_view    read_view{ read_session, bytes{ 0x70 } };
+   kv_values              expected;
+   for (char i = 0; i < 20; ++i) //
+      expected.values.push_back({ { 0x30, i }, { 0x50, i } });
+
+   // Later writes don't affect the snapshot
+   {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      view.erase(0x1234, to_slice({ 0x30, 0x05 }));
+      view.set(0x1234, to_slice({ 0x30, 0x40 }), to_slice({ 0x01 }));
+      session.write_changes(undo_stack);
+   }
+   BOOST_REQUIRE_EQUAL(get_matching(read_view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(get_matching2(read_view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(get_matching(read_view, 0x1234, { 0x30, 0x07 }), (kv_values{ { expected.values[7] } }));
+   BOOST_REQUIRE(read_view.get(0x1234, to_slice({ 0x30, 0x05 })) == (bytes{ 0x50, 0x05 }));
+   BOOST_REQUIRE(!read_view.get(0x1234, to_slice({ 0x30, 0x40 })));
+   auto values = read_view.get_many(0x1234, { to_slice({ 0x30, 0x05 }), to_slice({ 0x30, 0x40 }) });
+   BOOST_REQUIRE(values[0] == (bytes{ 0x50, 0x05 }));
+   BOOST_REQUIRE(!values[1]);
+
+   // Matches view::iterator behavior, including wrap-around
+   chain_kv::read_session current{ db };
+   chain_kv::read_view    current_view{ current, bytes{ 0x70 } };
+   chain_kv::write_session session{ db };
+   chain_kv::view          view{ session, bytes{ 0x70 } };
+   chain_kv::read_view::iterator a{ current_view, 0x1234, {} };
+   chain_kv::view::iterator      b{ view, 0x1234, {} };
+   auto                          same = [&] {
+      BOOST_REQUIRE_EQUAL(a.is_end(), b.is_end());
+      if (!a.is_end())
+         BOOST_REQUIRE(to_bytes(a.get_kv()->key) == to_bytes(b.get_kv()->key));
+   };
+   for (auto& key : std::vector<bytes>{ {}, { 0x20 }, { 0x30 }, { 0x30, 0x05 }, { 0x30, 0x13 }, { 0x30, 0x41 } }) {
+      a.lower_bound(key);
+      b.lower_bound(key);
+      same();
+      for (int i = 0; i < 25; ++i) {
+         ++a;
+         ++b;
+         same();
+      }
+      for (int i = 0; i < 25; ++i) {
+         --a;
+         --b;
+         same();
+      }
+   }
+   a.move_to_end();
+   BOOST_REQUIRE(a.is_end());
+
+   // Threads share a read_session. Boost.Test assertions aren't thread-safe, so the
+   // threads only report success.
+   std::vector<std::future<bool>> readers;
+   for (int t = 0; t < 4; ++t)
+      readers.push_back(std::async(std::launch::async, [&] {
+         bool ok = true;
+         for (int i = 0; i < 20; ++i) {
+            ok = ok && get_matching(read_view, 0x1234) == expected;
+            ok = ok && read_view.get(0x1233, to_slice({ 0x30 })) == (bytes{ 0x40 });
+         }
+         return ok;
+      }));
+   for (auto& r : readers) //
+      BOOST_REQUIRE(r.get());
+}
+
+BOOST_AUTO_TEST_CASE(test_read_session) { read_session_test(); }
+
 BOOST_AUTO_TEST_CASE(test_view) {
    view_test(false);
    view_test(true);
 }
 
+BOOST_AUTO_TEST_CASE(test_view_prefix_filters) {
+   chain_kv::database_config config;
+   config.bloom_bits_per_key               = 10;
+   config.view_prefix_size                 = 1;
+   config.memtable_prefix_bloom_size_ratio = 0.1;
+   view_test(false, config);
+   view_test(true, config);
+   read_session_test(config);
+
+   config.view_prefix_size = {};
+   KV_REQUIRE_EXCEPTION(view_test(false, config),
+                        "database::database: memtable_prefix_bloom_size_ratio requires view_prefix_size");
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -68,4 +68,532 @@ BOOST_AUTO_TEST_CASE(test_write_session) {
    write_session_test(true);
 }
 
+BOOST_AUTO_TEST_CASE(test_arena) {
+   chain_kv::arena a{ 1024 };
+   BOOST_REQUIRE_EQUAL(a.used(), 0);
+   BOOST_REQUIRE_EQUAL(a.reserved(), 0);
+
+   auto p1 = a.allocate(3, 1);
+   auto p2 = a.allocate(8, 8);
+   BOOST_REQUIRE_EQUAL(reinterpret_cast<uintptr_t>(p2) % 8, 0);
+   BOOST_REQUIRE(static_cast<char*>(p2) >= static_cast<char*>(p1) + 3);
+   BOOST_REQUIRE_EQUAL(a.reserved(), 1024);
+
+   // Large allocations get their own block
+   a.allocate(4096, 1);
+   BOOST_REQUIRE_EQUAL(a.reserved(), 1024 + 4096);
+   BOOST_REQUIRE_EQUAL(a.used(), 3 + 8 + 4096);
+
+   auto s = a.copy(to_slice({ 0x01, 0x02, 0x03 }));
+   BOOST_REQUIRE(chain_kv::to_bytes(s) == (bytes{ 0x01, 0x02, 0x03 }));
+   BOOST_REQUIRE(a.copy({}).empty());
+
+   a.clear();
+   BOOST_REQUIRE_EQUAL(a.used(), 0);
+   BOOST_REQUIRE_EQUAL(a.reserved(), 1024);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_session_wipe) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database      db{ "test-write-session-db", true };
+   chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+   chain_kv::write_session session{ db };
+
+   for (int i = 0; i < 1000; ++i) {
+      chain_kv::bytes key{ 0x20 };
+      chain_kv::append_key(key, uint32_t(i));
+      session.set(std::move(key), to_slice(chain_kv::bytes(i, char(i))));
+   }
+   BOOST_REQUIRE_GT(session.arena.used(), 0);
+   session.write_changes(undo_stack);
+   BOOST_REQUIRE(session.cache.empty());
+   BOOST_REQUIRE_EQUAL(session.arena.used(), 0);
+
+   for (int i = 0; i < 1000; ++i) {
+      chain_kv::bytes key{ 0x20 };
+      chain_kv::append_key(key, uint32_t(i));
+      auto value = session.get(std::move(key));
+      BOOST_REQUIRE(value);
+      BOOST_REQUIRE(chain_kv::to_bytes(*value) == chain_kv::bytes(i, char(i)));
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_get_result_lifetime) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database      db{ "test-write-session-db", true };
+   chain_kv::undo_stack    undo_stack{ db, { 0x10 } };
+   chain_kv::write_session session{ db };
+
+   session.set({ 0x20 }, to_slice({ 0x01, 0x02 }));
+   session.set({ 0x21 }, to_slice({}));
+   auto v1 = session.get({ 0x20 });
+   auto v2 = session.get({ 0x21 });
+   BOOST_REQUIRE(v1 && v2);
+   BOOST_REQUIRE(v2->empty());
+
+   // Values returned earlier stay valid when the key changes
+   session.set({ 0x20 }, to_slice({ 0x03 }));
+   session.erase({ 0x21 });
+   BOOST_REQUIRE(chain_kv::to_bytes(*v1) == (bytes{ 0x01, 0x02 }));
+   BOOST_REQUIRE(chain_kv::to_bytes(*session.get({ 0x20 })) == (bytes{ 0x03 }));
+   BOOST_REQUIRE(!session.get({ 0x21 }));
+   BOOST_REQUIRE(!session.get({ 0x22 }));
+}
+
+void get_many_test(bool reload_session) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database                       db{ "test-write-session-db", true };
+   chain_kv::undo_stack                     undo_stack{ db, { 0x10 } };
+   std::unique_ptr<chain_kv::write_session> session;
+
+   auto reload = [&] {
+      if (session && reload_session) {
+         session->write_changes(undo_stack);
+         session = nullptr;
+      }
+      if (!session)
+         session = std::make_unique<chain_kv::write_session>(db);
+   };
+   reload();
+
+   session->set({ 0x20 }, to_slice({ 0x01 }));
+   session->set({ 0x21 }, to_slice({ 0x02 }));
+   session->set({ 0x22 }, to_slice({}));
+   reload();
+   session->set({ 0x23 }, to_slice({ 0x03 }));
+   session->erase({ 0x21 });
+
+   std::vector<bytes> keys = {
+      { 0x23 }, { 0x22 }, { 0x21 }, { 0x30 }, { 0x20 }, { 0x22 }, { 0x30 }, { 0x20, 0x00 },
+   };
+   std::vector<rocksdb::Slice> slices;
+   for (auto& k : keys) slices.push_back(to_slice(k));
+
+   auto values = session->get_many(slices);
+   BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+   for (size_t i = 0; i < keys.size(); ++i) {
+      auto expected = session->get(bytes{ keys[i] });
+      BOOST_REQUIRE_EQUAL(bool(values[i]), bool(expected));
+      if (expected)
+         BOOST_REQUIRE(chain_kv::to_bytes(*values[i]) == chain_kv::to_bytes(*expected));
+   }
+   BOOST_REQUIRE(chain_kv::to_bytes(*values[0]) == (bytes{ 0x03 }));
+   BOOST_REQUIRE(values[1] && values[1]->empty());
+   BOOST_REQUIRE(!values[2]);
+   BOOST_REQUIRE(!values[3]);
+   BOOST_REQUIRE(chain_kv::to_bytes(*values[4]) == (bytes{ 0x01 }));
+   BOOST_REQUIRE(values[5] && values[5]->empty());
+   BOOST_REQUIRE(!values[6]);
+   BOOST_REQUIRE(!values[7]);
+   BOOST_REQUIRE(session->get_many({}).empty());
+} // get_many_test()
+
+BOOST_AUTO_TEST_CASE(test_get_many) {
+   get_many_test(false);
+   get_many_test(true);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_cache) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true, {}, {}, 1024 * 1024 };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   auto&                rc = *db.shared_read_cache;
+
+   std::vector<bytes> keys = { { 0x20 }, { 0x21 }, { 0x22 } };
+   {
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ 0x01 }));
+      session.set({ 0x21 }, to_slice({ 0x02 }));
+      session.write_changes(undo_stack);
+   }
+   {
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x01 } },
+                                                           { { 0x21 }, { 0x02 } },
+                                                     } }));
+   }
+   auto hits = rc.hits();
+   {
+      // Served from the read cache, including the missing key
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x01 } },
+                                                           { { 0x21 }, { 0x02 } },
+                                                     } }));
+   }
+   BOOST_REQUIRE_EQUAL(rc.hits(), hits + 3);
+
+   // Committed writes keep the cache coherent
+   undo_stack.push();
+   {
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ 0x11 }));
+      session.erase({ 0x21 });
+      session.set({ 0x22 }, to_slice({ 0x13 }));
+      session.write_changes(undo_stack);
+   }
+   {
+      chain_kv::write_session session{ db };
+      std::vector<rocksdb::Slice> slices;
+      for (auto& k : keys) slices.push_back(to_slice(k));
+      auto values = session.get_many(slices);
+      BOOST_REQUIRE(chain_kv::to_bytes(*values[0]) == (bytes{ 0x11 }));
+      BOOST_REQUIRE(!values[1]);
+      BOOST_REQUIRE(chain_kv::to_bytes(*values[2]) == (bytes{ 0x13 }));
+   }
+
+   // Undo invalidates
+   undo_stack.undo();
+   {
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x01 } },
+                                                           { { 0x21 }, { 0x02 } },
+                                                     } }));
+   }
+
+   // Eviction keeps the cache within budget
+   chain_kv::read_cache small{ 4096, 1 };
+   for (uint32_t i = 0; i < 100; ++i) {
+      bytes key;
+      chain_kv::append_key(key, i);
+      small.put(to_slice(key), to_slice(bytes(100, 'x')), small.begin_read(to_slice(key)));
+   }
+   BOOST_REQUIRE_LE(small.size(), 4096);
+   BOOST_REQUIRE_GT(small.size(), 0);
+
+   // A put racing with a write is dropped
+   auto generation = small.begin_read(to_slice({ 0x01 }));
+   small.erase(to_slice({ 0x01 }));
+   small.put(to_slice({ 0x01 }), to_slice({ 0x02 }), generation);
+   BOOST_REQUIRE(!small.get(to_slice({ 0x01 }), [](auto&) {}));
+}
+
+BOOST_AUTO_TEST_CASE(test_write_changes_async) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true, {}, {}, 1024 * 1024 };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+
+   std::vector<bytes>             keys = { { 0x20 }, { 0x21 }, { 0x22 } };
+   std::vector<std::future<void>> writes;
+   for (char i = 0; i < 10; ++i) {
+      undo_stack.push();
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ i }));
+      session.set({ 0x21 }, to_slice({ char(i + 1) }));
+      if (i % 2)
+         session.erase({ 0x22 });
+      else
+         session.set({ 0x22 }, to_slice({ char(i + 2) }));
+      writes.push_back(session.write_changes_async(undo_stack));
+   }
+   for (auto& w : writes) //
+      w.get();
+   BOOST_REQUIRE_EQUAL(undo_stack.revision(), 10);
+   {
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x09 } },
+                                                           { { 0x21 }, { 0x0a } },
+                                                     } }));
+   }
+
+   // Writes queued behind each other; undo waits for them
+   for (char i = 0; i < 3; ++i) {
+      undo_stack.push();
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ char(0x40 + i) }));
+      session.write_changes_async(undo_stack);
+   }
+   undo_stack.undo();
+   undo_stack.undo();
+   {
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x40 } },
+                                                           { { 0x21 }, { 0x0a } },
+                                                     } }));
+   }
+   for (int i = 0; i < 10; ++i) //
+      undo_stack.undo();
+   {
+      chain_kv::write_session session{ db };
+      BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                           { { 0x20 }, { 0x00 } },
+                                                           { { 0x21 }, { 0x01 } },
+                                                           { { 0x22 }, { 0x02 } },
+                                                     } }));
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_write_changes_async_reused_session) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true, {}, {}, 1024 * 1024 };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   std::vector<bytes>   keys = { { 0x20 } };
+   {
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ 0x00 }));
+      session.write_changes(undo_stack);
+   }
+
+   // Hold the writer thread, so the session's write is still queued when it reads again
+   chain_kv::write_session session{ db };
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ { { { 0x20 }, { 0x00 } } } }));
+   undo_stack.push();
+   std::promise<void> release;
+   auto               released = release.get_future();
+   db.write_async(rocksdb::WriteBatch{}, [&] { released.wait(); });
+   std::thread releaser{ [&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      release.set_value();
+   } };
+   session.set({ 0x20 }, to_slice({ 0x01 }));
+   auto first = session.write_changes_async(undo_stack);
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ { { { 0x20 }, { 0x01 } } } }));
+   releaser.join();
+
+   undo_stack.push();
+   session.set({ 0x20 }, to_slice({ 0x02 }));
+   session.write_changes_async(undo_stack).get();
+   first.get();
+
+   // Each revision's undo data holds the value the previous one wrote
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ { { { 0x20 }, { 0x01 } } } }));
+   undo_stack.undo();
+   session.wipe_cache();
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ { { { 0x20 }, { 0x00 } } } }));
+}
+
+void savepoint_test(bool blind_writes) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   {
+      chain_kv::write_session session{ db };
+      session.set({ 0x20 }, to_slice({ 0x01 }));
+      session.set({ 0x21 }, to_slice({ 0x02 }));
+      session.write_changes(undo_stack);
+   }
+   std::vector<bytes> keys      = { { 0x20 }, { 0x21 }, { 0x22 }, { 0x23 } };
+   auto               db_values = [&] {
+      chain_kv::write_session session{ db };
+      return get_values(session, keys);
+   };
+   auto original = db_values();
+
+   undo_stack.push();
+   chain_kv::write_session session{ db };
+   session.blind_writes = blind_writes;
+   session.set({ 0x20 }, to_slice({ 0x11 }));
+   auto outer = session.push_savepoint();
+   session.erase({ 0x21 });
+   session.set({ 0x22 }, to_slice({ 0x13 }));
+   auto after_outer = get_values(session, keys);
+
+   auto inner = session.push_savepoint();
+   session.set({ 0x20 }, to_slice({ 0x21 }));
+   session.set({ 0x21 }, to_slice({ 0x22 }));
+   session.erase({ 0x22 });
+   session.set({ 0x23 }, to_slice({ 0x24 }));
+   session.rollback_to(inner);
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), after_outer);
+   KV_REQUIRE_EXCEPTION(session.rollback_to(inner), "write_session::rollback_to: no such savepoint");
+
+   // Released changes are still covered by the outer savepoint
+   inner = session.push_savepoint();
+   session.set({ 0x23 }, to_slice({ 0x34 }));
+   session.release(inner);
+   KV_REQUIRE_EXCEPTION(session.release(inner), "write_session::release: no such savepoint");
+   BOOST_REQUIRE_EQUAL(get_values(session, keys).values.size(), 3);
+   session.rollback_to(outer);
+   BOOST_REQUIRE_EQUAL(get_values(session, keys), (kv_values{ {
+                                                         { { 0x20 }, { 0x11 } },
+                                                         { { 0x21 }, { 0x02 } },
+                                                   } }));
+
+   // Only changes which survived reach the database and the undo stack
+   outer = session.push_savepoint();
+   session.set({ 0x23 }, to_slice({ 0x44 }));
+   session.release(outer);
+   session.write_changes(undo_stack);
+   BOOST_REQUIRE_EQUAL(db_values(), (kv_values{ {
+                                       { { 0x20 }, { 0x11 } },
+                                       { { 0x21 }, { 0x02 } },
+                                       { { 0x23 }, { 0x44 } },
+                                 } }));
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(db_values(), original);
+} // savepoint_test()
+
+BOOST_AUTO_TEST_CASE(test_savepoints) {
+   savepoint_test(false);
+   savepoint_test(true);
+}
+
+BOOST_AUTO_TEST_CASE(test_fork_iteration) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   {
+      chain_kv::write_session session{ db };
+      chain_kv::view          view{ session, bytes{ 0x70 } };
+      for (char i = 0; i < 20; ++i)
+         view.set(0x1234, to_slice({ 0x30, i }), to_slice({ 0x50, i }));
+      view.set(0x1233, to_slice({ 0x30 }), to_slice({ 0x40 }));
+      view.set(0x1235, to_slice({ 0x30 }), to_slice({ 0x60 }));
+      session.write_changes(undo_stack);
+   }
+
+   // The fork sees the parent's uncommitted changes
+   chain_kv::write_session parent{ db };
+   chain_kv::view          parent_view{ parent, bytes{ 0x70 } };
+   parent_view.erase(0x1234, to_slice({ 0x30, 0x00 }));
+   parent_view.erase(0x1234, to_slice({ 0x30, 0x03 }));
+   parent_view.erase(0x1234, to_slice({ 0x30, 0x13 }));
+   parent_view.set(0x1234, to_slice({ 0x30, 0x05 }), to_slice({ 0x01 }));
+   parent_view.set(0x1234, to_slice({ 0x20 }), to_slice({ 0x02 }));
+   parent_view.set(0x1234, to_slice({ 0x30, 0x40 }), to_slice({ 0x03 }));
+   auto expected = get_matching(parent_view, 0x1234);
+   BOOST_REQUIRE_EQUAL(expected.values.size(), 19);
+
+   auto           child = parent.fork();
+   chain_kv::view child_view{ *child, bytes{ 0x70 } };
+   BOOST_REQUIRE_EQUAL(get_matching(child_view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(get_matching2(child_view, 0x1234), expected);
+   BOOST_REQUIRE_EQUAL(get_matching(child_view, 0x1233), (kv_values{ { { { 0x30 }, { 0x40 } } } }));
+   BOOST_REQUIRE_EQUAL(get_matching(child_view, 0x1235), (kv_values{ { { { 0x30 }, { 0x60 } } } }));
+   BOOST_REQUIRE(!child_view.get(0x1234, to_slice({ 0x30, 0x03 })));
+   BOOST_REQUIRE(*child_view.get(0x1234, to_slice({ 0x30, 0x05 })) == to_slice({ 0x01 }));
+
+   // Direction changes while stepping
+   chain_kv::view::iterator it{ child_view, 0x1234, {} };
+   for (auto& key : std::vector<bytes>{ {}, { 0x30, 0x03 }, { 0x30, 0x13 }, { 0x31 } }) {
+      it.lower_bound(key);
+      auto pos = std::lower_bound(expected.values.begin(), expected.values.end(), key,
+                                  [](auto& kv, auto& k) { return kv.first < k; }) -
+                 expected.values.begin();
+      for (int step : { 1, 1, -1, 1, -1, -1, -1, 1 }) {
+         if (step > 0) {
+            ++it;
+            pos = pos == (ptrdiff_t)expected.values.size() ? 0 : pos + 1;
+         } else {
+            --it;
+            pos = pos == 0 ? expected.values.size() : pos - 1;
+         }
+         BOOST_REQUIRE_EQUAL(it.is_end(), pos == (ptrdiff_t)expected.values.size());
+         if (!it.is_end())
+            BOOST_REQUIRE(chain_kv::to_bytes(it.get_kv()->key) == expected.values[pos].first);
+      }
+   }
+
+   // Changes in a fork of a fork don't affect its parent
+   auto           grandchild = child->fork();
+   chain_kv::view grandchild_view{ *grandchild, bytes{ 0x70 } };
+   grandchild_view.erase(0x1234, to_slice({ 0x20 }));
+   grandchild_view.set(0x1234, to_slice({ 0x30, 0x03 }), to_slice({ 0x04 }));
+   auto grandchild_expected = expected;
+   grandchild_expected.values.erase(grandchild_expected.values.begin());
+   grandchild_expected.values.insert(grandchild_expected.values.begin() + 2, { { 0x30, 0x03 }, { 0x04 } });
+   BOOST_REQUIRE_EQUAL(get_matching(grandchild_view, 0x1234), grandchild_expected);
+   BOOST_REQUIRE_EQUAL(get_matching2(grandchild_view, 0x1234), grandchild_expected);
+   BOOST_REQUIRE_EQUAL(get_matching(child_view, 0x1234), expected);
+
+   KV_REQUIRE_EXCEPTION(child->write_changes(undo_stack),
+                        "forked write_session can't write changes; merge it into its parent");
+}
+
+BOOST_AUTO_TEST_CASE(test_fork_merge) {
+   boost::filesystem::remove_all("test-write-session-db");
+   chain_kv::database   db{ "test-write-session-db", true };
+   chain_kv::undo_stack undo_stack{ db, { 0x10 } };
+   auto                 key = [](char i) { return bytes{ 0x70, 0, 0, 0, 0, 0, 0, 0, 1, i }; };
+   {
+      chain_kv::write_session session{ db };
+      for (char i = 0; i < 8; ++i) //
+         session.set(key(i), to_slice({ i }));
+      session.write_changes(undo_stack);
+   }
+   auto original = get_all(db, { 0x70 });
+
+   undo_stack.push();
+   chain_kv::write_session parent{ db };
+
+   std::vector<std::function<void(chain_kv::write_session&)>> transactions = {
+      // Reads 1, writes 2
+      [&](auto& s) { s.set(key(2), to_slice({ char((*s.get(key(1)))[0] + 0x10) })); },
+      // Reads 3, writes 4
+      [&](auto& s) { s.set(key(4), to_slice({ char((*s.get(key(3)))[0] + 0x10) })); },
+      // Reads 2: conflicts with the first
+      [&](auto& s) { s.set(key(5), to_slice({ char((*s.get(key(2)))[0] + 0x10) })); },
+      // Iterates through a range containing 2: conflicts with the first
+      [&](auto& s) {
+         chain_kv::view           view{ s, bytes{ 0x70 } };
+         chain_kv::view::iterator it{ view, 1, {} };
+         char                     sum = 0;
+         for (++it; !it.is_end(); ++it) //
+            sum += it.get_kv()->value[0];
+         s.set(key(6), to_slice({ sum }));
+      },
+      // Writes 2 without reading it: doesn't conflict, and replaces the first's value
+      [&](auto& s) {
+         s.set(key(2), to_slice({ 0x40 }));
+         s.erase(key(7));
+      },
+      // Changes 3
+      [&](auto& s) { s.set(key(3), to_slice({ 0x33 })); },
+      // Sets 3 to the value it started with: conflicts with the previous one, since running them
+      // in order would end with this value
+      [&](auto& s) { s.set(key(3), to_slice({ 0x03 })); },
+      // Creates 8
+      [&](auto& s) { s.set(key(8), to_slice({ 0x08 })); },
+      // Erases 8, which it sees as missing: conflicts with the previous one
+      [&](auto& s) { s.erase(key(8)); },
+   };
+
+   auto run = [&](std::vector<size_t> indexes) {
+      std::vector<std::unique_ptr<chain_kv::write_session>> forks;
+      std::vector<chain_kv::write_session*>                 ptrs;
+      std::vector<std::thread>                              threads;
+      for (size_t i = 0; i < indexes.size(); ++i) {
+         forks.push_back(parent.fork());
+         ptrs.push_back(forks.back().get());
+      }
+      for (size_t i = 0; i < indexes.size(); ++i)
+         threads.emplace_back([&, i] { transactions[indexes[i]](*forks[i]); });
+      for (auto& t : threads) //
+         t.join();
+      std::vector<size_t> result;
+      for (auto i : parent.merge(ptrs)) //
+         result.push_back(indexes[i]);
+      return result;
+   };
+
+   BOOST_REQUIRE(run({ 0, 1, 2, 3, 4 }) == (std::vector<size_t>{ 2, 3 }));
+   BOOST_REQUIRE(run({ 3, 2 }) == (std::vector<size_t>{}));
+   BOOST_REQUIRE(run({ 5, 6 }) == (std::vector<size_t>{ 6 }));
+   BOOST_REQUIRE(run({ 7, 8 }) == (std::vector<size_t>{ 8 }));
+
+   auto other = parent.fork();
+   KV_REQUIRE_EXCEPTION(chain_kv::write_session{ db }.merge({ other.get() }),
+                        "write_session::merge: session was not forked from this one");
+   other = nullptr;
+
+   parent.write_changes(undo_stack);
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), (kv_values{ {
+                                                  { key(0), { 0x00 } },
+                                                  { key(1), { 0x01 } },
+                                                  { key(2), { 0x40 } },
+                                                  { key(3), { 0x33 } },
+                                                  { key(4), { 0x13 } },
+                                                  { key(5), { 0x50 } },
+                                                  { key(6), { 0x62 } },
+                                                  { key(8), { 0x08 } },
+                                            } }));
+   undo_stack.undo();
+   BOOST_REQUIRE_EQUAL(get_all(db, { 0x70 }), original);
+}
+
 BOOST_AUTO_TEST_SUITE_END();